@@ -0,0 +1,436 @@
+// Microbenchmarks of the database operations.
+//
+// Each benchmark runs against a fresh database for every combination of table size, object
+// size and map mode given on the command line, and reports the mean time per operation.
+// Results are written as a text table, as JSON lines or as CSV, so that runs of different
+// builds can be compared by scripts.  Build with CMAKE_BUILD_TYPE=Release for meaningful numbers.
+
+#include <chainbase/chainbase.hpp>
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace chainbase;
+using namespace boost::multi_index;
+
+namespace {
+
+struct by_key;
+
+template<std::size_t PayloadSize>
+struct bench_object : public chainbase::object<0, bench_object<PayloadSize>> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( bench_object )
+
+   typename chainbase::object<0, bench_object>::id_type id;
+   uint64_t key = 0;
+   uint64_t value = 0;
+   char     payload[PayloadSize];
+};
+
+template<std::size_t PayloadSize>
+using bench_index = multi_index_container<
+   bench_object<PayloadSize>,
+   indexed_by<
+      ordered_unique< member<bench_object<PayloadSize>, typename bench_object<PayloadSize>::id_type, &bench_object<PayloadSize>::id> >,
+      ordered_unique< tag<by_key>, member<bench_object<PayloadSize>, uint64_t, &bench_object<PayloadSize>::key> >
+   >,
+   chainbase::node_allocator<bench_object<PayloadSize>>
+>;
+
+struct string_object : public chainbase::object<1, string_object> {
+   template<typename Constructor, typename Allocator>
+   string_object( Constructor&& c, Allocator&& a ) : value( a ) { c(*this); }
+
+   id_type       id;
+   shared_string value;
+};
+
+using string_index = multi_index_container<
+   string_object,
+   indexed_by<
+      ordered_unique< member<string_object, string_object::id_type, &string_object::id> >
+   >,
+   chainbase::node_allocator<string_object>
+>;
+
+}
+
+namespace chainbase {
+   template<std::size_t PayloadSize>
+   struct get_index_type<bench_object<PayloadSize>> { typedef bench_index<PayloadSize> type; };
+}
+CHAINBASE_SET_INDEX_TYPE( string_object, string_index )
+
+namespace {
+
+enum class output_format { text, json, csv };
+
+struct options {
+   std::vector<uint64_t>                              rows = { 10000, 100000 };
+   std::vector<std::size_t>                           object_sizes = { 16, 256 };
+   std::vector<pinnable_mapped_file::map_mode>        map_modes = { pinnable_mapped_file::mapped };
+   std::size_t                                        session_writes = 100;
+   std::size_t                                        string_size = 64;
+   std::string                                        filter;
+   output_format                                      format = output_format::text;
+   bfs::path                                          dir = bfs::temp_directory_path();
+};
+
+const char* to_string( pinnable_mapped_file::map_mode mode ) {
+   switch( mode ) {
+      case pinnable_mapped_file::mapped: return "mapped";
+      case pinnable_mapped_file::heap:   return "heap";
+      case pinnable_mapped_file::locked: return "locked";
+   }
+   return "unknown";
+}
+
+struct result {
+   std::string                    benchmark;
+   uint64_t                       rows;
+   std::size_t                    object_size;
+   pinnable_mapped_file::map_mode map_mode;
+   uint64_t                       ops;
+   std::chrono::nanoseconds       elapsed;
+
+   double ns_per_op()const { return ops ? double( elapsed.count() ) / ops : 0; }
+};
+
+class reporter {
+   public:
+      explicit reporter( output_format format ):_format( format ) {
+         if( _format == output_format::csv )
+            std::cout << "benchmark,rows,object_size,map_mode,ops,ns_per_op,ops_per_sec\n";
+         else if( _format == output_format::text )
+            std::cout << std::left << std::setw( 20 ) << "benchmark" << std::right << std::setw( 10 ) << "rows"
+                      << std::setw( 8 ) << "size" << std::setw( 8 ) << "mode" << std::setw( 10 ) << "ops"
+                      << std::setw( 14 ) << "ns/op" << std::setw( 14 ) << "ops/s" << "\n";
+      }
+
+      void report( const result& r ) {
+         double ops_per_sec = r.elapsed.count() ? r.ops * 1e9 / r.elapsed.count() : 0;
+         switch( _format ) {
+            case output_format::json:
+               std::cout << "{\"benchmark\":\"" << r.benchmark << "\",\"rows\":" << r.rows << ",\"object_size\":" << r.object_size
+                         << ",\"map_mode\":\"" << to_string( r.map_mode ) << "\",\"ops\":" << r.ops
+                         << ",\"ns_per_op\":" << r.ns_per_op() << ",\"ops_per_sec\":" << ops_per_sec << "}\n";
+               break;
+            case output_format::csv:
+               std::cout << r.benchmark << ',' << r.rows << ',' << r.object_size << ',' << to_string( r.map_mode ) << ','
+                         << r.ops << ',' << r.ns_per_op() << ',' << ops_per_sec << "\n";
+               break;
+            case output_format::text:
+               std::cout << std::left << std::setw( 20 ) << r.benchmark << std::right << std::setw( 10 ) << r.rows
+                         << std::setw( 8 ) << r.object_size << std::setw( 8 ) << to_string( r.map_mode ) << std::setw( 10 ) << r.ops
+                         << std::setw( 14 ) << std::fixed << std::setprecision( 1 ) << r.ns_per_op()
+                         << std::setw( 14 ) << std::setprecision( 0 ) << ops_per_sec << "\n";
+               break;
+         }
+         std::cout.flush();
+      }
+
+   private:
+      output_format _format;
+};
+
+// Removes a directory once the database inside it has been closed
+struct temp_directory {
+   bfs::path path;
+   ~temp_directory() { bfs::remove_all( path ); }
+};
+
+// Keeps the results of lookups alive, so that the compiler cannot drop them
+volatile uint64_t sink;
+
+template<std::size_t PayloadSize>
+class table_benchmarks {
+   public:
+      using object_type = bench_object<PayloadSize>;
+      using index_type = bench_index<PayloadSize>;
+      using id_type = typename object_type::id_type;
+
+      table_benchmarks( const options& opts, reporter& out, uint64_t rows, pinnable_mapped_file::map_mode mode )
+         : _opts( opts ), _out( out ), _rows( rows ), _mode( mode ),
+           _dir{ opts.dir / bfs::unique_path( "chainbase-bench-%%%%-%%%%-%%%%" ) },
+           _db( _dir.path, database::read_write, database_size( rows ), false, mode )
+      {
+         _db.add_index<index_type>();
+         _db.add_index<string_index>();
+         std::mt19937_64 rng( rows );
+         _order.resize( rows );
+         std::iota( _order.begin(), _order.end(), 0 );
+         std::shuffle( _order.begin(), _order.end(), rng );
+      }
+
+      void run() {
+         // Keys are even so that modify_key can move each object to an unused odd key, see below
+         measure( "emplace", _rows, [&] {
+            for( uint64_t i = 0; i < _rows; ++i ) {
+               _db.create<object_type>( [&]( object_type& obj ) {
+                  obj.key = 2 * _order[i];
+                  std::memset( obj.payload, 0, sizeof( obj.payload ) );
+               } );
+            }
+         } );
+         measure( "find_by_id", _rows, [&] {
+            uint64_t sum = 0;
+            for( uint64_t i : _order ) sum += _db.get<object_type>( id_type( i ) ).key;
+            sink = sum;
+         } );
+         measure( "find_by_key", _rows, [&] {
+            uint64_t sum = 0;
+            for( uint64_t i : _order ) sum += _db.get<object_type, by_key>( 2 * i ).value;
+            sink = sum;
+         } );
+         measure( "range_scan", _rows, [&] {
+            uint64_t sum = 0;
+            for( const object_type& obj : _db.get_index<index_type, by_key>() ) sum += obj.value;
+            sink = sum;
+         } );
+         measure( "range_scan_prefetch", _rows, [&] {
+            const auto& by_key_index = _db.get_index<index_type, by_key>();
+            uint64_t sum = 0;
+            by_key_index.for_each_in_range( by_key_index.begin(), by_key_index.end(), [&]( const object_type& obj ) { sum += obj.value; } );
+            sink = sum;
+         } );
+         measure( "modify_value", _rows, [&] {
+            for( uint64_t i : _order ) _db.modify( _db.get<object_type>( id_type( i ) ), []( object_type& obj ) { ++obj.value; } );
+         } );
+         // Each pass moves every key half way across the key range, which erases it from the
+         // tree and inserts it elsewhere.  The first pass moves to odd keys, which are unused,
+         // and the second back to the even keys emplace created.
+         measure( "modify_key", 2 * _rows, [&] {
+            for( uint64_t parity : { 1, 0 } ) {
+               for( uint64_t i : _order ) {
+                  _db.modify( _db.get<object_type>( id_type( i ) ), [&]( object_type& obj ) {
+                     obj.key = 2 * ( ( obj.key / 2 + _rows / 2 ) % _rows ) + parity;
+                  } );
+               }
+            }
+         } );
+         run_session_benchmarks();
+         run_string_benchmarks();
+         measure( "remove", _rows, [&] {
+            for( uint64_t i : _order ) _db.remove( _db.get<object_type>( id_type( i ) ) );
+         } );
+      }
+
+   private:
+      static uint64_t database_size( uint64_t rows ) {
+         // The size must be a multiple of 1 MiB
+         const uint64_t mib = 1024*1024;
+         return ( 64 + rows * ( sizeof( object_type ) + 512 ) * 3 / mib ) * mib;
+      }
+
+      template<typename F>
+      void measure( const char* name, uint64_t ops, F&& f ) {
+         if( _opts.filter.size() && std::string( name ).find( _opts.filter ) == std::string::npos ) {
+            // Benchmarks that populate or empty the table still have to run
+            if( std::strcmp( name, "emplace" ) != 0 && std::strcmp( name, "remove" ) != 0 ) return;
+            f();
+            return;
+         }
+         auto start = std::chrono::steady_clock::now();
+         f();
+         auto elapsed = std::chrono::steady_clock::now() - start;
+         _out.report( { name, _rows, PayloadSize, _mode, ops, std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ) } );
+      }
+
+      // Modifies session_writes objects, starting at position first of the random order
+      void write_objects( uint64_t& first ) {
+         for( std::size_t i = 0; i < _opts.session_writes; ++i, ++first ) {
+            _db.modify( _db.get<object_type>( id_type( _order[first % _rows] ) ), []( object_type& obj ) { ++obj.value; } );
+         }
+      }
+
+      // Each operation is one session that modifies session_writes objects
+      void run_session_benchmarks() {
+         const uint64_t sessions = std::max<uint64_t>( 1, std::min<uint64_t>( 1000, _rows / _opts.session_writes ) );
+         uint64_t next = 0;
+         measure( "session_push", sessions, [&] {
+            for( uint64_t i = 0; i < sessions; ++i ) _db.start_undo_session( true ).push();
+         } );
+         _db.commit( _db.revision() );
+         measure( "session_undo", sessions, [&] {
+            for( uint64_t i = 0; i < sessions; ++i ) {
+               auto session = _db.start_undo_session( true );
+               write_objects( next );
+               session.undo();
+            }
+         } );
+         measure( "session_squash", sessions, [&] {
+            auto outer = _db.start_undo_session( true );
+            for( uint64_t i = 0; i < sessions; ++i ) {
+               auto session = _db.start_undo_session( true );
+               write_objects( next );
+               session.squash();
+            }
+            outer.push();
+         } );
+         _db.commit( _db.revision() );
+         for( uint64_t i = 0; i < sessions; ++i ) {
+            auto session = _db.start_undo_session( true );
+            write_objects( next );
+            session.push();
+         }
+         const int64_t first = _db.revision() - sessions;
+         measure( "session_commit", sessions, [&] {
+            for( uint64_t i = 1; i <= sessions; ++i ) _db.commit( first + i );
+         } );
+      }
+
+      void run_string_benchmarks() {
+         const uint64_t count = std::min<uint64_t>( _rows, 100000 );
+         std::string data( _opts.string_size, 'x' );
+         measure( "string_create", count, [&] {
+            for( uint64_t i = 0; i < count; ++i ) {
+               _db.create<string_object>( [&]( string_object& obj ) { obj.value.assign( data.data(), data.size() ); } );
+            }
+         } );
+         measure( "string_copy", count - 1, [&] {
+            for( uint64_t i = 1; i < count; ++i ) {
+               const string_object& source = _db.get<string_object>( string_object::id_type( i - 1 ) );
+               _db.modify( _db.get<string_object>( string_object::id_type( i ) ), [&]( string_object& obj ) { obj.value = source.value; } );
+            }
+         } );
+         measure( "string_assign", count, [&] {
+            for( uint64_t i = 0; i < count; ++i ) {
+               data[i % data.size()] = 'a' + i % 26;
+               _db.modify( _db.get<string_object>( string_object::id_type( i ) ), [&]( string_object& obj ) { obj.value.assign( data.data(), data.size() ); } );
+            }
+         } );
+         measure( "string_compare", count - 1, [&] {
+            uint64_t equal = 0;
+            for( uint64_t i = 1; i < count; ++i ) {
+               equal += _db.get<string_object>( string_object::id_type( i - 1 ) ).value == _db.get<string_object>( string_object::id_type( i ) ).value;
+            }
+            sink = equal;
+         } );
+         const auto& strings = _db.get_index<string_index>();
+         while( !strings.indices().empty() ) _db.remove( *strings.indices().begin() );
+      }
+
+      const options&                 _opts;
+      reporter&                      _out;
+      uint64_t                       _rows;
+      pinnable_mapped_file::map_mode _mode;
+      temp_directory                 _dir;
+      database                       _db;
+      std::vector<uint64_t>          _order;
+};
+
+template<std::size_t PayloadSize>
+void run_table( const options& opts, reporter& out, uint64_t rows, pinnable_mapped_file::map_mode mode ) {
+   table_benchmarks<PayloadSize>( opts, out, rows, mode ).run();
+}
+
+using table_runner = void (*)( const options&, reporter&, uint64_t, pinnable_mapped_file::map_mode );
+
+table_runner runner_for_size( std::size_t object_size ) {
+   switch( object_size ) {
+      case 16:   return &run_table<16>;
+      case 64:   return &run_table<64>;
+      case 256:  return &run_table<256>;
+      case 1024: return &run_table<1024>;
+   }
+   throw std::invalid_argument( "unsupported object size " + std::to_string( object_size ) + ", use 16, 64, 256 or 1024" );
+}
+
+template<typename T, typename F>
+std::vector<T> parse_list( const std::string& arg, F&& parse ) {
+   std::vector<T> result;
+   std::stringstream in( arg );
+   for( std::string item; std::getline( in, item, ',' ); ) result.push_back( parse( item ) );
+   return result;
+}
+
+pinnable_mapped_file::map_mode parse_map_mode( const std::string& name ) {
+   if( name == "mapped" ) return pinnable_mapped_file::mapped;
+   if( name == "heap" ) return pinnable_mapped_file::heap;
+   if( name == "locked" ) return pinnable_mapped_file::locked;
+   throw std::invalid_argument( "unknown map mode " + name );
+}
+
+void usage( const char* name ) {
+   std::cerr << "usage: " << name << " [options]\n"
+             << "  --rows N[,N...]            table sizes (default 10000,100000)\n"
+             << "  --object-size N[,N...]     payload bytes per object: 16, 64, 256 or 1024 (default 16,256)\n"
+             << "  --map-mode M[,M...]        mapped, heap or locked (default mapped)\n"
+             << "  --session-writes N         objects modified by each session (default 100)\n"
+             << "  --string-size N            bytes per shared_cow_string (default 64)\n"
+             << "  --filter NAME              only report benchmarks whose name contains NAME\n"
+             << "  --format text|json|csv     output format (default text)\n"
+             << "  --dir PATH                 directory for the temporary databases (default the system temp directory)\n";
+}
+
+options parse_options( int argc, char** argv ) {
+   options opts;
+   auto to_u64 = []( const std::string& s ) { return std::stoull( s ); };
+   for( int i = 1; i < argc; ++i ) {
+      std::string arg = argv[i];
+      if( arg == "--help" || arg == "-h" ) {
+         usage( argv[0] );
+         std::exit( 0 );
+      }
+      if( i + 1 >= argc ) throw std::invalid_argument( "missing value for " + arg );
+      std::string value = argv[++i];
+      if( arg == "--rows" ) opts.rows = parse_list<uint64_t>( value, to_u64 );
+      else if( arg == "--object-size" ) opts.object_sizes = parse_list<std::size_t>( value, to_u64 );
+      else if( arg == "--map-mode" ) opts.map_modes = parse_list<pinnable_mapped_file::map_mode>( value, parse_map_mode );
+      else if( arg == "--session-writes" ) opts.session_writes = std::max<std::size_t>( 1, to_u64( value ) );
+      else if( arg == "--string-size" ) opts.string_size = std::max<std::size_t>( 1, to_u64( value ) );
+      else if( arg == "--filter" ) opts.filter = value;
+      else if( arg == "--dir" ) opts.dir = value;
+      else if( arg == "--format" ) {
+         if( value == "text" ) opts.format = output_format::text;
+         else if( value == "json" ) opts.format = output_format::json;
+         else if( value == "csv" ) opts.format = output_format::csv;
+         else throw std::invalid_argument( "unknown format " + value );
+      }
+      else throw std::invalid_argument( "unknown option " + arg );
+   }
+   for( std::size_t size : opts.object_sizes ) runner_for_size( size );
+   if( std::count( opts.rows.begin(), opts.rows.end(), 0 ) ) throw std::invalid_argument( "tables must have at least one row" );
+   return opts;
+}
+
+}
+
+int main( int argc, char** argv ) {
+   options opts;
+   try {
+      opts = parse_options( argc, argv );
+   } catch( const std::exception& e ) {
+      std::cerr << e.what() << "\n";
+      usage( argv[0] );
+      return 2;
+   }
+   reporter out( opts.format );
+   int status = 0;
+   for( pinnable_mapped_file::map_mode mode : opts.map_modes ) {
+      for( std::size_t size : opts.object_sizes ) {
+         for( uint64_t rows : opts.rows ) {
+            try {
+               runner_for_size( size )( opts, out, rows, mode );
+            } catch( const std::exception& e ) {
+               std::cerr << "rows " << rows << ", object size " << size << ", map mode " << to_string( mode ) << ": " << e.what() << "\n";
+               status = 1;
+            }
+         }
+      }
+   }
+   return status;
+}
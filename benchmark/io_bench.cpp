@@ -0,0 +1,412 @@
+// Benchmark of opening, preloading and saving a database in each map mode.
+//
+// For every combination of directory, database size and fill pattern given on the command line,
+// a database is created and filled in mapped mode and closed.  It is then reopened in each map
+// mode, and the benchmark reports the time to open it (which includes the preload in heap and
+// locked mode), the preload throughput, the latency of the first lookup and of a scan that
+// touches every row, the time to save it on close, and how much of the file is allocated on
+// disk afterwards.  The database is recreated for every map mode, so that the sparseness of the
+// file only reflects the mode that saved it.
+//
+// By default the databases are placed in the system temp directory and, when it exists, in
+// /dev/shm, to compare a local filesystem with tmpfs.  The page cache is dropped for the file
+// before it is opened unless --cache warm is given; this is best effort and has no effect on tmpfs.
+
+#include <chainbase/chainbase.hpp>
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+
+using namespace chainbase;
+using namespace boost::multi_index;
+
+namespace {
+
+struct io_object : public chainbase::object<0, io_object> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( io_object )
+
+   id_type  id;
+   uint64_t value = 0;
+   char     payload[240];
+};
+
+using io_index = multi_index_container<
+   io_object,
+   indexed_by<
+      ordered_unique< member<io_object, io_object::id_type, &io_object::id> >
+   >,
+   chainbase::node_allocator<io_object>
+>;
+
+}
+
+CHAINBASE_SET_INDEX_TYPE( io_object, io_index )
+
+namespace {
+
+// How the rows of the database are filled
+enum class fill_pattern {
+   random,     // every payload is random bytes
+   zeros,      // every payload is zero, so only the tree nodes and ids are non-zero
+   fragmented, // random payloads, and every other row is removed after filling
+};
+
+const char* to_string( fill_pattern pattern ) {
+   switch( pattern ) {
+      case fill_pattern::random:     return "random";
+      case fill_pattern::zeros:      return "zeros";
+      case fill_pattern::fragmented: return "fragmented";
+   }
+   return "unknown";
+}
+
+const char* to_string( pinnable_mapped_file::map_mode mode ) {
+   switch( mode ) {
+      case pinnable_mapped_file::mapped: return "mapped";
+      case pinnable_mapped_file::heap:   return "heap";
+      case pinnable_mapped_file::locked: return "locked";
+   }
+   return "unknown";
+}
+
+enum class output_format { text, json, csv };
+
+// A map mode to open the database with.  Locked mode is run once without and, if any are given,
+// once with the hugepage paths.
+struct open_mode {
+   pinnable_mapped_file::map_mode mode;
+   bool                           hugepages;
+
+   std::string name()const { return std::string( to_string( mode ) ) + ( hugepages ? "+huge" : "" ); }
+};
+
+struct options {
+   std::vector<bfs::path>                       dirs;
+   std::vector<uint64_t>                        sizes_mib = { 256 };
+   std::vector<fill_pattern>                    patterns = { fill_pattern::random };
+   std::vector<pinnable_mapped_file::map_mode>  map_modes = { pinnable_mapped_file::mapped, pinnable_mapped_file::heap };
+   std::vector<std::string>                     hugepage_paths;
+   unsigned                                     fill_percent = 50;
+   bool                                         cold = true;
+   output_format                                format = output_format::text;
+};
+
+struct result {
+   std::string  filesystem;
+   uint64_t     size_mib;
+   fill_pattern pattern;
+   std::string  mode;
+   uint64_t     rows;
+   double       fill_ms;
+   double       open_ms;
+   // Zero in mapped mode, which does not preload the file
+   double       preload_mib_per_sec;
+   double       first_touch_us;
+   double       scan_ms;
+   double       save_ms;
+   uint64_t     allocated_mib;
+   // The fraction of the file that is not allocated on disk
+   double       sparseness;
+};
+
+class reporter {
+   public:
+      explicit reporter( output_format format ):_format( format ) {
+         if( _format == output_format::csv )
+            std::cout << "filesystem,size_mib,pattern,map_mode,rows,fill_ms,open_ms,preload_mib_per_sec,first_touch_us,scan_ms,save_ms,allocated_mib,sparseness\n";
+         else if( _format == output_format::text )
+            std::cout << std::left << std::setw( 8 ) << "fs" << std::right << std::setw( 8 ) << "MiB" << std::setw( 12 ) << "pattern"
+                      << std::setw( 13 ) << "mode" << std::setw( 10 ) << "rows" << std::setw( 11 ) << "fill ms"
+                      << std::setw( 11 ) << "open ms" << std::setw( 11 ) << "MiB/s" << std::setw( 13 ) << "1st touch us"
+                      << std::setw( 11 ) << "scan ms" << std::setw( 11 ) << "save ms" << std::setw( 10 ) << "alloc MiB"
+                      << std::setw( 8 ) << "sparse" << "\n";
+      }
+
+      void report( const result& r ) {
+         switch( _format ) {
+            case output_format::json:
+               std::cout << "{\"filesystem\":\"" << r.filesystem << "\",\"size_mib\":" << r.size_mib << ",\"pattern\":\"" << to_string( r.pattern )
+                         << "\",\"map_mode\":\"" << r.mode << "\",\"rows\":" << r.rows << ",\"fill_ms\":" << r.fill_ms
+                         << ",\"open_ms\":" << r.open_ms << ",\"preload_mib_per_sec\":" << r.preload_mib_per_sec
+                         << ",\"first_touch_us\":" << r.first_touch_us << ",\"scan_ms\":" << r.scan_ms << ",\"save_ms\":" << r.save_ms
+                         << ",\"allocated_mib\":" << r.allocated_mib << ",\"sparseness\":" << r.sparseness << "}\n";
+               break;
+            case output_format::csv:
+               std::cout << r.filesystem << ',' << r.size_mib << ',' << to_string( r.pattern ) << ',' << r.mode << ',' << r.rows << ','
+                         << r.fill_ms << ',' << r.open_ms << ',' << r.preload_mib_per_sec << ',' << r.first_touch_us << ','
+                         << r.scan_ms << ',' << r.save_ms << ',' << r.allocated_mib << ',' << r.sparseness << "\n";
+               break;
+            case output_format::text:
+               std::cout << std::left << std::setw( 8 ) << r.filesystem << std::right << std::setw( 8 ) << r.size_mib
+                         << std::setw( 12 ) << to_string( r.pattern ) << std::setw( 13 ) << r.mode << std::setw( 10 ) << r.rows
+                         << std::fixed << std::setprecision( 1 ) << std::setw( 11 ) << r.fill_ms << std::setw( 11 ) << r.open_ms
+                         << std::setprecision( 0 ) << std::setw( 11 ) << r.preload_mib_per_sec
+                         << std::setprecision( 1 ) << std::setw( 13 ) << r.first_touch_us << std::setw( 11 ) << r.scan_ms
+                         << std::setw( 11 ) << r.save_ms << std::setw( 10 ) << r.allocated_mib
+                         << std::setprecision( 2 ) << std::setw( 8 ) << r.sparseness << "\n";
+               break;
+         }
+         std::cout.flush();
+      }
+
+   private:
+      output_format _format;
+};
+
+// Removes a directory once the database inside it has been closed
+struct temp_directory {
+   bfs::path path;
+   ~temp_directory() { bfs::remove_all( path ); }
+};
+
+// Keeps the results of lookups alive, so that the compiler cannot drop them
+volatile uint64_t sink;
+
+using bench_clock = std::chrono::steady_clock;
+
+double elapsed_ms( bench_clock::time_point start ) {
+   return std::chrono::duration<double, std::milli>( bench_clock::now() - start ).count();
+}
+
+std::string filesystem_name( const bfs::path& dir ) {
+#ifdef __linux__
+   struct statfs fs;
+   if( statfs( dir.c_str(), &fs ) == 0 && fs.f_type == 0x01021994 ) // TMPFS_MAGIC
+      return "tmpfs";
+#endif
+   return "local";
+}
+
+// Asks the kernel to drop the cached pages of the file
+void drop_page_cache( const bfs::path& file ) {
+#ifdef __linux__
+   int fd = ::open( file.c_str(), O_RDONLY );
+   if( fd < 0 ) return;
+   ::fdatasync( fd );
+   ::posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+   ::close( fd );
+#endif
+}
+
+uint64_t allocated_bytes( const bfs::path& file ) {
+   struct stat st;
+   if( ::stat( file.c_str(), &st ) != 0 ) return 0;
+   return uint64_t( st.st_blocks ) * 512;
+}
+
+class io_benchmark {
+   public:
+      io_benchmark( const options& opts, reporter& out, const bfs::path& dir, uint64_t size_mib, fill_pattern pattern )
+         : _opts( opts ), _out( out ), _root( dir ), _size_mib( size_mib ), _pattern( pattern ) {}
+
+      void run( const open_mode& mode ) {
+         temp_directory dir{ _root / bfs::unique_path( "chainbase-io-bench-%%%%-%%%%-%%%%" ) };
+         const bfs::path file = dir.path / "shared_memory.bin";
+         const uint64_t size = _size_mib * 1024 * 1024;
+
+         result r{ filesystem_name( _root ), _size_mib, _pattern, mode.name() };
+         auto start = bench_clock::now();
+         r.rows = fill( dir.path, size );
+         r.fill_ms = elapsed_ms( start );
+
+         if( _opts.cold ) drop_page_cache( file );
+         std::vector<std::string> hugepage_paths;
+         if( mode.hugepages ) hugepage_paths = _opts.hugepage_paths;
+         start = bench_clock::now();
+         auto db = std::make_unique<database>( dir.path, database::read_write, size, false, mode.mode, hugepage_paths );
+         r.open_ms = elapsed_ms( start );
+         if( mode.mode != pinnable_mapped_file::mapped && r.open_ms > 0 )
+            r.preload_mib_per_sec = _size_mib / ( r.open_ms / 1000 );
+         db->add_index<io_index>();
+
+         const auto& rows = db->get_index<io_index>().indices();
+         start = bench_clock::now();
+         const io_object* first = db->find<io_object>( io_object::id_type( r.rows / 2 | 1 ) );
+         r.first_touch_us = elapsed_ms( start ) * 1000;
+         sink = first ? first->value : 0;
+
+         start = bench_clock::now();
+         uint64_t sum = 0;
+         for( const io_object& obj : rows ) sum += obj.value + obj.payload[sizeof( obj.payload ) - 1];
+         r.scan_ms = elapsed_ms( start );
+         sink = sum;
+
+         // Dirty one row in sixteen, so that saving has pages to write back in mapped mode too
+         for( uint64_t id = 1; id < r.rows; id += 16 ) {
+            if( const io_object* obj = db->find<io_object>( io_object::id_type( id ) ) )
+               db->modify( *obj, []( io_object& o ) { ++o.value; } );
+         }
+
+         start = bench_clock::now();
+         db.reset();
+         r.save_ms = elapsed_ms( start );
+
+         uint64_t allocated = allocated_bytes( file );
+         r.allocated_mib = allocated / ( 1024 * 1024 );
+         r.sparseness = 1 - std::min( 1.0, double( allocated ) / size );
+         _out.report( r );
+      }
+
+   private:
+      // Creates the database in mapped mode and fills fill_percent of it.  Returns the id of the
+      // last row created plus one.
+      uint64_t fill( const bfs::path& dir, uint64_t size ) {
+         database db( dir, database::read_write, size );
+         db.add_index<io_index>();
+         const uint64_t target_free = db.get_free_memory() - db.get_free_memory() * std::min( _opts.fill_percent, 100u ) / 100;
+         std::mt19937_64 rng( size );
+         uint64_t rows = 0;
+         while( db.get_free_memory() > target_free + sizeof( io_object ) * 2 ) {
+            db.create<io_object>( [&]( io_object& obj ) {
+               obj.value = rows;
+               if( _pattern == fill_pattern::zeros ) {
+                  std::memset( obj.payload, 0, sizeof( obj.payload ) );
+               } else {
+                  for( std::size_t i = 0; i < sizeof( obj.payload ); i += sizeof( uint64_t ) ) {
+                     uint64_t bits = rng();
+                     std::memcpy( obj.payload + i, &bits, std::min( sizeof( bits ), sizeof( obj.payload ) - i ) );
+                  }
+               }
+            } );
+            ++rows;
+         }
+         if( _pattern == fill_pattern::fragmented ) {
+            for( uint64_t id = 0; id < rows; id += 2 ) db.remove( db.get<io_object>( io_object::id_type( id ) ) );
+         }
+         return rows;
+      }
+
+      const options& _opts;
+      reporter&      _out;
+      bfs::path      _root;
+      uint64_t       _size_mib;
+      fill_pattern   _pattern;
+};
+
+template<typename T, typename F>
+std::vector<T> parse_list( const std::string& arg, F&& parse ) {
+   std::vector<T> result;
+   std::stringstream in( arg );
+   for( std::string item; std::getline( in, item, ',' ); ) result.push_back( parse( item ) );
+   return result;
+}
+
+pinnable_mapped_file::map_mode parse_map_mode( const std::string& name ) {
+   if( name == "mapped" ) return pinnable_mapped_file::mapped;
+   if( name == "heap" ) return pinnable_mapped_file::heap;
+   if( name == "locked" ) return pinnable_mapped_file::locked;
+   throw std::invalid_argument( "unknown map mode " + name );
+}
+
+fill_pattern parse_pattern( const std::string& name ) {
+   if( name == "random" ) return fill_pattern::random;
+   if( name == "zeros" ) return fill_pattern::zeros;
+   if( name == "fragmented" ) return fill_pattern::fragmented;
+   throw std::invalid_argument( "unknown fill pattern " + name );
+}
+
+void usage( const char* name ) {
+   std::cerr << "usage: " << name << " [options]\n"
+             << "  --dir PATH[,PATH...]       directories for the temporary databases (default the system temp directory and /dev/shm)\n"
+             << "  --size MIB[,MIB...]        database sizes in MiB (default 256)\n"
+             << "  --fill PERCENT             how much of the database to fill with rows (default 50)\n"
+             << "  --pattern P[,P...]         random, zeros or fragmented (default random)\n"
+             << "  --map-mode M[,M...]        mapped, heap or locked (default mapped,heap)\n"
+             << "  --hugepage-path PATH       a hugetlbfs mount; locked mode is also run with the hugepage paths given\n"
+             << "  --cache cold|warm          drop the page cache for the file before opening it (default cold)\n"
+             << "  --format text|json|csv     output format (default text)\n";
+}
+
+options parse_options( int argc, char** argv ) {
+   options opts;
+   auto to_u64 = []( const std::string& s ) { return std::stoull( s ); };
+   for( int i = 1; i < argc; ++i ) {
+      std::string arg = argv[i];
+      if( arg == "--help" || arg == "-h" ) {
+         usage( argv[0] );
+         std::exit( 0 );
+      }
+      if( i + 1 >= argc ) throw std::invalid_argument( "missing value for " + arg );
+      std::string value = argv[++i];
+      if( arg == "--dir" ) opts.dirs = parse_list<bfs::path>( value, []( const std::string& s ) { return bfs::path( s ); } );
+      else if( arg == "--size" ) opts.sizes_mib = parse_list<uint64_t>( value, to_u64 );
+      else if( arg == "--fill" ) opts.fill_percent = std::min<uint64_t>( 100, to_u64( value ) );
+      else if( arg == "--pattern" ) opts.patterns = parse_list<fill_pattern>( value, parse_pattern );
+      else if( arg == "--map-mode" ) opts.map_modes = parse_list<pinnable_mapped_file::map_mode>( value, parse_map_mode );
+      else if( arg == "--hugepage-path" ) opts.hugepage_paths.push_back( value );
+      else if( arg == "--cache" ) {
+         if( value == "cold" ) opts.cold = true;
+         else if( value == "warm" ) opts.cold = false;
+         else throw std::invalid_argument( "unknown cache state " + value );
+      }
+      else if( arg == "--format" ) {
+         if( value == "text" ) opts.format = output_format::text;
+         else if( value == "json" ) opts.format = output_format::json;
+         else if( value == "csv" ) opts.format = output_format::csv;
+         else throw std::invalid_argument( "unknown format " + value );
+      }
+      else throw std::invalid_argument( "unknown option " + arg );
+   }
+   if( opts.dirs.empty() ) {
+      opts.dirs.push_back( bfs::temp_directory_path() );
+      if( bfs::is_directory( "/dev/shm" ) ) opts.dirs.push_back( "/dev/shm" );
+   }
+   if( std::count( opts.sizes_mib.begin(), opts.sizes_mib.end(), 0 ) ) throw std::invalid_argument( "databases must be at least 1 MiB" );
+   return opts;
+}
+
+}
+
+int main( int argc, char** argv ) {
+   options opts;
+   try {
+      opts = parse_options( argc, argv );
+   } catch( const std::exception& e ) {
+      std::cerr << e.what() << "\n";
+      usage( argv[0] );
+      return 2;
+   }
+   std::vector<open_mode> modes;
+   for( pinnable_mapped_file::map_mode mode : opts.map_modes ) {
+      modes.push_back( { mode, false } );
+      if( mode == pinnable_mapped_file::locked && opts.hugepage_paths.size() ) modes.push_back( { mode, true } );
+   }
+   reporter out( opts.format );
+   int status = 0;
+   for( const bfs::path& dir : opts.dirs ) {
+      for( uint64_t size : opts.sizes_mib ) {
+         for( fill_pattern pattern : opts.patterns ) {
+            io_benchmark bench( opts, out, dir, size, pattern );
+            for( const open_mode& mode : modes ) {
+               try {
+                  bench.run( mode );
+               } catch( const std::exception& e ) {
+                  std::cerr << dir.string() << ", " << size << " MiB, " << to_string( pattern ) << ", map mode " << mode.name() << ": " << e.what() << "\n";
+                  status = 1;
+               }
+            }
+         }
+      }
+   }
+   return status;
+}
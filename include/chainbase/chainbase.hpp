@@ -21,9 +21,16 @@
 
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <typeindex>
 #include <typeinfo>
 
@@ -31,6 +38,12 @@
 #include <chainbase/shared_cow_string.hpp>
 #include <chainbase/chainbase_node_allocator.hpp>
 #include <chainbase/undo_index.hpp>
+#include <chainbase/state_delta.hpp>
+#include <chainbase/snapshot.hpp>
+#include <chainbase/undo_spill.hpp>
+#include <chainbase/metrics.hpp>
+#include <chainbase/trace.hpp>
+#include <chainbase/epoch_lock.hpp>
 
 #ifndef CHAINBASE_NUM_RW_LOCKS
    #define CHAINBASE_NUM_RW_LOCKS 10
@@ -85,6 +98,9 @@ namespace chainbase {
          int64_t _id = 0;
    };
 
+   template<typename T>
+   constexpr bool is_saved_key<oid<T>> = true;
+
    template<uint16_t TypeNumber, typename Derived>
    struct object
    {
@@ -104,6 +120,20 @@ namespace chainbase {
    #define CHAINBASE_SET_INDEX_TYPE( OBJECT_TYPE, INDEX_TYPE )  \
    namespace chainbase { template<> struct get_index_type<OBJECT_TYPE> { typedef INDEX_TYPE type; }; }
 
+   /**
+    *  Enables the dense id table of undo_index for OBJECT_TYPE, see use_dense_id_table.
+    *  This macro must be used at global scope and OBJECT_TYPE must be fully qualified
+    */
+   #define CHAINBASE_USE_DENSE_ID_TABLE( OBJECT_TYPE ) \
+   namespace chainbase { template<> struct use_dense_id_table<OBJECT_TYPE> : std::true_type {}; }
+
+   /**
+    *  Records modifications of OBJECT_TYPE as byte diffs in the undo history, see use_diff_undo.
+    *  This macro must be used at global scope and OBJECT_TYPE must be fully qualified
+    */
+   #define CHAINBASE_USE_DIFF_UNDO( OBJECT_TYPE ) \
+   namespace chainbase { template<> struct use_diff_undo<OBJECT_TYPE> : std::true_type {}; }
+
    #define CHAINBASE_DEFAULT_CONSTRUCTOR( OBJECT_TYPE ) \
    template<typename Constructor, typename Allocator> \
    OBJECT_TYPE( Constructor&& c, Allocator&&  ) { c(*this); }
@@ -142,23 +172,29 @@ namespace chainbase {
          virtual void undo()             = 0;
    };
 
+   class abstract_index;
+
    template<typename SessionType>
    class session_impl : public abstract_session
    {
       public:
-         session_impl( SessionType&& s ):_session( std::move( s ) ){}
+         session_impl( SessionType&& s, const abstract_index& index ):_session( std::move( s ) ),_index( index ){}
 
          virtual void push() override  { _session.push();  }
-         virtual void squash() override{ _session.squash(); }
-         virtual void undo() override  { _session.undo();  }
+         virtual void squash() override;
+         virtual void undo() override;
       private:
-         SessionType _session;
+         SessionType           _session;
+         const abstract_index& _index;
    };
 
    class abstract_index
    {
       public:
-         abstract_index( void* i ):_idx_ptr(i){}
+         abstract_index( void* i ):_idx_ptr(i)
+         {
+            if( metrics_enabled ) _op_metrics.reset( new index_op_metrics );
+         }
          virtual ~abstract_index(){}
          virtual void     set_revision( uint64_t revision ) = 0;
          virtual unique_ptr<abstract_session> start_undo_session( bool enabled ) = 0;
@@ -170,14 +206,34 @@ namespace chainbase {
          virtual void    undo_all()const = 0;
          virtual uint32_t type_id()const  = 0;
          virtual uint64_t row_count()const = 0;
+         virtual std::size_t value_size()const = 0;
          virtual const std::string& type_name()const = 0;
          virtual std::pair<int64_t, int64_t> undo_stack_revision_range()const = 0;
-
+         virtual std::size_t undo_records_since( int64_t revision )const = 0;
+         virtual void        set_deferred_disposal( bool enabled )const = 0;
+         virtual std::size_t reclaim( std::size_t max_nodes )const = 0;
+         virtual std::size_t write_delta( delta_writer& out )const = 0;
+         virtual void        apply_delta( delta_reader& in )const = 0;
+         virtual uint64_t    next_id()const = 0;
+         virtual std::size_t write_snapshot_chunk( delta_writer& out, uint64_t begin_id, uint64_t end_id )const = 0;
+         virtual void        read_snapshot( snapshot_reader& in )const = 0;
+         virtual std::size_t spill( std::size_t keep )const = 0;
+         virtual void        unspill( std::size_t depth )const = 0;
+         virtual std::size_t spilled_sessions()const = 0;
+         // Pushes empty sessions until the index reaches revision
+         virtual void        extend_undo_stack( int64_t revision )const = 0;
+         virtual index_metrics metrics()const = 0;
+         virtual void        update_footer()const = 0;
+
+         virtual void set_spill_file( undo_spill_file* file ) = 0;
          virtual void remove_object( int64_t id ) = 0;
 
          void* get()const { return _idx_ptr; }
+         // nullptr unless CHAINBASE_ENABLE_METRICS is defined
+         index_op_metrics* op_metrics()const { return _op_metrics.get(); }
       private:
          void* _idx_ptr;
+         unique_ptr<index_op_metrics> _op_metrics;
    };
 
    template<typename BaseIndex>
@@ -186,26 +242,110 @@ namespace chainbase {
          index_impl( BaseIndex& base ):abstract_index( &base ),_base(base){}
 
          virtual unique_ptr<abstract_session> start_undo_session( bool enabled ) override {
-            return unique_ptr<abstract_session>(new session_impl<typename BaseIndex::session>( _base.start_undo_session( enabled ) ) );
+            return unique_ptr<abstract_session>(new session_impl<typename BaseIndex::session>( _base.start_undo_session( enabled ), *this ) );
          }
 
          virtual void     set_revision( uint64_t revision ) override { _base.set_revision( revision ); }
          virtual int64_t  revision()const  override { return _base.revision(); }
-         virtual void     undo()const  override { _base.undo(); }
-         virtual void     squash()const  override { _base.squash(); }
-         virtual void     commit( int64_t revision )const  override { _base.commit(revision); }
-         virtual void     undo_all() const override {_base.undo_all(); }
+         virtual void     undo()const  override { CHAINBASE_TIME_OP( *op_metrics(), undo ); unspill( 1 ); _base.undo(); }
+         virtual void     squash()const  override { CHAINBASE_TIME_OP( *op_metrics(), squash ); unspill( 2 ); _base.squash(); }
+         virtual void     commit( int64_t revision )const  override { CHAINBASE_TIME_OP( *op_metrics(), commit ); _base.commit(revision); }
+         virtual void     undo_all() const override {
+            while( _base.revision() > _base.undo_stack_revision_range().first ) undo();
+         }
+         virtual void     extend_undo_stack( int64_t revision )const override {
+            while( _base.revision() < revision ) _base.start_undo_session( true ).push();
+         }
          virtual uint32_t type_id()const override { return BaseIndex::value_type::type_id; }
          virtual uint64_t row_count()const override { return _base.indices().size(); }
+         virtual std::size_t value_size()const override { return sizeof( typename BaseIndex::value_type ); }
          virtual const std::string& type_name() const override { return BaseIndex_name; }
          virtual std::pair<int64_t, int64_t> undo_stack_revision_range()const override { return _base.undo_stack_revision_range(); }
+         virtual std::size_t undo_records_since( int64_t revision )const override { return _base.undo_records_since( revision ); }
+         virtual void        set_deferred_disposal( bool enabled )const override { _base.set_deferred_disposal( enabled ); }
+         virtual std::size_t reclaim( std::size_t max_nodes )const override { return _base.reclaim( max_nodes ); }
+         virtual std::size_t write_delta( delta_writer& out )const override {
+            if constexpr( has_object_serializer<typename BaseIndex::value_type> ) {
+               return write_index_delta( out, _base );
+            } else {
+               auto delta = _base.last_undo_session();
+               if( delta.new_values.empty() && delta.old_values.empty() && delta.removed_values.empty() ) return 0;
+               BOOST_THROW_EXCEPTION( std::logic_error( "no object_serializer for " + BaseIndex_name ) );
+            }
+         }
+         virtual void apply_delta( delta_reader& in )const override {
+            if constexpr( has_object_serializer<typename BaseIndex::value_type> ) apply_index_delta( in, _base );
+            else BOOST_THROW_EXCEPTION( std::logic_error( "no object_serializer for " + BaseIndex_name ) );
+         }
+         virtual uint64_t next_id()const override { return id_to_index( _base.next_id() ); }
+         // Snapshots must not depend on the memory layout of the objects
+         virtual std::size_t write_snapshot_chunk( delta_writer& out, uint64_t begin_id, uint64_t end_id )const override {
+            if constexpr( has_portable_serializer<typename BaseIndex::value_type> ) return chainbase::write_snapshot_chunk( out, _base, begin_id, end_id );
+            else BOOST_THROW_EXCEPTION( std::logic_error( "no specialized object_serializer for " + BaseIndex_name ) );
+         }
+         virtual void read_snapshot( snapshot_reader& in )const override {
+            if constexpr( has_portable_serializer<typename BaseIndex::value_type> ) read_snapshot_index( in, _base );
+            else BOOST_THROW_EXCEPTION( std::logic_error( "no specialized object_serializer for " + BaseIndex_name ) );
+         }
+         // Indices without an object_serializer keep their undo history in memory
+         virtual std::size_t spill( std::size_t keep )const override {
+            if constexpr( has_object_serializer<typename BaseIndex::value_type> ) {
+               return _base.spill( keep, [&]( const typename BaseIndex::spilled_records& records ) {
+                  std::vector<char> data;
+                  delta_writer out( data );
+                  write_spilled_session<BaseIndex>( out, records );
+                  return _spill_file->append( data );
+               } );
+            } else {
+               return 0;
+            }
+         }
+         virtual void unspill( std::size_t depth )const override {
+            _base.unspill( depth, [&]( int64_t location, typename BaseIndex::spill_loader& loader ) {
+               if( !_spill_file )
+                  BOOST_THROW_EXCEPTION( std::logic_error( "the undo history of " + BaseIndex_name + " has been spilled, but no spill file is set" ) );
+               if constexpr( has_object_serializer<typename BaseIndex::value_type> ) {
+                  std::vector<char> data = _spill_file->read( location );
+                  delta_reader in( data.data(), data.size() );
+                  read_spilled_session<BaseIndex>( in, loader );
+               }
+            } );
+         }
+         virtual std::size_t spilled_sessions()const override { return _base.spilled_sessions(); }
+         virtual index_metrics metrics()const override {
+            index_metrics result;
+            result.type_name = BaseIndex_name;
+            result.type_id = type_id();
+            result.row_count = row_count();
+            for( std::size_t height : _base.tree_heights() ) result.tree_heights.push_back( height );
+            auto [first, last] = _base.undo_stack_revision_range();
+            result.undo_sessions = last - first;
+            result.spilled_sessions = _base.spilled_sessions();
+            auto lists = _base.undo_lists_size();
+            result.old_values = lists.old_values;
+            result.removed_values = lists.removed_values;
+            result.diff_values = lists.diff_values;
+            if( const index_op_metrics* ops = op_metrics() ) {
+               for( std::size_t i = 0; i < index_op_count; ++i ) result.ops[i] = (*ops)[index_op( i )].snapshot();
+            }
+            return result;
+         }
 
+         virtual void        update_footer()const override { _base.update_footer(); }
+
+         virtual void     set_spill_file( undo_spill_file* file ) override { _spill_file = file; }
          virtual void     remove_object( int64_t id ) override { return _base.remove_object( id ); }
       private:
          BaseIndex& _base;
+         undo_spill_file* _spill_file = nullptr;
          std::string BaseIndex_name = boost::core::demangle( typeid( typename BaseIndex::value_type ).name() );
    };
 
+   template<typename SessionType>
+   void session_impl<SessionType>::squash() { CHAINBASE_TIME_OP( *_index.op_metrics(), squash ); _index.unspill( 2 ); _session.squash(); }
+   template<typename SessionType>
+   void session_impl<SessionType>::undo() { CHAINBASE_TIME_OP( *_index.op_metrics(), undo ); _index.unspill( 1 ); _session.undo(); }
+
    template<typename IndexType>
    class index : public index_impl<IndexType> {
       public:
@@ -245,6 +385,48 @@ namespace chainbase {
    };
 
 
+   /**
+    *  A fixed set of threads that runs batches of independent tasks.  The calling
+    *  thread takes part in each batch, which is intended for a small number of
+    *  coarse tasks such as one per index.
+    */
+   class worker_pool
+   {
+      public:
+         explicit worker_pool( unsigned num_threads );
+         ~worker_pool();
+         worker_pool( const worker_pool& ) = delete;
+         worker_pool& operator=( const worker_pool& ) = delete;
+
+         unsigned size()const { return _threads.size(); }
+
+         /**
+          * Calls f(i) for every i in [0, n) and returns once all of them have finished.
+          * If any call throws, the first exception is rethrown after the batch completes.
+          */
+         void run( std::size_t n, const std::function<void(std::size_t)>& f );
+
+      private:
+         void stop();
+         void work();
+         void drain( std::unique_lock<std::mutex>& lock, uint64_t generation );
+
+         std::vector<std::thread>                                    _threads;
+         std::mutex                                                  _mutex;
+         std::condition_variable                                     _start;
+         std::condition_variable                                     _finished;
+         const std::function<void(std::size_t)>*                    _task = nullptr;
+         std::size_t                                                 _task_count = 0;
+         std::size_t                                                 _next_task = 0;
+         std::size_t                                                 _done_count = 0;
+         uint64_t                                                    _generation = 0;
+         std::exception_ptr                                          _error;
+         bool                                                        _stop = false;
+   };
+
+   template<typename... MultiIndexTypes>
+   class typed_database;
+
    /**
     *  This class
     */
@@ -286,62 +468,333 @@ namespace chainbase {
 
          struct session {
             public:
-               session( session&& s ):_index_sessions( std::move(s._index_sessions) ){}
+               session( session&& s ):_index_sessions( std::move(s._index_sessions) ),_db( s._db ),_lazy( s._lazy )
+               {
+                  s._lazy = false;
+               }
                session( vector<std::unique_ptr<abstract_session>>&& s ):_index_sessions( std::move(s) )
                {
                }
 
-               ~session() {
-                  undo();
-               }
+               // Undoes the session.  If a spilled session cannot be reloaded, the error is
+               // logged and the session is left on the undo stack, as if it had been pushed.
+               ~session();
 
                void push()
                {
                   for( auto& i : _index_sessions ) i->push();
                   _index_sessions.clear();
+                  _lazy = false;
                }
 
                void squash()
                {
+                  if( _lazy ) {
+                     _lazy = false;
+                     return _db->squash();
+                  }
+                  if( is_committed() ) return push();
+                  if( _db ) _db->unspill( 2 );
+                  if( _db && _db->_trace ) _db->_trace->squash();
                   for( auto& i : _index_sessions ) i->squash();
                   _index_sessions.clear();
                }
 
                void undo()
                {
+                  if( _lazy ) {
+                     _lazy = false;
+                     return _db->undo();
+                  }
+                  if( _index_sessions.empty() ) return;
+                  if( is_committed() ) return push();
+                  if( _db ) _db->unspill( 1 );
+                  if( _db && _db->_trace ) _db->_trace->undo();
                   for( auto& i : _index_sessions ) i->undo();
                   _index_sessions.clear();
+                  if( _db ) _db->release_undone_pins();
                }
 
             private:
                friend class database;
                session(){}
+               // A commit that is deferred by a pin leaves committed sessions on the undo stack
+               bool is_committed()const { return _db && _db->is_committed( _db->revision() ); }
 
                vector< std::unique_ptr<abstract_session> > _index_sessions;
+               database*                                   _db = nullptr;
+               bool                                        _lazy = false; // see set_lazy_sessions
+         };
+
+      private:
+         struct revision_pins;
+      public:
+
+         /**
+          *  Keeps a revision readable through find_at_revision until it is destroyed.  While a revision
+          *  is pinned, commit leaves it on the undo stack, so that readers can reconstruct the objects as
+          *  of that revision from the undo history while the writer applies new sessions.  An undo past
+          *  the pinned revision releases the pin.
+          *
+          *  Pins can be created and destroyed from any thread.  Each read must still be serialized with
+          *  the writer, e.g. by the shared lock of a reader from make_reader, but a series of reads
+          *  through a pin sees one revision even if the writer makes changes in between.  Pins must
+          *  not outlive the database, which commits the sessions that were only kept for pins when
+          *  it is closed.
+          *
+          *  Historical reads are not available for types that use_diff_undo, whose undo records
+          *  hold the changed bytes rather than whole objects.
+          */
+         class revision_pin {
+            public:
+               revision_pin( revision_pin&& other );
+               revision_pin& operator=( revision_pin&& ) = delete;
+               ~revision_pin();
+
+               int64_t revision()const { return _revision; }
+               // Returns false once the pinned revision has been undone
+               bool valid()const;
+
+            private:
+               friend class database;
+               revision_pin( revision_pins& pins, uint64_t id, int64_t revision ):_pins( &pins ),_id( id ),_revision( revision ){}
+
+               revision_pins* _pins;
+               uint64_t       _id;
+               int64_t        _revision;
          };
 
+         /**
+          * Pins revision, which must be within the undo stack revision range.
+          */
+         revision_pin pin_revision( int64_t revision )const;
+         revision_pin pin_revision()const { return pin_revision( revision() ); }
+
+         /**
+          * Returns the object as it was at the pinned revision, see undo_index::find_at_revision.
+          */
+         template<typename ObjectType>
+         const ObjectType* find_at_revision( const revision_pin& pin, const oid<ObjectType>& key )const
+         {
+             CHAINBASE_REQUIRE_READ_LOCK("find_at_revision", ObjectType);
+             if( !pin.valid() )
+                BOOST_THROW_EXCEPTION( std::logic_error( "the pinned revision has been undone" ) );
+             typedef typename get_index_type< ObjectType >::type index_type;
+             const auto& idx = get_index< index_type >();
+             // An index that was not written to by lazy sessions has not changed since its revision
+             return idx.find_at_revision( key, std::min( pin.revision(), idx.revision() ) );
+         }
+
+         /**
+          * Calls f( const ObjectType& ) for every object that existed at the pinned revision, in id order,
+          * see undo_index::for_each_at_revision.
+          */
+         template<typename ObjectType, typename F>
+         void for_each_at_revision( const revision_pin& pin, F&& f )const
+         {
+             CHAINBASE_REQUIRE_READ_LOCK("for_each_at_revision", ObjectType);
+             if( !pin.valid() )
+                BOOST_THROW_EXCEPTION( std::logic_error( "the pinned revision has been undone" ) );
+             typedef typename get_index_type< ObjectType >::type index_type;
+             const auto& idx = get_index< index_type >();
+             idx.for_each_at_revision( std::min( pin.revision(), idx.revision() ), std::forward<F>( f ) );
+         }
+
          session start_undo_session( bool enabled );
 
          int64_t revision()const {
+             if( _lazy_sessions ) return _lazy_revision;
              if( _index_list.size() == 0 ) return -1;
              return _index_list[0]->revision();
          }
 
+         /**
+          * When enabled, start_undo_session only advances the revision of the database, and an
+          * index joins the session on its first write.  Undo and squash only visit the indices
+          * that were written to since lazy sessions were enabled, so the cost of a session does
+          * not depend on the number of indices.  Commit does the same once every index has been
+          * committed up to the revision at which lazy sessions were enabled.
+          *
+          * The undo stack of an index that was not written to stops at the revision of its last
+          * write; use undo_stack_revision_range of the database, or sync_undo_stacks, to get a
+          * consistent view.  Writes must go through the database, or through an index returned
+          * by get_mutable_index after the session was started.  Disabling lazy sessions, and
+          * closing the database, brings every index up to the current revision.
+          */
+         void set_lazy_sessions( bool enabled );
+         // Pushes empty sessions onto the indices that were not written to by lazy sessions
+         void sync_undo_stacks();
+         /**
+          * The first revision is the oldest one that undo can return to.  Sessions at or below the
+          * last commit may still be on the undo stacks, for pins or for indices that lazy sessions
+          * did not write to, but undo does not undo them.
+          */
+         std::pair<int64_t, int64_t> undo_stack_revision_range()const {
+             if( _index_list.size() == 0 ) return { -1, -1 };
+             const int64_t first = _index_list[0]->undo_stack_revision_range().first;
+             return { std::max( first, std::min( _commit_revision, revision() ) ), revision() };
+         }
+
          void undo();
          void squash();
          void commit( int64_t revision );
          void undo_all();
 
+         /**
+          * Runs undo, squash, commit and undo_all on num_threads worker threads, one task per index,
+          * whenever the indices hold at least min_undo_records records that the operation has to
+          * process (see undo_index::undo_records_since).  Smaller operations, and all operations
+          * when num_threads is 0, run on the calling thread.  The undo_index_observer hooks of
+          * different indices then run concurrently on the worker threads.
+          */
+         void set_parallel_undo( unsigned num_threads, std::size_t min_undo_records = 10000 );
+
+         /**
+          * When enabled, commit only detaches the undo history that it discards, which makes
+          * its cost independent of the size of that history.  The memory is released by
+          * reclaim, which should be called when the writer is otherwise idle.
+          */
+         void set_deferred_disposal( bool enabled );
+
+         /**
+          * Releases undo history detached by commit, stopping after roughly budget has elapsed.
+          * Returns false once everything has been released.
+          */
+         bool reclaim( std::chrono::nanoseconds budget );
+
+
+         /**
+          * Encodes the objects created, modified and removed by the top undo session of every
+          * index, so that they can be installed in another database with apply_delta.  Every
+          * index that has changes needs an object_serializer.
+          *
+          * The delta consists of a uint32 number of index sections.  Each section is the uint32
+          * type_id of the index, the uint64 size of the rest of the section and the changes
+          * encoded by write_index_delta.
+          */
+         std::vector<char> last_undo_session_delta();
+
+         /**
+          * Installs a delta produced by last_undo_session_delta.  The indices present in the delta
+          * must exist in this database and hold the same state the producer's did before its
+          * session.  Start an undo session first to be able to revert the delta, or a partially
+          * applied delta if this throws.
+          */
+         void apply_delta( const char* data, std::size_t size );
+
+         /**
+          * Writes the revision and the contents of every index to out in a format that only
+          * depends on the object_serializer of each type, not on the memory layout of the
+          * database.  Every type needs a specialization of object_serializer, see
+          * has_portable_serializer.  Indices are split into chunks of id ranges that are encoded
+          * concurrently on num_threads worker threads.  At most 2 * num_threads chunks are held in
+          * memory at a time, and they are written in order.  If out cannot seek back to fill in
+          * the size of each section, every chunk is encoded twice, first to measure it.
+          *
+          * The snapshot starts with the uint32 magic number snapshot_magic, the int64 revision and
+          * the uint32 number of index sections.  Each section is the uint32 type_id of the index,
+          * the uint64 size of the rest of the section and the data read by read_snapshot_index.
+          * All integers are little-endian.
+          */
+         void write_snapshot( std::ostream& out, unsigned num_threads = std::thread::hardware_concurrency() )const;
+
+         /**
+          * Loads a snapshot written by write_snapshot.  Every index in the snapshot must have been
+          * added, must be empty and must not have an undo stack.  The objects are read from the
+          * stream one at a time as the indices are built, so the snapshot is never buffered as a
+          * whole, and sizes in the snapshot are checked against the length of the stream if it
+          * can be determined.  A stream is read by one thread, one index after the other.
+          *
+          * Exception safety: basic.  Indices loaded before an error are not cleared.
+          */
+         void read_snapshot( std::istream& in );
+         /**
+          * Loads a snapshot file as above, with up to num_threads indices built concurrently.  The
+          * sections of the indices are located from their sizes first, then every worker reads the
+          * section of its index through a stream of its own.
+          */
+         void read_snapshot( const bfs::path& file, unsigned num_threads = std::thread::hardware_concurrency() );
+
+         static constexpr uint32_t snapshot_magic = 0x53534243; // "CBSS"
+
+         /**
+          * Records the sessions, commits and the creates, modifies, removes and finds made through the
+          * database to a trace file at path, see trace.hpp, until stop_trace is called.  The trace
+          * starts with the size of every index, and can be replayed by chainbase-replay.  Changes made
+          * through get_mutable_index, apply_delta or read_snapshot are not recorded.  Finds of reader
+          * threads (see make_reader) are recorded too, so with readers the trace must be started and
+          * stopped under write_lock().
+          */
+         void start_trace( const bfs::path& path );
+         void stop_trace();
+
+         /**
+          * Holds the epoch lock of the database exclusively, see make_reader.  When
+          * CHAINBASE_CHECK_LOCKING is defined, it also satisfies require_write_lock.
+          */
+         class write_guard {
+            public:
+               explicit write_guard( database& db ):_db( &db ) {
+                  _db->_epoch_lock->lock();
+#ifdef CHAINBASE_CHECK_LOCKING
+                  ++_db->_write_lock_count;
+#endif
+               }
+               write_guard( write_guard&& other ):_db( other._db ) { other._db = nullptr; }
+               write_guard( const write_guard& ) = delete;
+               write_guard& operator=( const write_guard& ) = delete;
+               ~write_guard() {
+                  if( !_db ) return;
+#ifdef CHAINBASE_CHECK_LOCKING
+                  --_db->_write_lock_count;
+#endif
+                  _db->_epoch_lock->unlock();
+               }
+            private:
+               database* _db;
+         };
+
+         /**
+          * Lets other threads read the database while one thread writes to it.  Each reader thread
+          * takes a reader once and holds its shared lock, e.g. with std::shared_lock, while it calls
+          * find or get or iterates an index.  The writer holds write_lock() while it changes the
+          * database, e.g. for the lifetime of each undo session, so that readers run between sessions
+          * and never see a session half applied.  See epoch_lock.
+          *
+          * With CHAINBASE_CHECK_LOCKING, write_lock() satisfies require_write_lock, but the shared
+          * lock of a reader does not satisfy require_read_lock: it is not counted, so a read only
+          * database with set_require_locking enabled still fails the check on every read.
+          */
+         epoch_lock::reader make_reader()const { return _epoch_lock->make_reader(); }
+         write_guard write_lock() { return write_guard( *this ); }
+         /// Advances by two with every write_lock, and is odd while it is held or waited for
+         uint64_t write_epoch()const { return _epoch_lock->epoch(); }
+
+         /**
+          * Limits the undo history kept in memory.  Once more than 2 * max_depth undo sessions of an
+          * index are in memory, start_undo_session appends the records of all but the newest max_depth
+          * of them to the file at path and releases them.  undo and squash read them back when they
+          * reach a spilled session.  Spilling several sessions at once amortizes the traversal of the
+          * sessions that stay in memory.  Indices without an object_serializer are never spilled.
+          *
+          * The file is truncated whenever no spilled session remains.  Spilled sessions survive a restart
+          * as long as the file does, so the same path must be set again before they are undone.  A
+          * max_depth of 0 stops spilling.
+          */
+         void set_undo_spill( const bfs::path& path, std::size_t max_depth );
 
          void set_revision( uint64_t revision )
          {
              CHAINBASE_REQUIRE_WRITE_LOCK( "set_revision", uint64_t );
              for( auto i : _index_list ) i->set_revision( revision );
+             _lazy_revision = _lazy_floor = revision;
+             _lazy_touched.clear();
          }
 
 
          template<typename MultiIndexType>
          void add_index() {
+            sync_undo_stacks();
             const uint16_t type_id = generic_index<MultiIndexType>::value_type::type_id;
             typedef generic_index<MultiIndexType>          index_type;
             typedef typename index_type::allocator_type    index_alloc;
@@ -403,7 +856,14 @@ namespace chainbase {
             if( type_id >= _index_map.size() )
                _index_map.resize( type_id + 1 );
 
+            if( !_read_only )
+               idx_ptr->set_deferred_disposal( _deferred_disposal );
+
+            if( _trace )
+               _trace->add_index( type_id, sizeof( typename index_type::value_type ), idx_ptr->indices().size(), id_to_index( idx_ptr->next_id() ) );
+
             auto new_index = new index<index_type>( *idx_ptr );
+            new_index->set_spill_file( _undo_spill.get() );
             _index_map[ type_id ].reset( new_index );
             _index_list.push_back( new_index );
          }
@@ -451,7 +911,10 @@ namespace chainbase {
             typedef index_type*                   index_type_ptr;
             assert( _index_map.size() > index_type::value_type::type_id );
             assert( _index_map[index_type::value_type::type_id] );
-            return *index_type_ptr( _index_map[index_type::value_type::type_id]->get() );
+            index_type& idx = *index_type_ptr( _index_map[index_type::value_type::type_id]->get() );
+            if( BOOST_UNLIKELY( _lazy_sessions ) && idx.revision() < _lazy_revision )
+               join_lazy_session( *_index_map[index_type::value_type::type_id] );
+            return idx;
          }
 
          template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
@@ -459,10 +922,12 @@ namespace chainbase {
          {
              CHAINBASE_REQUIRE_READ_LOCK("find", ObjectType);
              typedef typename get_index_type< ObjectType >::type index_type;
+             CHAINBASE_TIME_OP( op_metrics< index_type >(), find );
              const auto& idx = get_index< index_type >().indices().template get< IndexedByType >();
              auto itr = idx.find( std::forward< CompatibleKey >( key ) );
-             if( itr == idx.end() ) return nullptr;
-             return &*itr;
+             const ObjectType* result = itr == idx.end() ? nullptr : &*itr;
+             if( BOOST_UNLIKELY( _trace != nullptr ) ) trace_find( *_trace, &trace_recorder::find_by_key, result );
+             return result;
          }
 
          template< typename ObjectType >
@@ -470,7 +935,30 @@ namespace chainbase {
          {
              CHAINBASE_REQUIRE_READ_LOCK("find", ObjectType);
              typedef typename get_index_type< ObjectType >::type index_type;
-             return get_index< index_type >().find( key );
+             CHAINBASE_TIME_OP( op_metrics< index_type >(), find );
+             const ObjectType* result = get_index< index_type >().find( key );
+             if( BOOST_UNLIKELY( _trace != nullptr ) ) trace_find( *_trace, &trace_recorder::find, result );
+             return result;
+         }
+
+         /**
+          * Looks up each key in [first, last) and writes a pointer to the object, or nullptr, to out.
+          * The lookups descend the tree together, so that their cache misses overlap.
+          */
+         template< typename ObjectType, typename IndexedByType, typename KeyIterator, typename OutputIterator >
+         OutputIterator find_batch( KeyIterator first, KeyIterator last, OutputIterator out )const
+         {
+             CHAINBASE_REQUIRE_READ_LOCK("find_batch", ObjectType);
+             typedef typename get_index_type< ObjectType >::type index_type;
+             return get_index< index_type >().indices().template get< IndexedByType >().find_batch( first, last, out );
+         }
+
+         template< typename ObjectType, typename KeyIterator, typename OutputIterator >
+         OutputIterator find_batch( KeyIterator first, KeyIterator last, OutputIterator out )const
+         {
+             CHAINBASE_REQUIRE_READ_LOCK("find_batch", ObjectType);
+             typedef typename get_index_type< ObjectType >::type index_type;
+             return get_index< index_type >().find_batch( first, last, out );
          }
 
          template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
@@ -504,7 +992,15 @@ namespace chainbase {
          {
              CHAINBASE_REQUIRE_WRITE_LOCK("modify", ObjectType);
              typedef typename get_index_type<ObjectType>::type index_type;
-             get_mutable_index<index_type>().modify( obj, m );
+             CHAINBASE_TIME_OP( op_metrics<index_type>(), modify );
+             auto& idx = get_mutable_index<index_type>();
+             if( BOOST_UNLIKELY( _trace != nullptr ) ) {
+                auto keys = idx.key_values( obj );
+                idx.modify( obj, m );
+                _trace->modify( ObjectType::type_id, id_to_index( obj.id ), idx.changed_keys( obj, keys ) );
+                return;
+             }
+             idx.modify( obj, m );
          }
 
          template<typename ObjectType>
@@ -512,17 +1008,82 @@ namespace chainbase {
          {
              CHAINBASE_REQUIRE_WRITE_LOCK("remove", ObjectType);
              typedef typename get_index_type<ObjectType>::type index_type;
+             CHAINBASE_TIME_OP( op_metrics<index_type>(), remove );
+             if( BOOST_UNLIKELY( _trace != nullptr ) ) _trace->remove( ObjectType::type_id, id_to_index( obj.id ) );
              return get_mutable_index<index_type>().remove( obj );
          }
 
+         /**
+          * Removes all objects whose IndexedByType key is in [lower, upper) and returns how many were removed
+          */
+         template<typename ObjectType, typename IndexedByType, typename LowerKey, typename UpperKey>
+         std::size_t remove_range( LowerKey&& lower, UpperKey&& upper )
+         {
+             CHAINBASE_REQUIRE_WRITE_LOCK("remove_range", ObjectType);
+             typedef typename get_index_type<ObjectType>::type index_type;
+             CHAINBASE_TIME_OP( op_metrics<index_type>(), remove );
+             auto& idx = get_mutable_index<index_type>();
+             if( BOOST_UNLIKELY( _trace != nullptr ) ) {
+                const auto& by = idx.indices().template get<IndexedByType>();
+                for( auto iter = by.lower_bound( lower ), end = by.lower_bound( upper ); iter != end; ++iter )
+                   _trace->remove( ObjectType::type_id, id_to_index( iter->id ) );
+             }
+             return idx.template remove_range<IndexedByType>( std::forward<LowerKey>(lower), std::forward<UpperKey>(upper) );
+         }
+
+         template<typename ObjectType, typename Predicate>
+         std::size_t remove_if( Predicate&& p )
+         {
+             CHAINBASE_REQUIRE_WRITE_LOCK("remove_if", ObjectType);
+             typedef typename get_index_type<ObjectType>::type index_type;
+             CHAINBASE_TIME_OP( op_metrics<index_type>(), remove );
+             if( BOOST_UNLIKELY( _trace != nullptr ) ) {
+                return get_mutable_index<index_type>().remove_if( [&]( const ObjectType& obj ) {
+                   bool result = p( obj );
+                   if( result ) _trace->remove( ObjectType::type_id, id_to_index( obj.id ) );
+                   return result;
+                } );
+             }
+             return get_mutable_index<index_type>().remove_if( std::forward<Predicate>(p) );
+         }
+
          template<typename ObjectType, typename Constructor>
          const ObjectType& create( Constructor&& con )
          {
              CHAINBASE_REQUIRE_WRITE_LOCK("create", ObjectType);
              typedef typename get_index_type<ObjectType>::type index_type;
-             return get_mutable_index<index_type>().emplace( std::forward<Constructor>(con) );
+             CHAINBASE_TIME_OP( op_metrics<index_type>(), emplace );
+             const ObjectType& result = get_mutable_index<index_type>().emplace( std::forward<Constructor>(con) );
+             if( BOOST_UNLIKELY( _trace != nullptr ) ) _trace->create( ObjectType::type_id, id_to_index( result.id ) );
+             return result;
          }
 
+         /**
+          * Creates one object per element of [first, last) in an empty index, calling con( obj, element ).
+          * See undo_index::bulk_emplace.
+          */
+         template<typename ObjectType, typename Iter, typename Constructor>
+         void bulk_create( Iter first, Iter last, Constructor&& con )
+         {
+             CHAINBASE_REQUIRE_WRITE_LOCK("bulk_create", ObjectType);
+             typedef typename get_index_type<ObjectType>::type index_type;
+             CHAINBASE_TIME_OP( op_metrics<index_type>(), emplace );
+             auto& idx = get_mutable_index<index_type>();
+             idx.bulk_emplace( first, last, std::forward<Constructor>(con) );
+             if( BOOST_UNLIKELY( _trace != nullptr ) ) {
+                for( const ObjectType& obj : idx.indices() ) _trace->create( ObjectType::type_id, id_to_index( obj.id ) );
+             }
+         }
+
+         /**
+          * Returns the size, tree heights and undo history of every index, in type_id order.  The latency
+          * of each operation is only recorded when CHAINBASE_ENABLE_METRICS is defined, see metrics.hpp;
+          * operations through a typed_database are not recorded.
+          */
+         std::vector<index_metrics> metrics_snapshot()const;
+         // Clears the recorded operation latencies
+         void reset_metrics();
+
          database_index_row_count_multiset row_count_per_index()const {
             database_index_row_count_multiset ret;
             for(const auto& ai_ptr : _index_map) {
@@ -534,9 +1095,73 @@ namespace chainbase {
          }
 
       private:
+         template<typename Work, typename Op>
+         void for_each_index( Work&& work, Op&& op );
+         void truncate_undo_spill();
+         // Moves old undo sessions to the spill file, see set_undo_spill
+         void spill_undo_history();
+         // Reloads the spilled sessions of every index that an undo or squash is about to need,
+         // so that an error leaves all the indices unchanged
+         void unspill( std::size_t depth );
+         // Throws unless the database can load a snapshot, see read_snapshot
+         void check_snapshot_target();
+         int64_t read_snapshot_header( snapshot_reader& reader )const;
+         // Returns the index of a snapshot section, which must be empty and not loaded yet
+         const abstract_index& snapshot_section_index( uint32_t type_id, std::vector<const abstract_index*>& loaded )const;
+         static void read_snapshot_section( const abstract_index& item, snapshot_reader& section );
+         // Returns the oldest pinned revision, or the current revision if there are no pins
+         int64_t oldest_pinned_revision()const;
+         void release_undone_pins();
+         // Brings an index to the revision of the database before it is written to
+         void join_lazy_session( abstract_index& item );
+         // Calls op on the indices that have a session at the top revision, see set_lazy_sessions
+         void for_each_lazy_index( const std::function<void(abstract_index&)>& op );
+         bool is_committed( int64_t revision )const { return revision <= _commit_revision; }
+         template<typename ObjectType>
+         static void trace_find( trace_recorder& trace, void (trace_recorder::*op)( uint32_t, const uint64_t* ), const ObjectType* result ) {
+            uint64_t id = result ? id_to_index( result->id ) : 0;
+            (trace.*op)( ObjectType::type_id, result ? &id : nullptr );
+         }
+         template<typename MultiIndexType>
+         index_op_metrics& op_metrics()const {
+            return *_index_map[generic_index<MultiIndexType>::value_type::type_id]->op_metrics();
+         }
+
+         template<typename... MultiIndexTypes>
+         friend class typed_database;
+
+         struct revision_pins {
+            std::mutex                  mutex;
+            std::map<uint64_t, int64_t> revisions; // revision of each pin
+            uint64_t                    next_id = 0;
+         };
+
          pinnable_mapped_file                                        _db_file;
          bool                                                        _read_only = false;
 
+         unique_ptr<worker_pool>                                     _undo_workers;
+         std::size_t                                                 _min_parallel_undo_records = 0;
+         bool                                                        _deferred_disposal = false;
+         std::size_t                                                 _reclaim_cursor = 0;
+         unique_ptr<undo_spill_file>                                 _undo_spill;
+         std::size_t                                                 _undo_spill_depth = 0;
+         unique_ptr<revision_pins>                                   _pins{ new revision_pins };
+         /// The highest revision passed to commit.  Sessions above it are only kept for pinned revisions.
+         int64_t                                                     _commit_revision = std::numeric_limits<int64_t>::min();
+         bool                                                        _lazy_sessions = false;
+         int64_t                                                     _lazy_revision = 0;
+         /// The revision of the indices that were not written to by lazy sessions
+         int64_t                                                     _lazy_floor = 0;
+         /// The indices whose revision is above _lazy_floor
+         vector<abstract_index*>                                     _lazy_touched;
+         /// Every index is committed up to this revision, see commit
+         int64_t                                                     _lazy_committed = std::numeric_limits<int64_t>::min();
+         /// Records operations while a trace is running, see start_trace
+         unique_ptr<trace_recorder>                                  _trace;
+
+         /// Kept in the memory of the process, so that readers do not write to the database file
+         unique_ptr<epoch_lock>                                      _epoch_lock{ new epoch_lock };
+
          /**
           * This is a sparse list of known indices kept to accelerate creation of undo sessions
           */
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <boost/throw_exception.hpp>
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#ifndef CHAINBASE_MAX_READERS
+   #define CHAINBASE_MAX_READERS 64
+#endif
+
+namespace chainbase {
+
+   /**
+    *  Lets many reader threads share a database with one writer thread at a time.
+    *
+    *  Every reader thread owns a slot on its own cache line, so that taking and releasing a
+    *  shared lock only writes to memory of that thread and readers do not contend with each
+    *  other.  The writer makes the epoch odd, then waits until no slot is active; a reader marks
+    *  its slot active, then checks that the epoch is even, and otherwise steps back and waits
+    *  for the writer.  The epoch advances by two with every write, so readers can tell whether
+    *  the database changed since they last read it.
+    *
+    *  Readers cannot validate a read after the fact as with a seqlock, because the trees of an
+    *  index may be freed while a reader follows them.  Instead the writer excludes readers only
+    *  while it holds the lock, e.g. for each undo session, and readers run between sessions.
+    *
+    *  A thread must not take the write lock while it holds a shared lock, and the lock does not
+    *  extend to other processes that map the same database.
+    */
+   class epoch_lock {
+      public:
+         static constexpr std::size_t max_readers = CHAINBASE_MAX_READERS;
+
+         // The slot of one reader thread.  Satisfies SharedLockable, e.g. for std::shared_lock.
+         class reader {
+            public:
+               reader( reader&& other ) noexcept : _lock( other._lock ), _slot( other._slot ), _epoch( other._epoch ) { other._lock = nullptr; }
+               reader& operator=( reader&& other ) noexcept {
+                  std::swap( _lock, other._lock );
+                  std::swap( _slot, other._slot );
+                  std::swap( _epoch, other._epoch );
+                  return *this;
+               }
+               ~reader() { if( _lock ) _lock->release( _slot ); }
+
+               void lock_shared() {
+                  auto& active = _lock->_slots[_slot].active;
+                  for( ;; ) {
+                     active.store( 1, std::memory_order_seq_cst );
+                     _epoch = _lock->_epoch.load( std::memory_order_seq_cst );
+                     if( ( _epoch & 1 ) == 0 ) return;
+                     active.store( 0, std::memory_order_release );
+                     _lock->wait_for_writer();
+                  }
+               }
+               bool try_lock_shared() {
+                  auto& active = _lock->_slots[_slot].active;
+                  active.store( 1, std::memory_order_seq_cst );
+                  _epoch = _lock->_epoch.load( std::memory_order_seq_cst );
+                  if( ( _epoch & 1 ) == 0 ) return true;
+                  active.store( 0, std::memory_order_release );
+                  return false;
+               }
+               void unlock_shared() { _lock->_slots[_slot].active.store( 0, std::memory_order_release ); }
+
+               // The epoch when the shared lock was last taken.  The writer may make the epoch of
+               // the lock odd while the shared lock is held, but cannot write until it is released.
+               uint64_t epoch()const { return _epoch; }
+
+            private:
+               friend class epoch_lock;
+               reader( epoch_lock& lock, std::size_t slot ) : _lock( &lock ), _slot( slot ) {}
+
+               epoch_lock* _lock;
+               std::size_t _slot;
+               uint64_t    _epoch = 0;
+         };
+
+         epoch_lock() = default;
+         epoch_lock( const epoch_lock& ) = delete;
+         epoch_lock& operator=( const epoch_lock& ) = delete;
+
+         // Claims a slot for the calling thread.  Throws std::runtime_error if all max_readers
+         // slots are taken.
+         reader make_reader() {
+            for( std::size_t i = 0; i < max_readers; ++i ) {
+               bool expected = false;
+               if( _slots[i].claimed.compare_exchange_strong( expected, true ) ) {
+                  std::size_t used = _used_slots.load();
+                  while( used < i + 1 && !_used_slots.compare_exchange_weak( used, i + 1 ) ) {}
+                  return reader( *this, i );
+               }
+            }
+            BOOST_THROW_EXCEPTION( std::runtime_error( "all " + std::to_string( max_readers ) + " reader slots of the database are in use" ) );
+         }
+
+         // Takes the lock exclusively, waiting for the readers that hold it to release it.
+         // Satisfies Lockable, e.g. for std::unique_lock.
+         void lock() {
+            uint64_t epoch = _epoch.load( std::memory_order_relaxed );
+            for( unsigned spins = 0; ( epoch & 1 ) || !_epoch.compare_exchange_weak( epoch, epoch + 1, std::memory_order_seq_cst ); ++spins ) {
+               backoff( spins );
+               epoch = _epoch.load( std::memory_order_relaxed );
+            }
+            const std::size_t used = _used_slots.load( std::memory_order_seq_cst );
+            for( std::size_t i = 0; i < used; ++i ) {
+               for( unsigned spins = 0; _slots[i].active.load( std::memory_order_seq_cst ); ++spins ) backoff( spins );
+            }
+         }
+         bool try_lock() {
+            uint64_t epoch = _epoch.load( std::memory_order_relaxed );
+            if( ( epoch & 1 ) || !_epoch.compare_exchange_strong( epoch, epoch + 1, std::memory_order_seq_cst ) ) return false;
+            const std::size_t used = _used_slots.load( std::memory_order_seq_cst );
+            for( std::size_t i = 0; i < used; ++i ) {
+               if( _slots[i].active.load( std::memory_order_seq_cst ) ) {
+                  // Nothing was written, so the epoch goes back to where it was
+                  end_write( -1 );
+                  return false;
+               }
+            }
+            return true;
+         }
+         void unlock() { end_write( 1 ); }
+
+         // Odd while a writer holds the lock or waits for readers to release it
+         uint64_t epoch()const { return _epoch.load( std::memory_order_acquire ); }
+
+      private:
+         struct alignas(64) slot {
+            std::atomic<uint32_t> active{ 0 };
+            std::atomic<bool>     claimed{ false };
+         };
+
+         void end_write( int64_t delta ) {
+            _epoch.fetch_add( delta, std::memory_order_seq_cst );
+            if( _waiting_readers.load( std::memory_order_seq_cst ) ) {
+               std::lock_guard<std::mutex> guard( _wait_mutex );
+               _wait_condition.notify_all();
+            }
+         }
+
+         void release( std::size_t slot ) {
+            _slots[slot].active.store( 0, std::memory_order_release );
+            _slots[slot].claimed.store( false, std::memory_order_release );
+         }
+
+         // Spins briefly, then sleeps until the writer releases the lock.  Writes may take
+         // a while, so readers do not spin for their whole duration.
+         void wait_for_writer() {
+            for( unsigned spins = 0; spins < 128; ++spins ) {
+               if( ( _epoch.load( std::memory_order_acquire ) & 1 ) == 0 ) return;
+               backoff( spins );
+            }
+            _waiting_readers.fetch_add( 1, std::memory_order_seq_cst );
+            {
+               std::unique_lock<std::mutex> guard( _wait_mutex );
+               _wait_condition.wait( guard, [&] { return ( _epoch.load( std::memory_order_seq_cst ) & 1 ) == 0; } );
+            }
+            _waiting_readers.fetch_sub( 1, std::memory_order_relaxed );
+         }
+
+         static void backoff( unsigned spins ) {
+            if( spins >= 16 ) std::this_thread::yield();
+         }
+
+         alignas(64) std::atomic<uint64_t>      _epoch{ 0 };
+         std::atomic<std::size_t>               _used_slots{ 0 };
+         std::atomic<uint32_t>                  _waiting_readers{ 0 };
+         std::mutex                             _wait_mutex;
+         std::condition_variable                _wait_condition;
+         std::array<slot, max_readers>          _slots;
+   };
+
+}  // namespace chainbase
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Define CHAINBASE_ENABLE_METRICS to record the latency of every index operation, see
+// database::metrics_snapshot.  Like CHAINBASE_CHECK_LOCKING, it must be defined in every
+// translation unit that uses the database.
+#ifdef CHAINBASE_ENABLE_METRICS
+   #define CHAINBASE_TIME_OP(metrics, op) ::chainbase::scoped_op_timer chainbase_op_timer_( (metrics)[::chainbase::index_op::op] )
+#else
+   #define CHAINBASE_TIME_OP(metrics, op)
+#endif
+
+namespace chainbase {
+
+#ifdef CHAINBASE_ENABLE_METRICS
+   constexpr bool metrics_enabled = true;
+#else
+   constexpr bool metrics_enabled = false;
+#endif
+
+   // The operations whose latency is recorded for each index
+   enum class index_op : uint8_t {
+      emplace,
+      modify,
+      remove,
+      find,
+      undo,
+      squash,
+      commit,
+   };
+   constexpr std::size_t index_op_count = 7;
+
+   inline const char* to_string( index_op op ) {
+      static const char* const names[index_op_count] = { "emplace", "modify", "remove", "find", "undo", "squash", "commit" };
+      return names[static_cast<std::size_t>(op)];
+   }
+
+   /**
+    *  The latencies recorded by a latency_histogram.  Values below sub_buckets nanoseconds have a
+    *  bucket each, and every higher power of two is split into sub_buckets buckets, so that the
+    *  bucket of a value bounds it within 1 / sub_buckets of its magnitude, as in HDR histograms.
+    */
+   struct latency_stats {
+      static constexpr unsigned    sub_bucket_bits = 3;
+      static constexpr uint64_t    sub_buckets = uint64_t(1) << sub_bucket_bits;
+      static constexpr std::size_t bucket_count = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+      uint64_t count = 0;
+      uint64_t total_ns = 0;
+      uint64_t max_ns = 0;
+      std::array<uint64_t, bucket_count> buckets = {};
+
+      static std::size_t bucket_of( uint64_t ns ) {
+         if( ns < sub_buckets ) return ns;
+         unsigned shift = log2_floor( ns ) - sub_bucket_bits;
+         return ( shift + 1 ) * sub_buckets + ( ( ns >> shift ) - sub_buckets );
+      }
+      // Returns the lowest value that falls into bucket
+      static uint64_t bucket_lower_bound( std::size_t bucket ) {
+         if( bucket < sub_buckets ) return bucket;
+         unsigned shift = bucket / sub_buckets - 1;
+         return ( sub_buckets + bucket % sub_buckets ) << shift;
+      }
+
+      static unsigned log2_floor( uint64_t n ) {
+#if defined(__GNUC__)
+         return 63 - __builtin_clzll( n );
+#else
+         unsigned result = 0;
+         while( n >>= 1 ) ++result;
+         return result;
+#endif
+      }
+
+      double mean_ns()const { return count ? double( total_ns ) / count : 0; }
+
+      // Returns an upper bound on the latency of the given fraction of the operations,
+      // e.g. percentile( 0.99 ) bounds the 99th percentile.
+      uint64_t percentile( double fraction )const {
+         if( count == 0 ) return 0;
+         uint64_t rank = std::max<uint64_t>( 1, uint64_t( fraction * count + 0.5 ) );
+         uint64_t seen = 0;
+         for( std::size_t i = 0; i < bucket_count; ++i ) {
+            seen += buckets[i];
+            if( seen >= rank ) {
+               uint64_t upper = i + 1 < bucket_count ? bucket_lower_bound( i + 1 ) - 1 : std::numeric_limits<uint64_t>::max();
+               return std::min( upper, max_ns );
+            }
+         }
+         return max_ns;
+      }
+   };
+
+   // Records latencies from any number of threads
+   class latency_histogram {
+      public:
+         void record( uint64_t ns ) noexcept {
+            _count.fetch_add( 1, std::memory_order_relaxed );
+            _total_ns.fetch_add( ns, std::memory_order_relaxed );
+            uint64_t max = _max_ns.load( std::memory_order_relaxed );
+            while( ns > max && !_max_ns.compare_exchange_weak( max, ns, std::memory_order_relaxed ) ) {}
+            _buckets[latency_stats::bucket_of( ns )].fetch_add( 1, std::memory_order_relaxed );
+         }
+
+         // The result is not an atomic snapshot if operations are recorded concurrently
+         latency_stats snapshot()const {
+            latency_stats result;
+            result.count = _count.load( std::memory_order_relaxed );
+            result.total_ns = _total_ns.load( std::memory_order_relaxed );
+            result.max_ns = _max_ns.load( std::memory_order_relaxed );
+            for( std::size_t i = 0; i < latency_stats::bucket_count; ++i )
+               result.buckets[i] = _buckets[i].load( std::memory_order_relaxed );
+            return result;
+         }
+
+         void reset() noexcept {
+            _count.store( 0, std::memory_order_relaxed );
+            _total_ns.store( 0, std::memory_order_relaxed );
+            _max_ns.store( 0, std::memory_order_relaxed );
+            for( auto& bucket : _buckets ) bucket.store( 0, std::memory_order_relaxed );
+         }
+
+      private:
+         std::atomic<uint64_t>                                          _count{ 0 };
+         std::atomic<uint64_t>                                          _total_ns{ 0 };
+         std::atomic<uint64_t>                                          _max_ns{ 0 };
+         std::array<std::atomic<uint64_t>, latency_stats::bucket_count> _buckets = {};
+   };
+
+   // The latency histograms of the operations on one index
+   class index_op_metrics {
+      public:
+         latency_histogram& operator[]( index_op op ) { return _ops[static_cast<std::size_t>(op)]; }
+         const latency_histogram& operator[]( index_op op )const { return _ops[static_cast<std::size_t>(op)]; }
+         void reset() noexcept { for( auto& h : _ops ) h.reset(); }
+      private:
+         std::array<latency_histogram, index_op_count> _ops;
+   };
+
+   // Records the time from its construction to its destruction, including when an exception is thrown
+   class scoped_op_timer {
+      public:
+         explicit scoped_op_timer( latency_histogram& h ):_histogram( h ),_start( std::chrono::steady_clock::now() ){}
+         scoped_op_timer( const scoped_op_timer& ) = delete;
+         scoped_op_timer& operator=( const scoped_op_timer& ) = delete;
+         ~scoped_op_timer() {
+            auto elapsed = std::chrono::steady_clock::now() - _start;
+            _histogram.record( std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count() );
+         }
+      private:
+         latency_histogram&                    _histogram;
+         std::chrono::steady_clock::time_point _start;
+   };
+
+   // A snapshot of the state of one index, see database::metrics_snapshot
+   struct index_metrics {
+      std::string           type_name;
+      uint32_t              type_id = 0;
+      uint64_t              row_count = 0;
+      /// The height of the tree of each ordered index, in the order of the multi_index_container
+      std::vector<uint32_t> tree_heights;
+      /// The number of sessions on the undo stack, and how many of them have been spilled
+      uint64_t              undo_sessions = 0;
+      uint64_t              spilled_sessions = 0;
+      /// The lengths of the undo lists, see undo_index::undo_lists_size
+      uint64_t              old_values = 0;
+      uint64_t              removed_values = 0;
+      uint64_t              diff_values = 0;
+      /// Only recorded when CHAINBASE_ENABLE_METRICS is defined
+      std::array<latency_stats, index_op_count> ops;
+
+      const latency_stats& operator[]( index_op op )const { return ops[static_cast<std::size_t>(op)]; }
+   };
+
+}  // namespace chainbase
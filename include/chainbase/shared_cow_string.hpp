@@ -9,6 +9,10 @@
 #include <algorithm>
 #include <string>
 
+#ifdef _MSC_VER
+   #include <intrin.h>
+#endif
+
 #include <chainbase/pinnable_mapped_file.hpp>
 
 namespace chainbase {
@@ -51,9 +55,11 @@ namespace chainbase {
          new_data->data[size] = '\0';
          _data = new_data;
       }
+      // The reference count is updated atomically, because objects in different
+      // indices may share a buffer and indices can be undone concurrently.
       shared_cow_string(const shared_cow_string& other) : _data(other._data), _alloc(other._alloc) {
          if(_data != nullptr) {
-            ++_data->reference_count;
+            add_refcount(_data->reference_count, 1);
          }
       }
       shared_cow_string(shared_cow_string&& other) : _data(other._data), _alloc(other._alloc) {
@@ -131,8 +137,18 @@ namespace chainbase {
       bool operator!=(const shared_cow_string& rhs) const { return !(*this == rhs); }
       const allocator_type& get_allocator() const { return _alloc; }
     private:
+      // Adds to a reference count in the mapped file and returns the new count.  The count is a
+      // plain integer so that the layout of the file does not depend on std::atomic.
+      static uint32_t add_refcount(uint32_t& count, int32_t delta) {
+#ifdef _MSC_VER
+         static_assert(sizeof(long) == sizeof(uint32_t));
+         return uint32_t(_InterlockedExchangeAdd(reinterpret_cast<volatile long*>(&count), delta) + delta);
+#else
+         return __atomic_add_fetch(&count, uint32_t(delta), __ATOMIC_ACQ_REL);
+#endif
+      }
       void dec_refcount() {
-         if(_data && --_data->reference_count == 0) {
+         if(_data && add_refcount(_data->reference_count, -1) == 0) {
             _alloc.deallocate((char*)&*_data, sizeof(shared_cow_string) + _data->size + 1);
          }
       }
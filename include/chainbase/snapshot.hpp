@@ -0,0 +1,166 @@
+#pragma once
+
+#include <chainbase/state_delta.hpp>
+
+#include <boost/throw_exception.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+namespace chainbase {
+
+   // A snapshot chunk holds the objects of an index whose ids are in a given range:
+   //   uint64 number of objects, uint64 size of the objects in bytes,
+   //   followed by the objects, each prefixed by its size as a uint32.
+   // Objects are stored in id order and encoded by object_serializer.
+   //
+   // Writes the chunk for the ids in [begin_id, end_id) and returns the number of objects.
+   template<typename Index>
+   std::size_t write_snapshot_chunk(delta_writer& out, const Index& idx, uint64_t begin_id, uint64_t end_id) {
+      using id_type = typename Index::id_type;
+      using serializer = object_serializer<typename Index::value_type>;
+      std::size_t header_pos = out.position();
+      out.write(uint64_t(0));
+      out.write(uint64_t(0));
+      uint64_t count = 0;
+      const auto& by_id = idx.template get<0>();
+      for(auto iter = by_id.lower_bound(id_type(begin_id)), end = by_id.lower_bound(id_type(end_id)); iter != end; ++iter) {
+         std::size_t size_pos = out.position();
+         out.write(uint32_t(0));
+         serializer::pack(out, *iter);
+         out.patch(size_pos, uint32_t(out.position() - size_pos - sizeof(uint32_t)));
+         ++count;
+      }
+      out.patch(header_pos, count);
+      out.patch(header_pos + sizeof(uint64_t), uint64_t(out.position() - header_pos - 2 * sizeof(uint64_t)));
+      return count;
+   }
+
+   // Reads a snapshot from a stream.  Every size read from the snapshot is checked against
+   // the number of bytes left, so that a truncated or damaged snapshot cannot make the
+   // reader allocate more memory than the snapshot holds.  Throws std::runtime_error if
+   // the snapshot ends early.
+   class snapshot_reader {
+    public:
+      snapshot_reader(std::istream& in, uint64_t size) : _in(&in), _remaining(size) {}
+      void read(void* data, std::size_t size) {
+         if(size > _remaining)
+            BOOST_THROW_EXCEPTION( std::runtime_error{ "unexpected end of snapshot" } );
+         _in->read(static_cast<char*>(data), size);
+         if(!*_in)
+            BOOST_THROW_EXCEPTION( std::runtime_error{ "unexpected end of snapshot" } );
+         _remaining -= size;
+      }
+      template<typename T>
+      T read() {
+         static_assert(std::is_trivially_copyable_v<T>);
+         T result;
+         read(&result, sizeof(result));
+         return from_little_endian(result);
+      }
+      // Returns a reader for the next size bytes, which must be read before this reader is used again.
+      snapshot_reader sub_reader(uint64_t size) {
+         if(size > _remaining)
+            BOOST_THROW_EXCEPTION( std::runtime_error{ "unexpected end of snapshot" } );
+         _remaining -= size;
+         return snapshot_reader(*_in, size);
+      }
+      // Moves past the next size bytes without reading them
+      void skip(uint64_t size) {
+         if(size > _remaining || !_in->seekg(size, std::ios::cur))
+            BOOST_THROW_EXCEPTION( std::runtime_error{ "unexpected end of snapshot" } );
+         _remaining -= size;
+      }
+      uint64_t remaining() const { return _remaining; }
+    private:
+      std::istream* _in;
+      uint64_t      _remaining;
+   };
+
+   // Reads the objects of the chunks of an index section one at a time, so that a section
+   // is never held in memory as a whole.  Used as an input range by read_snapshot_index.
+   class snapshot_objects {
+    public:
+      snapshot_objects(snapshot_reader& in, uint64_t chunks) : _in(in), _chunk(in.sub_reader(0)), _chunks(chunks) { next_chunk(); }
+
+      class iterator {
+       public:
+         using iterator_category = std::input_iterator_tag;
+         using value_type = delta_reader;
+         using difference_type = std::ptrdiff_t;
+         using pointer = delta_reader*;
+         using reference = delta_reader&;
+         explicit iterator(snapshot_objects* objects = nullptr) : _objects(objects) {}
+         delta_reader& operator*() const { return _objects->current(); }
+         iterator& operator++() { _objects->next(); return *this; }
+         bool operator==(const iterator& other) const { return at_end() == other.at_end(); }
+         bool operator!=(const iterator& other) const { return !(*this == other); }
+       private:
+         bool at_end() const { return !_objects || _objects->_count == 0; }
+         snapshot_objects* _objects;
+      };
+      iterator begin() { return iterator(this); }
+      iterator end() { return iterator(); }
+
+    private:
+      delta_reader& current() {
+         if(!_loaded) {
+            const uint32_t size = _chunk.read<uint32_t>();
+            if(size > _chunk.remaining())
+               BOOST_THROW_EXCEPTION( std::runtime_error{ "unexpected end of snapshot" } );
+            _buffer.resize(size);
+            _chunk.read(_buffer.data(), size);
+            _value = delta_reader(_buffer.data(), size);
+            _loaded = true;
+         }
+         return _value;
+      }
+      void next() {
+         current();
+         _loaded = false;
+         --_count;
+         next_chunk();
+      }
+      void next_chunk() {
+         while(_count == 0) {
+            if(_chunk.remaining() != 0)
+               BOOST_THROW_EXCEPTION( std::logic_error{ "malformed snapshot chunk" } );
+            if(_chunks == 0) return;
+            --_chunks;
+            _count = _in.read<uint64_t>();
+            _chunk = _in.sub_reader(_in.read<uint64_t>());
+            // Every object is prefixed by its size
+            if(_count > _chunk.remaining() / sizeof(uint32_t))
+               BOOST_THROW_EXCEPTION( std::logic_error{ "malformed snapshot chunk" } );
+         }
+      }
+
+      snapshot_reader&  _in;
+      snapshot_reader   _chunk;
+      uint64_t          _chunks;
+      uint64_t          _count = 0;
+      bool              _loaded = false;
+      std::vector<char> _buffer;
+      delta_reader      _value{ nullptr, 0 };
+   };
+
+   // Reads an index section of a snapshot, a uint64 next_id and a uint64 number of chunks
+   // followed by the chunks, into an empty index.  The objects are bulk loaded as they are read.
+   template<typename Index>
+   void read_snapshot_index(snapshot_reader& in, Index& idx) {
+      using id_type = typename Index::id_type;
+      using value_type = typename Index::value_type;
+      using serializer = object_serializer<value_type>;
+      auto next_id = in.read<uint64_t>();
+      snapshot_objects objects(in, in.read<uint64_t>());
+      idx.bulk_emplace(objects.begin(), objects.end(), [](value_type& v, delta_reader& value_in) {
+         serializer::unpack(value_in, v);
+      });
+      idx.set_next_id(id_type(next_id));
+   }
+
+}  // namespace chainbase
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <chainbase/undo_index.hpp>
+
+#include <boost/endian/conversion.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace chainbase {
+
+   // Integers are stored in little-endian byte order, so that deltas and snapshots
+   // can be read on hosts of either byte order.
+   template<typename T>
+   T to_little_endian(T value) {
+      if constexpr (std::is_integral_v<T> && sizeof(T) > 1) return boost::endian::native_to_little(value);
+      else return value;
+   }
+   template<typename T>
+   T from_little_endian(T value) {
+      if constexpr (std::is_integral_v<T> && sizeof(T) > 1) return boost::endian::little_to_native(value);
+      else return value;
+   }
+
+   // Appends binary data to a buffer.  Integers are written in little-endian byte order.
+   class delta_writer {
+    public:
+      explicit delta_writer(std::vector<char>& out) : _out(out) {}
+      void write(const void* data, std::size_t size) {
+         const char* p = static_cast<const char*>(data);
+         _out.insert(_out.end(), p, p + size);
+      }
+      template<typename T>
+      void write(const T& value) {
+         static_assert(std::is_trivially_copyable_v<T>);
+         const T stored = to_little_endian(value);
+         write(&stored, sizeof(stored));
+      }
+      std::size_t position() const { return _out.size(); }
+      // Overwrites a value written earlier at pos.  Used to fill in lengths and counts.
+      template<typename T>
+      void patch(std::size_t pos, const T& value) {
+         static_assert(std::is_trivially_copyable_v<T>);
+         const T stored = to_little_endian(value);
+         std::memcpy(_out.data() + pos, &stored, sizeof(stored));
+      }
+    private:
+      std::vector<char>& _out;
+   };
+
+   // Reads data written by delta_writer.  Throws std::out_of_range if the input is truncated.
+   class delta_reader {
+    public:
+      delta_reader(const char* data, std::size_t size) : _pos(data), _end(data + size) {}
+      void read(void* data, std::size_t size) {
+         std::memcpy(data, skip(size), size);
+      }
+      template<typename T>
+      T read() {
+         static_assert(std::is_trivially_copyable_v<T>);
+         T result;
+         read(&result, sizeof(result));
+         return from_little_endian(result);
+      }
+      // Returns a reader for the next size bytes and advances past them.
+      delta_reader sub_reader(std::size_t size) {
+         return delta_reader(skip(size), size);
+      }
+      std::size_t remaining() const { return _end - _pos; }
+    private:
+      const char* skip(std::size_t size) {
+         if(size > remaining())
+            BOOST_THROW_EXCEPTION( std::out_of_range{ "unexpected end of state delta" } );
+         const char* result = _pos;
+         _pos += size;
+         return result;
+      }
+      const char* _pos;
+      const char* _end;
+   };
+
+   // Converts objects to and from the binary representation used by state deltas.
+   // Trivially copyable objects are copied as is.  Specialize this for other types
+   // with static pack( delta_writer&, const T& ) and unpack( delta_reader&, T& ).
+   // unpack is given an object that was constructed by the index and must
+   // overwrite every field including the id.
+   //
+   // Copying the object depends on its memory layout, which is fine for deltas between
+   // builds of the same program, but snapshots require a specialization, see
+   // has_portable_serializer.
+   template<typename T, typename = void>
+   struct object_serializer {};
+
+   template<typename T>
+   struct object_serializer<T, std::enable_if_t<std::is_trivially_copyable_v<T>>> {
+      static constexpr bool copies_memory = true;
+      static void pack(delta_writer& out, const T& obj) { out.write(&obj, sizeof(obj)); }
+      static void unpack(delta_reader& in, T& obj) { in.read(&obj, sizeof(obj)); }
+   };
+
+   template<typename T, typename = void>
+   constexpr bool has_object_serializer = false;
+   template<typename T>
+   constexpr bool has_object_serializer<T, std::void_t<decltype(object_serializer<T>::pack(std::declval<delta_writer&>(), std::declval<const T&>()))>> = true;
+
+   // True if object_serializer<T> is specialized rather than copying the memory of the object
+   template<typename T, typename = void>
+   constexpr bool has_portable_serializer = has_object_serializer<T>;
+   template<typename T>
+   constexpr bool has_portable_serializer<T, std::void_t<decltype(object_serializer<T>::copies_memory)>> = false;
+
+   // The delta of a single index is encoded as
+   //   uint64 number of removed objects, followed by their ids as uint64
+   //   uint64 number of modified objects, followed by the id as uint64 and the new value of each
+   //   uint64 number of created objects, followed by the value of each
+   // where each value is prefixed by its size as a uint32.
+   //
+   // Writes the changes made by the top undo session of idx and returns the number of changes.
+   template<typename Index>
+   std::size_t write_index_delta(delta_writer& out, const Index& idx) {
+      using value_type = typename Index::value_type;
+      using serializer = object_serializer<value_type>;
+      auto delta = idx.last_undo_session();
+      auto is_new = [&](const value_type& v) { return !delta.new_values.empty() && !(v.id < delta.new_values.begin()->id); };
+      auto write_value = [&](const value_type& v) {
+         std::size_t size_pos = out.position();
+         out.write(uint32_t(0));
+         serializer::pack(out, v);
+         out.patch(size_pos, uint32_t(out.position() - size_pos - sizeof(uint32_t)));
+      };
+
+      std::size_t count_pos = out.position();
+      uint64_t count = 0;
+      out.write(count);
+      for(const value_type& v : delta.removed_values) {
+         if(is_new(v)) continue;
+         out.write(uint64_t(id_to_index(v.id)));
+         ++count;
+      }
+      out.patch(count_pos, count);
+      std::size_t result = count;
+
+      count_pos = out.position();
+      count = 0;
+      out.write(count);
+      for(const value_type& old : delta.old_values) {
+         if(is_new(old)) continue;
+         const value_type* current = idx.find(old.id);
+         if(!current) continue; // removed later in the same session
+         out.write(uint64_t(id_to_index(old.id)));
+         write_value(*current);
+         ++count;
+      }
+      out.patch(count_pos, count);
+      result += count;
+
+      count = std::distance(delta.new_values.begin(), delta.new_values.end());
+      out.write(count);
+      for(const value_type& v : delta.new_values) {
+         write_value(v);
+      }
+      return result + count;
+   }
+
+   // Installs a delta produced by write_index_delta.  Removes are applied first,
+   // then all the modifications at once, and finally the new objects, so objects may
+   // take over the unique keys of objects that were removed or modified.
+   //
+   // Exception safety: basic.  Apply the delta inside an undo session to be able to
+   // revert a partially applied delta.
+   template<typename Index>
+   void apply_index_delta(delta_reader& in, Index& idx) {
+      using value_type = typename Index::value_type;
+      using id_type = typename Index::id_type;
+      using serializer = object_serializer<value_type>;
+      auto read_value = [&](value_type& v) {
+         delta_reader value_in = in.sub_reader(in.read<uint32_t>());
+         serializer::unpack(value_in, v);
+      };
+
+      for(uint64_t n = in.read<uint64_t>(); n > 0; --n) {
+         auto id = in.read<uint64_t>();
+         const value_type* obj = idx.find(id_type(id));
+         if(!obj)
+            BOOST_THROW_EXCEPTION( std::out_of_range{ "state delta removes a missing object " + std::to_string(id) } );
+         idx.remove(*obj);
+      }
+
+      std::vector<std::reference_wrapper<const value_type>> modified;
+      std::vector<delta_reader> values;
+      for(uint64_t n = in.read<uint64_t>(); n > 0; --n) {
+         auto id = in.read<uint64_t>();
+         const value_type* obj = idx.find(id_type(id));
+         if(!obj)
+            BOOST_THROW_EXCEPTION( std::out_of_range{ "state delta modifies a missing object " + std::to_string(id) } );
+         modified.push_back(*obj);
+         values.push_back(in.sub_reader(in.read<uint32_t>()));
+      }
+      auto next_value = values.begin();
+      idx.modify_each(modified.begin(), modified.end(), [&](value_type& v) {
+         auto id = v.id;
+         serializer::unpack(*next_value++, v);
+         if(v.id != id) {
+            v.id = id;
+            BOOST_THROW_EXCEPTION( std::logic_error{ "state delta changes the id of an object" } );
+         }
+      });
+
+      for(uint64_t n = in.read<uint64_t>(); n > 0; --n) {
+         idx.emplace([&](value_type& v) { read_value(v); });
+      }
+   }
+
+}  // namespace chainbase
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <boost/filesystem/path.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+namespace chainbase {
+
+   // The operations recorded in a trace, see database::start_trace
+   enum class trace_op : uint8_t {
+      add_index     = 1,  // type_id, value size, row count, next id
+      start_session = 2,
+      undo          = 3,  // undo of the top session
+      squash        = 4,  // squash of the top session
+      commit        = 5,  // revision
+      undo_all      = 6,
+      create        = 7,  // type_id, id
+      modify        = 8,  // type_id, id, mask of the indices whose key changed
+      remove        = 9,  // type_id, id
+      find          = 10, // type_id, id + 1 or 0 if not found
+      find_by_key   = 11, // type_id, id + 1 or 0 if not found
+   };
+
+   struct trace_event {
+      trace_op op;
+      uint32_t type_id = 0;
+      uint64_t id = 0;
+      // The value size of add_index, the key mask of modify and the revision of commit
+      uint64_t value = 0;
+      // The row count and next id of add_index
+      uint64_t rows = 0;
+      uint64_t next_id = 0;
+   };
+
+   // A trace starts with the uint32 magic number trace_magic, the uint32 format version and the
+   // revision of the database as a varint.  Each event is its trace_op as a byte followed by the
+   // fields listed for the op as LEB128 varints.
+   constexpr uint32_t trace_magic = 0x52544243; // "CBTR"
+   constexpr uint32_t trace_version = 1;
+
+   // Writes a trace.  Events are buffered and written in blocks.  Each event is appended under a
+   // mutex, since reader threads record their finds while the writer records its operations.
+   class trace_recorder {
+    public:
+      trace_recorder(const boost::filesystem::path& path, int64_t revision);
+      ~trace_recorder();
+      trace_recorder(const trace_recorder&) = delete;
+      trace_recorder& operator=(const trace_recorder&) = delete;
+
+      void add_index(uint32_t type_id, uint64_t value_size, uint64_t rows, uint64_t next_id) {
+         event(trace_op::add_index, type_id, value_size, rows, next_id);
+      }
+      void start_session() { event(trace_op::start_session); }
+      void undo() { event(trace_op::undo); }
+      void squash() { event(trace_op::squash); }
+      void commit(int64_t revision) { event(trace_op::commit, revision); }
+      void undo_all() { event(trace_op::undo_all); }
+      void create(uint32_t type_id, uint64_t id) { event(trace_op::create, type_id, id); }
+      void modify(uint32_t type_id, uint64_t id, uint64_t changed_keys) { event(trace_op::modify, type_id, id, changed_keys); }
+      void remove(uint32_t type_id, uint64_t id) { event(trace_op::remove, type_id, id); }
+      void find(uint32_t type_id, const uint64_t* id) { event(trace_op::find, type_id, id ? *id + 1 : 0); }
+      void find_by_key(uint32_t type_id, const uint64_t* id) { event(trace_op::find_by_key, type_id, id ? *id + 1 : 0); }
+
+      // Writes the buffered events to the file
+      void flush() {
+         std::lock_guard<std::mutex> guard(_mutex);
+         write_buffer();
+      }
+
+    private:
+      template<typename... Fields>
+      void event(trace_op o, Fields... fields) {
+         std::lock_guard<std::mutex> guard(_mutex);
+         _buffer.push_back(static_cast<char>(o));
+         (varint(fields), ...);
+         if(_buffer.size() >= buffer_size) write_buffer();
+      }
+      void write_buffer();
+      void varint(uint64_t value) {
+         for(; value >= 0x80; value >>= 7) _buffer.push_back(static_cast<char>(value | 0x80));
+         _buffer.push_back(static_cast<char>(value));
+      }
+
+      static constexpr std::size_t buffer_size = 1 << 16;
+      boost::filesystem::path _path;
+      std::ofstream           _file;
+      std::vector<char>       _buffer;
+      std::mutex              _mutex;
+   };
+
+   // Reads a trace written by trace_recorder.  Throws std::runtime_error if the file is not a trace.
+   class trace_reader {
+    public:
+      explicit trace_reader(const boost::filesystem::path& path);
+
+      int64_t revision() const { return _revision; }
+      // Reads the next event.  Returns false at the end of the trace.
+      bool next(trace_event& event);
+
+    private:
+      bool byte(uint8_t& b);
+      uint64_t varint();
+
+      boost::filesystem::path _path;
+      std::ifstream           _file;
+      int64_t                 _revision = 0;
+   };
+
+}  // namespace chainbase
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <chainbase/chainbase.hpp>
+
+#include <boost/throw_exception.hpp>
+
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+namespace chainbase {
+
+   /**
+    *  A view of a database whose indices are known at compile time.  Undo sessions hold a
+    *  tuple of undo_index sessions instead of a vector of heap allocated abstract sessions,
+    *  and undo and squash call the indices directly instead of through abstract_index.
+    *
+    *  The typed_database must cover every index of the database, so that all the undo stacks
+    *  stay at the same revision.  Missing indices are added by the constructor, after it has
+    *  checked that the database holds no index that is not listed.  Operations that are not on
+    *  the hot path, such as commit and undo_all, are forwarded to the database.  Lazy sessions
+    *  (see database::set_lazy_sessions) must be disabled, otherwise start_undo_session, undo
+    *  and squash throw std::logic_error.
+    */
+   template<typename... MultiIndexTypes>
+   class typed_database {
+      public:
+         explicit typed_database( database& db )
+            : _db( check_coverage( db ) ), _indices( add_index<MultiIndexTypes>( db )... ) {}
+
+         class session {
+            public:
+               session( session&& other )
+                  : _db( other._db ), _sessions( std::move( other._sessions ) ), _apply( other._apply )
+               {
+                  other._apply = false;
+               }
+               session& operator=( session&& ) = delete;
+               // See database::session::~session
+               ~session() {
+                  try {
+                     undo();
+                  } catch( const std::exception& e ) {
+                     std::cerr << "CHAINBASE: could not undo session, it is left on the undo stack: " << e.what() << std::endl;
+                     push();
+                  } catch( ... ) {
+                     std::cerr << "CHAINBASE: could not undo session, it is left on the undo stack" << std::endl;
+                     push();
+                  }
+               }
+
+               void push()
+               {
+                  std::apply( []( auto&... s ) { ( s.push(), ... ); }, _sessions );
+                  _apply = false;
+               }
+
+               void squash()
+               {
+                  if( !_apply ) return;
+                  if( _db.is_committed() ) return push();
+                  _db._db.unspill( 2 );
+                  if( _db._db._trace ) _db._db._trace->squash();
+                  std::apply( []( auto&... s ) { ( s.squash(), ... ); }, _sessions );
+                  _apply = false;
+               }
+
+               void undo()
+               {
+                  if( !_apply ) return;
+                  if( _db.is_committed() ) return push();
+                  _db._db.unspill( 1 );
+                  if( _db._db._trace ) _db._db._trace->undo();
+                  std::apply( []( auto&... s ) { ( s.undo(), ... ); }, _sessions );
+                  _apply = false;
+                  _db.after_undo();
+               }
+
+            private:
+               friend class typed_database;
+               using sessions_type = std::tuple<typename generic_index<MultiIndexTypes>::session...>;
+               session( typed_database& db, sessions_type&& sessions, bool apply )
+                  : _db( db ), _sessions( std::move( sessions ) ), _apply( apply ) {}
+
+               typed_database& _db;
+               sessions_type   _sessions;
+               bool            _apply;
+         };
+
+         session start_undo_session( bool enabled )
+         {
+            require_eager_sessions();
+            if( enabled && _db._trace ) _db._trace->start_session();
+            session result( *this, std::apply( [&]( auto*... idx ) {
+               return typename session::sessions_type( idx->start_undo_session( enabled )... );
+            }, _indices ), enabled );
+            if( enabled && _db._undo_spill_depth > 0 ) _db.spill_undo_history();
+            return result;
+         }
+
+         int64_t revision()const { return std::get<0>( _indices )->revision(); }
+
+         void undo()
+         {
+            require_eager_sessions();
+            if( is_committed() ) return;
+            _db.unspill( 1 );
+            if( _db._trace ) _db._trace->undo();
+            std::apply( []( auto*... idx ) { ( idx->undo(), ... ); }, _indices );
+            after_undo();
+         }
+
+         void squash()
+         {
+            require_eager_sessions();
+            if( is_committed() ) return;
+            _db.unspill( 2 );
+            if( _db._trace ) _db._trace->squash();
+            std::apply( []( auto*... idx ) { ( idx->squash(), ... ); }, _indices );
+         }
+
+         void commit( int64_t revision ) { _db.commit( revision ); }
+         void undo_all() { _db.undo_all(); }
+
+         template<typename MultiIndexType>
+         const generic_index<MultiIndexType>& get_index()const
+         {
+            return *std::get<generic_index<MultiIndexType>*>( _indices );
+         }
+
+         template<typename MultiIndexType>
+         generic_index<MultiIndexType>& get_mutable_index()
+         {
+            return *std::get<generic_index<MultiIndexType>*>( _indices );
+         }
+
+         database& db() { return _db; }
+         const database& db()const { return _db; }
+
+      private:
+         static bool is_registered( const database& db, uint16_t type_id )
+         {
+            return db._index_map.size() > type_id && db._index_map[type_id];
+         }
+
+         // Throws before any index is added if the database holds an index that is not listed
+         static database& check_coverage( database& db )
+         {
+            const std::size_t listed = ( std::size_t( 0 ) + ... + is_registered( db, generic_index<MultiIndexTypes>::value_type::type_id ) );
+            if( db._index_list.size() != listed )
+               BOOST_THROW_EXCEPTION( std::logic_error( "typed_database does not cover every index of the database" ) );
+            return db;
+         }
+
+         void require_eager_sessions()const
+         {
+            if( _db._lazy_sessions )
+               BOOST_THROW_EXCEPTION( std::logic_error( "typed_database does not support lazy sessions" ) );
+         }
+
+         template<typename MultiIndexType>
+         static generic_index<MultiIndexType>* add_index( database& db )
+         {
+            const auto type_id = generic_index<MultiIndexType>::value_type::type_id;
+            if( !is_registered( db, type_id ) )
+               db.add_index<MultiIndexType>();
+            return &db.get_mutable_index<MultiIndexType>();
+         }
+
+         bool is_committed()const { return _db.is_committed( revision() ); }
+
+         void after_undo()
+         {
+            if( _db._undo_spill_depth > 0 ) _db.truncate_undo_spill();
+            _db.release_undone_pins();
+         }
+
+         database&                                          _db;
+         std::tuple<generic_index<MultiIndexTypes>*...>     _indices;
+   };
+
+}  // namespace chainbase
@@ -1,10 +1,12 @@
 #pragma once
 
 #include <boost/multi_index_container_fwd.hpp>
+#include <boost/multi_index/ranked_index_fwd.hpp>
 #include <boost/intrusive/set.hpp>
 #include <boost/intrusive/avltree.hpp>
 #include <boost/intrusive/slist.hpp>
 #include <boost/container/deque.hpp>
+#include <boost/container/vector.hpp>
 #include <boost/throw_exception.hpp>
 #include <boost/mpl/fold.hpp>
 #include <boost/mp11/list.hpp>
@@ -13,10 +15,25 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/core/demangle.hpp>
 #include <boost/interprocess/interprocess_fwd.hpp>
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstring>
+#include <future>
+#include <map>
 #include <memory>
+#include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <sstream>
+#include <vector>
+
+namespace boost { namespace multi_index {
+   template<typename CompositeKey>
+   struct composite_key_result;
+}}
 
 namespace chainbase {
 
@@ -40,6 +57,14 @@ namespace chainbase {
       decltype(auto) operator()(const T& arg) const { return KeyExtractor{}(arg); }
    };
 
+   // Keys that are saved before a modify to skip the trees whose key did not change.  A saved
+   // key must be a value that does not refer to the object it was extracted from, or it would
+   // compare equal to the key after the modify, and must be cheap to copy.  Other keys, such as
+   // composite keys, strings and views, are compared against the backup of the object instead.
+   // Specialize this for other trivially copyable value types.
+   template<typename Key>
+   constexpr bool is_saved_key = std::is_arithmetic_v<Key> || std::is_enum_v<Key>;
+
    template<typename T>
    struct value_holder {
       template<typename... A>
@@ -47,8 +72,20 @@ namespace chainbase {
       T _item;
    };
 
+   // Indices declared as ranked_unique keep the size of every subtree in their
+   // nodes, which allows set_impl to count, rank and index values in O(log n).
+   template<typename OrderedIndex>
+   constexpr bool is_ranked_index = false;
+   template<typename... T>
+   constexpr bool is_ranked_index<boost::multi_index::ranked_unique<T...>> = true;
+
+   struct subtree_size_field {
+      uint64_t _subtree_size;
+   };
+   struct no_subtree_size_field {};
+
    template<class Tag>
-   struct offset_node_base {
+   struct offset_node_base : std::conditional_t<is_ranked_index<Tag>, subtree_size_field, no_subtree_size_field> {
       offset_node_base() = default;
       offset_node_base(const offset_node_base&) {}
       constexpr offset_node_base& operator=(const offset_node_base&) { return *this; }
@@ -163,6 +200,8 @@ namespace chainbase {
    constexpr bool is_valid_index = false;
    template<typename... T>
    constexpr bool is_valid_index<boost::multi_index::ordered_unique<T...>> = true;
+   template<typename... T>
+   constexpr bool is_valid_index<boost::multi_index::ranked_unique<T...>> = true;
 
    template<typename Node, typename Tag>
    using list_base = boost::intrusive::slist<
@@ -180,9 +219,124 @@ namespace chainbase {
       }
    }
 
+   // Specialize to std::true_type to maintain a dense id -> node table for T.
+   // find and get by primary key then cost a single indexed load instead of
+   // a tree descent.  The table holds one pointer per id ever assigned.
+   template<typename T>
+   struct use_dense_id_table : std::false_type {};
+
+   // Specialize to std::true_type to record only the bytes that each modify of T changed
+   // in the undo history, instead of a copy of the whole object.  T must be trivially
+   // copyable.  The old values of such objects are not available from last_undo_session
+   // or delta_between.
+   template<typename T>
+   struct use_diff_undo : std::false_type {};
+
+   // Specialize to receive notifications of the changes made to every undo_index of T.
+   // Specializations should derive from undo_index_observer_base<T> and hide the hooks
+   // that they need.  Without a specialization, no hook code is generated.
+   template<typename T>
+   struct undo_index_observer {
+      static constexpr bool enabled = false;
+   };
+
+   // Hooks are called synchronously and must neither throw nor change the index.  on_undo is
+   // called by undo and undo_all, which database::set_parallel_undo may run for several
+   // indices at once on worker threads.  Hooks of different types can then run concurrently, so
+   // an observer that shares state across types must synchronize it.  The hooks of one index
+   // are always called from one thread at a time.
+   template<typename T>
+   struct undo_index_observer_base {
+      static constexpr bool enabled = true;
+      // Called after obj was created
+      static void after_emplace(const T& obj) noexcept {}
+      // Called before and after a successful modify of obj.  If the modify fails, obj is
+      // either restored without a call to after_modify, or removed.
+      static void before_modify(const T& obj) noexcept {}
+      static void after_modify(const T& obj) noexcept {}
+      // Called before obj is removed
+      static void before_remove(const T& obj) noexcept {}
+      // Called by undo for each object that it changes, before the change.  before is the
+      // current value and after the value that undo restores.  before is nullptr for objects
+      // that are restored after a remove, and after is nullptr for objects that are erased.
+      static void on_undo(const T* before, const T* after) noexcept {}
+   };
+
+   template<typename Id>
+   std::size_t id_to_index(const Id& id) {
+      if constexpr (std::is_integral_v<Id>) return static_cast<std::size_t>(id);
+      else return static_cast<std::size_t>(id._id);
+   }
+
+   // Ids are assigned sequentially and only reused when an insertion is undone,
+   // so a chunked array indexed by id stays compact.  Chunks are allocated on
+   // demand and are only released when the table is destroyed.
+   template<typename Node, typename Allocator>
+   class dense_id_table {
+    public:
+      using node_pointer = typename std::allocator_traits<rebind_alloc_t<Allocator, Node>>::pointer;
+      using chunk_allocator = rebind_alloc_t<Allocator, node_pointer>;
+      using chunk_alloc_traits = std::allocator_traits<chunk_allocator>;
+      using chunk_pointer = typename chunk_alloc_traits::pointer;
+      static constexpr std::size_t chunk_size = 1024;
+
+      dense_id_table() = default;
+      explicit dense_id_table(const Allocator& a) : _chunks{a}, _chunk_allocator{a} {}
+      dense_id_table(const dense_id_table&) = delete;
+      dense_id_table& operator=(const dense_id_table&) = delete;
+      ~dense_id_table() {
+         for(auto& c : _chunks) chunk_alloc_traits::deallocate(_chunk_allocator, c, chunk_size);
+      }
+
+      // Exception safety: strong
+      void reserve(std::size_t idx) {
+         while(_chunks.size() <= idx / chunk_size) {
+            chunk_pointer c = chunk_alloc_traits::allocate(_chunk_allocator, chunk_size);
+            auto guard = scope_exit{[&]{ chunk_alloc_traits::deallocate(_chunk_allocator, c, chunk_size); }};
+            std::uninitialized_fill_n(&*c, chunk_size, node_pointer{});
+            _chunks.push_back(c);
+            guard.cancel();
+         }
+      }
+      // The slot must have been reserved
+      void set(std::size_t idx, Node* n) noexcept {
+         _chunks[idx / chunk_size][idx % chunk_size] = n;
+      }
+      void reset(std::size_t idx) noexcept {
+         if(idx / chunk_size < _chunks.size()) _chunks[idx / chunk_size][idx % chunk_size] = nullptr;
+      }
+      Node* get(std::size_t idx) const noexcept {
+         if(idx / chunk_size >= _chunks.size()) return nullptr;
+         const node_pointer& p = _chunks[idx / chunk_size][idx % chunk_size];
+         return p ? &*p : nullptr;
+      }
+
+    private:
+      boost::container::vector<chunk_pointer, rebind_alloc_t<Allocator, chunk_pointer>> _chunks;
+      chunk_allocator _chunk_allocator;
+   };
+
+   struct no_id_table {
+      no_id_table() = default;
+      template<typename A>
+      explicit no_id_table(const A&) {}
+   };
+
    template<typename T, typename Allocator, typename... Indices>
    class undo_index;
-  
+
+   // Hints that the size bytes at p will be read soon.
+   inline void prefetch_for_read(const void* p, std::size_t size) noexcept {
+#if defined(__GNUC__)
+      constexpr std::size_t cache_line_size = 64;
+      for(std::size_t offset = 0; offset < size; offset += cache_line_size)
+         __builtin_prefetch(static_cast<const char*>(p) + offset, 0, 3);
+#else
+      (void)p;
+      (void)size;
+#endif
+   }
+
    template<typename Node, typename OrderedIndex>
    struct set_impl : private set_base<Node, OrderedIndex> {
       using base_type = set_base<Node, OrderedIndex>;
@@ -210,8 +364,296 @@ namespace chainbase {
       using base_type::size;
       using base_type::iterator_to;
       using base_type::empty;
+
+      // The maximum number of values that for_each_batch_in_range passes at once
+      static constexpr std::size_t scan_batch_size = 64;
+
+      // Calls f(const value_type&) for the values in [first, last) in order.  The nodes are
+      // prefetched before the walk reaches them, see prefetching_walk.
+      template<typename F>
+      void for_each_in_range(typename base_type::const_iterator first, typename base_type::const_iterator last, F&& f) const {
+         for(prefetching_walk walk(*this, first.pointed_node(), last.pointed_node()); !walk.done(); walk.next()) f(walk.value());
+      }
+
+      // Calls f(const value_type* const* values, std::size_t count) for consecutive blocks of up to
+      // scan_batch_size values in [first, last), which are collected by a prefetching_walk.
+      template<typename F>
+      void for_each_batch_in_range(typename base_type::const_iterator first, typename base_type::const_iterator last, F&& f) const {
+         std::array<const typename base_type::value_type*, scan_batch_size> batch;
+         prefetching_walk walk(*this, first.pointed_node(), last.pointed_node());
+         while(!walk.done()) {
+            std::size_t n = 0;
+            for(; !walk.done() && n < batch.size(); walk.next()) batch[n++] = &walk.value();
+            f(static_cast<const typename base_type::value_type* const*>(batch.data()), n);
+         }
+      }
+
+      // The number of searches that find_batch runs together
+      static constexpr std::size_t batch_find_width = 16;
+
+      // Looks up each key in [first, last) and writes a pointer to the matching value, or
+      // nullptr, to out.  Up to batch_find_width searches descend the tree together, one
+      // level per round, and each round prefetches the nodes that the next round reads,
+      // so that the cache misses of the searches overlap.  Returns the end of the output.
+      template<typename KeyIterator, typename OutputIterator>
+      OutputIterator find_batch(KeyIterator first, KeyIterator last, OutputIterator out) const {
+         std::array<KeyIterator, batch_find_width> keys;
+         std::array<node_ptr, batch_find_width> current;
+         std::array<node_ptr, batch_find_width> candidate; // the lowest node that is not less than the key
+         const auto& comp = this->key_comp();
+         typename base_type::key_of_value key_of;
+         auto node_key = [&](node_ptr n) -> decltype(auto) { return key_of(*value_traits::to_value_ptr(n)); };
+         while(first != last) {
+            std::size_t n = 0;
+            for(; first != last && n < batch_find_width; ++first, ++n) {
+               keys[n] = first;
+               current[n] = root_node();
+               candidate[n] = nullptr;
+            }
+            for(bool active = true; active; ) {
+               active = false;
+               for(std::size_t i = 0; i < n; ++i) {
+                  node_ptr x = current[i];
+                  if(!x) continue;
+                  if(comp(node_key(x), *keys[i])) {
+                     x = node_traits::get_right(x);
+                  } else {
+                     candidate[i] = x;
+                     x = node_traits::get_left(x);
+                  }
+                  current[i] = x;
+                  if(x) {
+                     prefetch_for_read(&*x, 1);
+                     prefetch_for_read(value_traits::to_value_ptr(x), 1);
+                     active = true;
+                  }
+               }
+            }
+            for(std::size_t i = 0; i < n; ++i) {
+               node_ptr x = candidate[i];
+               *out++ = x && !comp(*keys[i], node_key(x)) ? &*value_traits::to_value_ptr(x) : nullptr;
+            }
+         }
+         return out;
+      }
+
+      static constexpr bool ranked = is_ranked_index<OrderedIndex>;
+
+      // The following are only available for ranked_unique indices.  Each takes O(log n).
+
+      // Returns the number of values that are not less than lower and less than upper
+      template<typename K>
+      std::size_t count(const K& lower, const K& upper) const {
+         std::size_t first = rank(lower_bound(lower));
+         std::size_t last = rank(lower_bound(upper));
+         return last > first ? last - first : 0;
+      }
+      // Returns the number of values before iter
+      std::size_t rank(typename base_type::const_iterator iter) const {
+         static_assert(ranked, "rank requires a ranked_unique index");
+         if(iter == end()) return size();
+         auto n = iter.pointed_node();
+         std::size_t result = subtree_size(node_traits::get_left(n));
+         for(auto root = root_node(); n != root; ) {
+            auto parent = node_traits::get_parent(n);
+            if(node_traits::get_right(parent) == n) result += subtree_size(node_traits::get_left(parent)) + 1;
+            n = parent;
+         }
+         return result;
+      }
+      // Returns an iterator to the value at position n, or end() if n >= size()
+      typename base_type::const_iterator nth(std::size_t n) const {
+         static_assert(ranked, "nth requires a ranked_unique index");
+         if(n >= size()) return end();
+         node_ptr current = root_node();
+         for(;;) {
+            std::size_t left_size = subtree_size(node_traits::get_left(current));
+            if(n < left_size) {
+               current = node_traits::get_left(current);
+            } else if(n == left_size) {
+               return this->iterator_to(*value_traits::to_value_ptr(current));
+            } else {
+               n -= left_size + 1;
+               current = node_traits::get_right(current);
+            }
+         }
+      }
+
+      // Returns the number of nodes on the longest path from the root.  The balance of each
+      // AVL node points to its taller subtree, so this only follows one path.
+      std::size_t height() const noexcept {
+         std::size_t result = 0;
+         for(node_ptr n = root_node(); n; ++result) {
+            n = node_traits::get_balance(n) > 0 ? node_traits::get_right(n) : node_traits::get_left(n);
+         }
+         return result;
+      }
+
       template<typename T, typename Allocator, typename... Indices>
       friend class undo_index;
+    private:
+      using node_traits = typename base_type::node_traits;
+      using node_ptr = typename node_traits::node_ptr;
+      using value_traits = offset_node_value_traits<Node, OrderedIndex>;
+      using value_type = typename base_type::value_type;
+
+      // The operations that change the tree are wrapped to keep the subtree sizes
+      // of ranked indices up to date.  They are forwarded unchanged otherwise.
+      std::pair<typename base_type::iterator, bool> insert_unique(value_type& v) {
+         auto result = base_type::insert_unique(v);
+         if(result.second) update_sizes_after_insert(v);
+         return result;
+      }
+      typename base_type::iterator insert_equal(value_type& v) {
+         auto result = base_type::insert_equal(v);
+         update_sizes_after_insert(v);
+         return result;
+      }
+      typename base_type::iterator insert_before(typename base_type::const_iterator pos, value_type& v) {
+         auto result = base_type::insert_before(pos, v);
+         update_sizes_after_insert(v);
+         return result;
+      }
+      void push_back(value_type& v) {
+         base_type::push_back(v);
+         update_sizes_after_insert(v);
+      }
+      typename base_type::iterator erase(typename base_type::const_iterator iter) noexcept {
+         return erase_and_dispose(iter, [](value_type*){});
+      }
+      template<typename Disposer>
+      typename base_type::iterator erase_and_dispose(typename base_type::const_iterator iter, Disposer&& d) noexcept {
+         if constexpr (ranked) {
+            node_ptr start = rebalance_start(iter.pointed_node());
+            auto result = base_type::erase_and_dispose(iter, d);
+            update_sizes(start);
+            return result;
+         } else {
+            return base_type::erase_and_dispose(iter, d);
+         }
+      }
+      template<typename Disposer>
+      typename base_type::iterator erase_and_dispose(typename base_type::const_iterator first, typename base_type::const_iterator last, Disposer&& d) noexcept {
+         if constexpr (ranked) {
+            while(first != last) first = erase_and_dispose(first, d);
+            return last.unconst();
+         } else {
+            return base_type::erase_and_dispose(first, last, d);
+         }
+      }
+
+      // Visits the nodes in [first, last) in order and prefetches the nodes that it reaches later.
+      // The right child of each node on a path down to the leftmost node of a subtree is visited
+      // after the left subtree of that node, so it is prefetched when the path is taken.  The
+      // left descendants of such a node are visited just before it.  They are prefetched a level
+      // at a time from a queue, once the node above has had the time to arrive, so that reading
+      // the link to the next level does not stall.
+      class prefetching_walk {
+       public:
+         prefetching_walk(const set_impl& set, node_ptr first, node_ptr last) : _current(first), _last(last) {
+            if(first == last) return;
+            // The parent of the root is the header, which a const tree only hands out as a const pointer
+            const node_ptr header = node_traits::get_parent(set.root_node());
+            // The ancestors of first whose left subtree holds it, and their right subtrees, follow it
+            candidate(node_traits::get_right(first));
+            for(node_ptr n = first, parent = node_traits::get_parent(n); parent != header; n = parent, parent = node_traits::get_parent(n)) {
+               if(node_traits::get_left(parent) == n) candidate(node_traits::get_right(parent));
+            }
+         }
+         bool done() const { return _current == _last; }
+         const value_type& value() const { return *value_traits::to_value_ptr(_current); }
+         void next() {
+            if(node_ptr n = node_traits::get_right(_current)) {
+               for(node_ptr left; (left = node_traits::get_left(n)); n = left) candidate(node_traits::get_right(left));
+               _current = n;
+            } else {
+               _current = boost::intrusive::bstree_algorithms<node_traits>::next_node(_current);
+            }
+            if(_tail - _head > queue_delay) candidate(node_traits::get_left(_queue[_head++ % _queue.size()]));
+         }
+       private:
+         // The number of nodes that are prefetched after a node before its link is read
+         static constexpr std::size_t queue_delay = 2;
+         void candidate(node_ptr n) {
+            if(!n) return;
+            prefetch_for_read(&*n, 1);
+            prefetch_for_read(value_traits::to_value_ptr(n), 1);
+            if(_tail - _head == _queue.size()) ++_head;
+            _queue[_tail++ % _queue.size()] = n;
+         }
+         node_ptr                 _current;
+         node_ptr                 _last;
+         std::array<node_ptr, 16> _queue;
+         std::size_t              _head = 0;
+         std::size_t              _tail = 0;
+      };
+
+      static std::size_t subtree_size(node_ptr n) noexcept {
+         if constexpr (ranked) return n ? n->_subtree_size : 0;
+         else return 0;
+      }
+      node_ptr root_node() const noexcept {
+         return node_traits::get_parent(this->header_ptr());
+      }
+      void update_sizes_after_insert(value_type& v) noexcept {
+         if constexpr (ranked) update_sizes(value_traits::to_node_ptr(v));
+      }
+      // Returns the lowest node whose subtree changes when n is erased
+      node_ptr rebalance_start(node_ptr n) const noexcept {
+         node_ptr left = node_traits::get_left(n);
+         node_ptr right = node_traits::get_right(n);
+         if(!left || !right) return node_traits::get_parent(n);
+         node_ptr successor = right;
+         while(node_ptr next = node_traits::get_left(successor)) successor = next;
+         node_ptr parent = node_traits::get_parent(successor);
+         return parent == n ? successor : parent;
+      }
+      // Recomputes the subtree sizes after an insert or erase, starting at the lowest
+      // node whose subtree changed.  Rebalancing only rotates nodes on the path from
+      // there to the root and their children, and the children of those are unchanged.
+      void update_sizes(node_ptr n) noexcept {
+         node_ptr header = this->header_ptr();
+         node_ptr from = nullptr;
+         for(; n != header; from = n, n = node_traits::get_parent(n)) {
+            for(node_ptr child : { node_traits::get_left(n), node_traits::get_right(n) }) {
+               if(child && child != from) recompute_size(child);
+            }
+            recompute_size(n);
+         }
+      }
+      static void recompute_size(node_ptr n) noexcept {
+         n->_subtree_size = subtree_size(node_traits::get_left(n)) + subtree_size(node_traits::get_right(n)) + 1;
+      }
+
+      // Links values, which must be sorted and unique, into this empty tree.
+      // The result is perfectly balanced and is built bottom-up in linear time.
+      template<typename Ptr>
+      void build_from_sorted(const Ptr* values, std::size_t n) noexcept {
+         assert(this->empty());
+         if(n == 0) return;
+         node_ptr header = this->header_ptr();
+         node_ptr root = build_subtree(values, 0, n, header).first;
+         node_traits::set_parent(header, root);
+         node_traits::set_left(header, value_traits::to_node_ptr(*values[0]));
+         node_traits::set_right(header, value_traits::to_node_ptr(*values[n - 1]));
+         this->sz_traits().set_size(n);
+      }
+      // Returns the root of the subtree holding values[lo, hi) and its height
+      template<typename Ptr>
+      static std::pair<node_ptr, int> build_subtree(const Ptr* values, std::size_t lo, std::size_t hi, node_ptr parent) noexcept {
+         if(lo == hi) return { nullptr, 0 };
+         std::size_t mid = lo + (hi - lo) / 2;
+         node_ptr n = value_traits::to_node_ptr(*values[mid]);
+         auto [left, left_height] = build_subtree(values, lo, mid, n);
+         auto [right, right_height] = build_subtree(values, mid + 1, hi, n);
+         node_traits::set_parent(n, parent);
+         node_traits::set_left(n, left);
+         node_traits::set_right(n, right);
+         if constexpr (ranked) n->_subtree_size = hi - lo;
+         // The left half is never smaller than the right half
+         node_traits::set_balance(n, right_height < left_height ? node_traits::negative() : node_traits::zero());
+         return { n, left_height + 1 };
+      }
    };
 
    template<typename T, typename S>
@@ -229,6 +671,26 @@ namespace chainbase {
    template<typename T, typename S>
    auto propagate_allocator(chainbase::chainbase_node_allocator<T, S>& a) { return boost::interprocess::allocator<T, S>{a.get_segment_manager()}; }
 
+   // The last member of every undo_index.  Its layout does not depend on the value type, so that
+   // tools can read an index in a database file without the types of the application, see
+   // tools/inspect.cpp.  The counts are a summary of the index that is refreshed by
+   // undo_index::update_footer, which database calls when it is closed.
+   struct undo_index_footer {
+      static constexpr uint32_t magic_value = 0x46495543; // "CUIF"
+      uint32_t size_of_value_type = 0;
+      uint32_t size_of_this = 0;
+      uint32_t magic = magic_value;
+      uint32_t index_count = 0;
+      uint64_t row_count = 0;
+      uint64_t next_id = 0;
+      int64_t  revision = 0;
+      uint64_t undo_sessions = 0;
+      uint64_t spilled_sessions = 0;
+      uint64_t undo_records = 0;
+      uint64_t undo_bytes = 0;
+   };
+   static_assert(sizeof(undo_index_footer) % alignof(uint64_t) == 0, "undo_index_footer must end the undo_index without padding");
+
    // Similar to boost::multi_index_container with an undo stack.
    // Indices should be instances of ordered_unique.
    template<typename T, typename Allocator, typename... Indices>
@@ -241,7 +703,7 @@ namespace chainbase {
       static_assert((... && is_valid_index<Indices>), "Only ordered_unique indices are supported");
 
       undo_index() = default;
-      explicit undo_index(const Allocator& a) : _undo_stack{a}, _allocator{a}, _old_values_allocator{a} {}
+      explicit undo_index(const Allocator& a) : _undo_stack{a}, _allocator{a}, _old_values_allocator{a}, _diff_allocator{a}, _diff_data_allocator{a}, _id_table{a} {}
       ~undo_index() {
          dispose_undo();
          clear_impl<1>();
@@ -249,7 +711,7 @@ namespace chainbase {
       }
 
       void validate()const {
-         if( sizeof(node) != _size_of_value_type || sizeof(*this) != _size_of_this )
+         if( sizeof(node) != _footer.size_of_value_type || sizeof(*this) != _footer.size_of_this )
             BOOST_THROW_EXCEPTION( std::runtime_error("content of memory does not match data expected by executable") );
       }
     
@@ -275,11 +737,37 @@ namespace chainbase {
          using value_type = T;
          using allocator_type = Allocator;
          template<typename... A>
-         explicit old_node(const T& t) : value_holder<T>{t} {}
+         explicit old_node(A&&... a) : value_holder<T>{static_cast<A&&>(a)...} {}
          uint64_t _mtime = 0; // Backup of the node's _mtime, to be restored on undo
          typename alloc_traits::pointer _current; // pointer to the actual node
       };
 
+      static constexpr bool diff_undo = use_diff_undo<T>::value;
+      using observer = undo_index_observer<T>;
+      static_assert(!diff_undo || std::is_trivially_copyable_v<T>, "diff undo requires a trivially copyable type");
+      using diff_data_alloc_traits = typename std::allocator_traits<Allocator>::template rebind_traits<uint64_t>;
+
+      // An undo record that holds the bytes of an object that were changed by a modify,
+      // as a sequence of (uint32 offset, uint32 size, old bytes).  Small diffs are
+      // stored inline and larger ones in a separate allocation.
+      struct diff_record {
+         static constexpr std::size_t inline_size = 32;
+         const char* data() const { return _size <= inline_size ? _inline : reinterpret_cast<const char*>(&*_external); }
+         char* data() { return const_cast<char*>(static_cast<const diff_record*>(this)->data()); }
+         typename alloc_traits::pointer _current; // pointer to the modified node
+         id_type _id{}; // The id of _current, which no longer exists if it was created in the same session
+         uint64_t _mtime = 0; // Backup of the node's _mtime, to be restored on undo
+         uint32_t _size = 0;
+         char _inline[inline_size];
+         typename diff_data_alloc_traits::pointer _external;
+      };
+      struct diff_node : hook<index0_type, Allocator>, value_holder<diff_record> {
+         using value_type = diff_record;
+         using allocator_type = Allocator;
+      };
+      using diff_alloc_traits = typename std::allocator_traits<Allocator>::template rebind_traits<diff_node>;
+      using diff_pointer = typename std::allocator_traits<Allocator>::template rebind_traits<diff_record>::pointer;
+
       using id_pointer = id_type*;
       using pointer = value_type*;
       using const_iterator = typename index0_set_type::const_iterator;
@@ -334,8 +822,14 @@ namespace chainbase {
          typename std::allocator_traits<Allocator>::pointer removed_values_end;
          id_type old_next_id = 0;
          uint64_t ctime = 0; // _monotonic_revision at the point the undo_state was created
+         uint64_t old_record_count = 0; // _record_count at the point the undo_state was created
+         diff_pointer diff_values_end;
+         int64_t spill_location = -1; // Set when the records of the session have been moved out of memory by spill
       };
 
+      // The constructor may raise the id it is given (e.g. to replicate an object
+      // created elsewhere), but not lower it.
+      //
       // Exception safety: strong
       template<typename Constructor>
       const value_type& emplace( Constructor&& c ) {
@@ -348,27 +842,91 @@ namespace chainbase {
          };
          alloc_traits::construct(_allocator, &*p, constructor, propagate_allocator(_allocator));
          auto guard1 = scope_exit{[&]{ alloc_traits::destroy(_allocator, &*p); }};
+         if(p->_item.id < new_id)
+            BOOST_THROW_EXCEPTION( std::logic_error{ "could not insert object, the id is already in use" } );
+         if constexpr (use_dense_id_table<T>::value) _id_table.reserve(id_to_index(p->_item.id));
          if(!insert_impl<1>(p->_item))
             BOOST_THROW_EXCEPTION( std::logic_error{ "could not insert object, most likely a uniqueness constraint was violated" } );
          std::get<0>(_indices).push_back(p->_item); // cannot fail and we know that it will definitely insert at the end.
+         link_id(p->_item);
          on_create(p->_item);
+         _next_id = p->_item.id;
          ++_next_id;
          guard1.cancel();
          guard0.cancel();
+         if constexpr (observer::enabled) observer::after_emplace(p->_item);
          return p->_item;
       }
 
+      // Creates one object for each element of [first, last) by calling c(value, element).
+      // Ids are assigned sequentially.  The constructor may raise the id it is given,
+      // (e.g. to restore a snapshot with gaps) as long as ids remain strictly increasing.
+      //
+      // The index must be empty.  Instead of rebalancing every tree on each insert,
+      // the nodes are sorted once per index, in parallel when there are enough of them,
+      // and each tree is built bottom-up in linear time.
+      //
+      // Exception safety: strong
+      template<typename Iter, typename Constructor>
+      void bulk_emplace( Iter first, Iter last, Constructor&& c ) {
+         if(!empty())
+            BOOST_THROW_EXCEPTION( std::logic_error{ "bulk_emplace requires an empty index" } );
+         std::vector<value_type*> values;
+         if constexpr (std::is_base_of_v<std::forward_iterator_tag, typename std::iterator_traits<Iter>::iterator_category>)
+            values.reserve(std::distance(first, last));
+         auto guard0 = scope_exit{[&]{ for(value_type* v : values) dispose_node(*v); }};
+         auto next_id = _next_id;
+         for(; first != last; ++first) {
+            auto p = alloc_traits::allocate(_allocator, 1);
+            auto guard1 = scope_exit{[&]{ alloc_traits::deallocate(_allocator, p, 1); }};
+            auto constructor = [&]( value_type& v ) {
+               v.id = next_id;
+               c( v, *first );
+            };
+            alloc_traits::construct(_allocator, &*p, constructor, propagate_allocator(_allocator));
+            auto guard2 = scope_exit{[&]{ alloc_traits::destroy(_allocator, &*p); }};
+            if(p->_item.id < next_id)
+               BOOST_THROW_EXCEPTION( std::logic_error{ "bulk_emplace requires strictly increasing ids" } );
+            values.push_back(&p->_item);
+            guard2.cancel();
+            guard1.cancel();
+            next_id = p->_item.id;
+            ++next_id;
+         }
+         if(values.empty()) return;
+         if constexpr (use_dense_id_table<T>::value) _id_table.reserve(id_to_index(values.back()->id));
+         // values is already in id order
+         auto sorted = sort_for_bulk_build<1>(values);
+         std::get<0>(_indices).build_from_sorted(values.data(), values.size());
+         build_sorted_impl<1>(sorted);
+         for(value_type* v : values) {
+            link_id(*v);
+            on_create(*v);
+         }
+         _next_id = next_id;
+         guard0.cancel();
+         if constexpr (observer::enabled) {
+            for(value_type* v : values) observer::after_emplace(*v);
+         }
+      }
+
       // Exception safety: basic.
       // If the modifier leaves the object in a state that conflicts
       // with another object, it will either be reverted or erased.
       template<typename Modifier>
       void modify( const value_type& obj, Modifier&& m) {
+         if constexpr (diff_undo) {
+            modify_diff(obj, m);
+            return;
+         }
+         if constexpr (observer::enabled) observer::before_modify(obj);
+         saved_keys keys = save_keys(obj);
          value_type* backup = on_modify(obj);
          value_type& node_ref = const_cast<value_type&>(obj);
          bool success = false;
          {
             auto guard0 = scope_exit{[&]{
-               if(!post_modify<true, 1>(node_ref)) { // The object id cannot be modified
+               if(!post_modify_changed(node_ref, keys, backup)) { // The object id cannot be modified
                   if(backup) {
                      node_ref = std::move(*backup);
                      bool success = post_modify<true, 1>(node_ref);
@@ -390,6 +948,90 @@ namespace chainbase {
          }
          if(!success)
             BOOST_THROW_EXCEPTION( std::logic_error{ "could not modify object, most likely a uniqueness constraint was violated" } );
+         if constexpr (observer::enabled) observer::after_modify(obj);
+      }
+
+      // Modifies each object in [first, last), which must be distinct, by calling m
+      // on them in order.  Unique keys are only checked after all the modifiers have
+      // run, so the objects may exchange keys with each other.
+      //
+      // Exception safety: basic.
+      // If the result conflicts with another object, or a modifier throws, each
+      // object will either be reverted or erased.
+      template<typename Iter, typename Modifier>
+      void modify_each( Iter first, Iter last, Modifier&& m ) {
+         if constexpr (diff_undo) {
+            modify_each_diff(first, last, m);
+            return;
+         }
+         struct modified_value {
+            value_type* value;
+            value_type* backup;
+         };
+         std::vector<modified_value> modified;
+         modified.reserve(std::distance(first, last));
+         std::size_t inserted = 0;
+         auto guard0 = scope_exit{[&]{
+            for(std::size_t i = 0; i < inserted; ++i) erase_impl<1>(*modified[i].value);
+            std::size_t backups = 0;
+            for(const modified_value& v : modified) {
+               if(v.backup) {
+                  *v.value = std::move(*v.backup);
+                  to_node(*v.value)._mtime = to_old_node(*v.backup)._mtime;
+                  ++backups;
+               }
+            }
+            // The backups are the most recently added old values
+            for(; backups > 0; --backups) _old_values.pop_front_and_dispose([this](pointer p){ dispose_old(*p); });
+            for(const modified_value& v : modified) {
+               if(v.backup) {
+                  bool success = insert_impl<1>(*v.value);
+                  (void)success;
+                  assert(success);
+               }
+            }
+            for(const modified_value& v : modified) {
+               if(!v.backup && !insert_impl<1>(*v.value)) {
+                  if constexpr (observer::enabled) observer::before_remove(*v.value);
+                  auto& by_id = std::get<0>(_indices);
+                  by_id.erase(by_id.iterator_to(*v.value));
+                  unlink_id(*v.value);
+                  if(on_remove(*v.value)) {
+                     dispose_node(*v.value);
+                  }
+               }
+            }
+         }};
+         for(; first != last; ++first) {
+            value_type& node_ref = const_cast<value_type&>(static_cast<const value_type&>(*first));
+            if constexpr (observer::enabled) observer::before_modify(node_ref);
+            value_type* backup = on_modify(node_ref);
+            modified.push_back({&node_ref, backup});
+            erase_impl<1>(node_ref);
+            auto old_id = node_ref.id;
+            m(node_ref);
+            (void)old_id;
+            assert(node_ref.id == old_id);
+         }
+         for(; inserted < modified.size(); ++inserted) {
+            if(!insert_impl<1>(*modified[inserted].value))
+               BOOST_THROW_EXCEPTION( std::logic_error{ "could not modify object, most likely a uniqueness constraint was violated" } );
+         }
+         guard0.cancel();
+         if constexpr (observer::enabled) {
+            for(const modified_value& v : modified) observer::after_modify(*v.value);
+         }
+      }
+
+      // Saves the keys of obj, so that changed_keys can tell which of them a modify changes
+      auto key_values(const value_type& obj) const { return save_keys(obj); }
+
+      // Returns a mask with bit N set if the key of obj in index N differs from keys, which were
+      // saved by key_values.  Keys that are not is_saved_key, such as composite keys, are not
+      // saved and are always reported as changed.
+      template<typename Keys>
+      uint64_t changed_keys(const value_type& obj, const Keys& keys) const {
+         return changed_keys_impl(obj, keys, std::make_index_sequence<sizeof...(Indices)>{});
       }
 
       // Allows testing whether a value has been removed from the undo_index.
@@ -428,6 +1070,7 @@ namespace chainbase {
       }
 
       void remove( const value_type& obj ) noexcept {
+         if constexpr (observer::enabled) observer::before_remove(obj);
          auto& node_ref = const_cast<value_type&>(obj);
          erase_impl(node_ref);
          if(on_remove(node_ref)) {
@@ -435,9 +1078,34 @@ namespace chainbase {
          }
       }
 
+      // Removes every object whose key in the given index is in [lower, upper).
+      // Returns the number of objects removed.
+      template<typename Tag, typename LowerKey, typename UpperKey>
+      std::size_t remove_range( LowerKey&& lower, UpperKey&& upper ) {
+         return remove_range<find_tag<Tag, Indices...>::value>(static_cast<LowerKey&&>(lower), static_cast<UpperKey&&>(upper));
+      }
+
+      template<int N, typename LowerKey, typename UpperKey>
+      std::size_t remove_range( LowerKey&& lower, UpperKey&& upper ) {
+         const auto& idx = std::get<N>(_indices);
+         auto first = idx.lower_bound(static_cast<LowerKey&&>(lower));
+         auto last = idx.lower_bound(static_cast<UpperKey&&>(upper));
+         return remove_if_impl<N>(first, last, [](const value_type&) { return true; });
+      }
+
+      // Removes every object for which p returns true.
+      // Exception safety: basic.  If p throws, the objects that were
+      // already selected remain removed.
+      template<typename Pred>
+      std::size_t remove_if( Pred&& p ) {
+         const auto& idx = std::get<0>(_indices);
+         return remove_if_impl<0>(idx.begin(), idx.end(), p);
+      }
+
     private:
 
       void remove( const value_type& obj, removed_nodes_tracker& tracker ) noexcept {
+         if constexpr (observer::enabled) observer::before_remove(obj);
          auto& node_ref = const_cast<value_type&>(obj);
          erase_impl(node_ref);
          if(on_remove(node_ref)) {
@@ -445,10 +1113,53 @@ namespace chainbase {
          }
       }
 
+      // Batched equivalent of calling remove on each selected object in [first, last) of index N.
+      // Nodes that must be kept for undo are collected and spliced onto removed_values
+      // at once, and the rest are disposed together after all trees have been updated.
+      template<int N, typename Iter, typename Pred>
+      std::size_t remove_if_impl( Iter first, Iter last, Pred&& p ) {
+         list_base<node, index0_type> removed;
+         list_base<node, index0_type> disposed;
+         auto removed_last = removed.before_begin();
+         std::size_t count = 0;
+         auto guard = scope_exit{[&]{
+            if(!removed.empty()) {
+               _record_count += removed.size();
+               _removed_values.splice_after(_removed_values.before_begin(), removed, removed.before_begin(), removed_last, removed.size());
+            }
+            disposed.clear_and_dispose([this](pointer p){ dispose_node(*p); });
+         }};
+         const id_type* old_next_id = _undo_stack.empty() ? nullptr : &_undo_stack.back().old_next_id;
+         while(first != last) {
+            auto& node_ref = const_cast<value_type&>(*first);
+            ++first;
+            if(!p(std::as_const(node_ref))) continue;
+            if constexpr (observer::enabled) observer::before_remove(node_ref);
+            erase_impl(node_ref);
+            if(old_next_id && node_ref.id < *old_next_id) {
+               get_removed_field(node_ref) = erased_flag;
+               if(removed.empty()) {
+                  removed.push_front(node_ref);
+                  removed_last = removed.begin();
+               } else {
+                  removed.push_front(node_ref);
+               }
+            } else {
+               disposed.push_front(node_ref);
+            }
+            ++count;
+         }
+         return count;
+      }
+
     public:
 
       template<typename CompatibleKey>
       const value_type* find( CompatibleKey&& key) const {
+         if constexpr (use_dense_id_table<T>::value && std::is_convertible_v<CompatibleKey&&, id_type>) {
+            node* p = _id_table.get(id_to_index(id_type(static_cast<CompatibleKey&&>(key))));
+            return p ? &p->_item : nullptr;
+         }
          const auto& index = std::get<0>(_indices);
          auto iter = index.find(static_cast<CompatibleKey&&>(key));
          if (iter != index.end()) {
@@ -458,6 +1169,23 @@ namespace chainbase {
          }
       }
 
+      // Looks up each id in [first, last) and writes a pointer to the object, or nullptr, to out.
+      // See set_impl::find_batch.
+      template<typename KeyIterator, typename OutputIterator>
+      OutputIterator find_batch( KeyIterator first, KeyIterator last, OutputIterator out ) const {
+         if constexpr (use_dense_id_table<T>::value && std::is_convertible_v<decltype(*first), id_type>) {
+            // The slots are found without touching the nodes, which are prefetched for the caller
+            for(; first != last; ++first) {
+               node* p = _id_table.get(id_to_index(id_type(*first)));
+               if(p) prefetch_for_read(&p->_item, 1);
+               *out++ = p ? &p->_item : nullptr;
+            }
+            return out;
+         } else {
+            return std::get<0>(_indices).find_batch(first, last, out);
+         }
+      }
+
       template<typename CompatibleKey>
       const value_type& get( CompatibleKey&& key )const {
          auto ptr = find( static_cast<CompatibleKey&&>(key) );
@@ -534,21 +1262,299 @@ namespace chainbase {
          return { _revision - _undo_stack.size(), _revision };
       }
 
+      // Returns an upper bound on the number of objects created, modified or removed
+      // by the undo sessions after revision.  This is the amount of work needed
+      // to undo or squash those sessions, and commit( revision ) disposes of the
+      // difference between this and undo_records_since( undo_stack_revision_range().first ).
+      std::size_t undo_records_since( int64_t revision ) const {
+         auto [first, last] = undo_stack_revision_range();
+         if( _undo_stack.empty() || revision >= last ) return 0;
+         const undo_state& state = _undo_stack[std::max(revision, first) - first];
+         return (_record_count - state.old_record_count) + (id_to_index(_next_id) - id_to_index(state.old_next_id));
+      }
+
       /**
        * Discards all undo history prior to revision
        */
       void commit( int64_t revision ) noexcept {
          revision = std::min(revision, _revision);
          if (revision == _revision) {
-            dispose_undo();
+            release_undo();
             _undo_stack.clear();
          } else if( (_revision - revision) < _undo_stack.size() ) {
             auto iter = _undo_stack.begin() + (_undo_stack.size() - (_revision - revision));
-            dispose(get_old_values_end(*iter), get_removed_values_end(*iter));
+            dispose(get_old_values_end(*iter), get_removed_values_end(*iter), get_diff_values_end(*iter));
             _undo_stack.erase(_undo_stack.begin(), iter);
          }
       }
 
+      /**
+       * When enabled, commit only marks the undo history that it discards, and the
+       * memory is released later by reclaim.  This keeps the cost of commit independent
+       * of the amount of history discarded.
+       */
+      void set_deferred_disposal( bool enabled ) { _defer_disposal = enabled; }
+      bool deferred_disposal() const { return _defer_disposal; }
+
+      bool has_pending_reclamation() const {
+         return _old_values_reclaim_start != nullptr || _removed_values_reclaim_start != nullptr || _diff_values_reclaim_start != nullptr;
+      }
+
+      // Releases at most max_nodes of the undo history discarded by commit
+      // while deferred disposal was enabled.  Returns the number of nodes released.
+      std::size_t reclaim( std::size_t max_nodes ) noexcept {
+         std::size_t result = 0;
+         auto reclaim_list = [&](auto& list, auto& start, auto&& disposer) {
+            if(start == nullptr) return;
+            auto pos = list.iterator_to(*start);
+            while(result < max_nodes && std::next(pos) != list.end()) {
+               list.erase_after_and_dispose(pos, disposer);
+               ++result;
+            }
+            if(std::next(pos) == list.end()) start = nullptr;
+         };
+         reclaim_list(_old_values, _old_values_reclaim_start, [this](pointer p){ dispose_old(*p); });
+         reclaim_list(_removed_values, _removed_values_reclaim_start, [this](pointer p){ dispose_node(*p); });
+         reclaim_list(_diff_values, _diff_values_reclaim_start, [this](diff_record* p){ dispose_diff(*p); });
+         return result;
+      }
+
+      // The records of the spilled sessions that are passed to the store function of spill.
+      // Records are listed oldest first, with the _mtime of the old value or removed node.
+      struct spilled_records {
+         std::vector<std::pair<const value_type*, uint64_t>> old_values;
+         std::vector<std::pair<const value_type*, uint64_t>> removed_values;
+         std::vector<const diff_record*> diff_values;
+      };
+
+      // Returns the height of the tree of each index, in the order of Indices
+      std::array<std::size_t, sizeof...(Indices)> tree_heights() const {
+         return std::apply([](const auto&... idx) { return std::array<std::size_t, sizeof...(Indices)>{ idx.height()... }; }, _indices);
+      }
+
+      // The number of records in each of the undo lists, including records that
+      // were discarded by commit and are waiting for reclaim
+      struct undo_list_sizes {
+         std::size_t old_values;
+         std::size_t removed_values;
+         std::size_t diff_values;
+      };
+      undo_list_sizes undo_lists_size() const {
+         return { _old_values.size(), _removed_values.size(), _diff_values.size() };
+      }
+
+      // Records the size of the index and of its undo history in the footer.  The undo bytes are
+      // the memory held by the undo stack and the undo lists, not counting spilled sessions.
+      void update_footer() {
+         auto lists = undo_lists_size();
+         uint64_t diff_bytes = 0;
+         for(const diff_record& record : _diff_values) {
+            if(record._size > diff_record::inline_size) diff_bytes += diff_words(record._size) * sizeof(uint64_t);
+         }
+         _footer.row_count = std::get<0>(_indices).size();
+         _footer.next_id = id_to_index(_next_id);
+         _footer.revision = _revision;
+         _footer.undo_sessions = _undo_stack.size();
+         _footer.spilled_sessions = spilled_sessions();
+         _footer.undo_records = lists.old_values + lists.removed_values + lists.diff_values;
+         _footer.undo_bytes = _undo_stack.size() * sizeof(undo_state) + lists.old_values * sizeof(old_node) +
+                              lists.removed_values * sizeof(node) + lists.diff_values * sizeof(diff_node) + diff_bytes;
+      }
+      const undo_index_footer& footer() const { return _footer; }
+
+      // Returns the number of sessions at the bottom of the undo stack that have been spilled.
+      std::size_t spilled_sessions() const {
+         return std::partition_point(_undo_stack.begin(), _undo_stack.end(),
+                                     [](const undo_state& state) { return state.spill_location >= 0; }) - _undo_stack.begin();
+      }
+
+      // Moves the undo records of all but the newest keep sessions out of memory.  store is
+      // called with the spilled_records of each session that has not been spilled yet, oldest
+      // first, and returns a non-negative location that identifies them for unspill.
+      // Returns the number of sessions that were spilled.
+      //
+      // The records of the sessions that are kept are traversed, so callers should spill
+      // several sessions at a time.  A spilled session must be reloaded with unspill before
+      // it can be undone or squashed.  Committing a spilled session discards it.
+      //
+      // Exception safety: strong, as long as store only has side effects outside the undo_index.
+      template<typename Store>
+      std::size_t spill(std::size_t keep, Store&& store) {
+         std::size_t first = spilled_sessions();
+         if(_undo_stack.size() <= keep || first >= _undo_stack.size() - keep) return 0;
+         std::size_t last = _undo_stack.size() - keep;
+         // The records of session j start at the end of session j + 1
+         std::vector<spilled_records> records(last - first);
+         auto collect = [&](auto& list, auto&& get_end, auto&& add) {
+            auto pos = get_end(_undo_stack[last]);
+            for(std::size_t j = last; j-- > first;) {
+               auto end = get_end(_undo_stack[j]);
+               for(; pos != end; ++pos) add(records[j - first], *pos);
+            }
+         };
+         collect(_old_values, [this](const undo_state& state) { return get_old_values_end(state); },
+                 [](spilled_records& r, value_type& v) { r.old_values.emplace_back(&v, to_old_node(v)._mtime); });
+         collect(_removed_values, [this](const undo_state& state) { return get_removed_values_end(state); },
+                 [](spilled_records& r, value_type& v) { r.removed_values.emplace_back(&v, to_node(v)._mtime); });
+         collect(_diff_values, [this](const undo_state& state) { return get_diff_values_end(state); },
+                 [](spilled_records& r, diff_record& d) { r.diff_values.push_back(&d); });
+         std::vector<int64_t> locations;
+         locations.reserve(records.size());
+         for(spilled_records& r : records) {
+            std::reverse(r.old_values.begin(), r.old_values.end());
+            std::reverse(r.removed_values.begin(), r.removed_values.end());
+            std::reverse(r.diff_values.begin(), r.diff_values.end());
+            locations.push_back(store(static_cast<const spilled_records&>(r)));
+         }
+         // The spilled sessions, and the oldest session that is kept, all end where the
+         // records of the oldest spilled session ended.
+         auto release = [&](auto& list, auto end_member, auto&& get_end, auto&& disposer) {
+            auto spilled_begin = get_end(_undo_stack[last]);
+            auto spilled_end = get_end(_undo_stack[first]);
+            if(spilled_begin != spilled_end) {
+               auto pos = list.before_begin();
+               while(std::next(pos) != spilled_begin) ++pos;
+               list.erase_after_and_dispose(pos, spilled_end, disposer);
+            }
+            auto end_value = _undo_stack[first].*end_member;
+            for(std::size_t j = first; j <= last; ++j) _undo_stack[j].*end_member = end_value;
+         };
+         release(_old_values, &undo_state::old_values_end, [this](const undo_state& state) { return get_old_values_end(state); },
+                 [this](pointer p){ dispose_old(*p); });
+         release(_removed_values, &undo_state::removed_values_end, [this](const undo_state& state) { return get_removed_values_end(state); },
+                 [this](pointer p){ dispose_node(*p); });
+         release(_diff_values, &undo_state::diff_values_end, [this](const undo_state& state) { return get_diff_values_end(state); },
+                 [this](diff_record* p){ dispose_diff(*p); });
+         for(std::size_t j = first; j < last; ++j) _undo_stack[j].spill_location = locations[j - first];
+         return last - first;
+      }
+
+      // Recreates spilled records for unspill.  The records of a session must be added
+      // oldest first, removed values before the old values and diffs that refer to them.
+      class spill_loader {
+       public:
+         spill_loader(const spill_loader&) = delete;
+         spill_loader& operator=(const spill_loader&) = delete;
+         ~spill_loader() {
+            for(; _removed_count > 0; --_removed_count) _self->_removed_values.erase_after_and_dispose(_removed_pos, [this](pointer p){ _self->dispose_node(*p); });
+            for(; _old_count > 0; --_old_count) _self->_old_values.erase_after_and_dispose(_old_pos, [this](pointer p){ _self->dispose_old(*p); });
+            for(; _diff_count > 0; --_diff_count) _self->_diff_values.erase_after_and_dispose(_diff_pos, [this](diff_record* p){ _self->dispose_diff(*p); });
+         }
+         // c(value) must assign every field of the object, including the id
+         template<typename Constructor>
+         void removed_value(uint64_t mtime, Constructor&& c) {
+            auto p = alloc_traits::allocate(_self->_allocator, 1);
+            auto guard0 = scope_exit{[&]{ alloc_traits::deallocate(_self->_allocator, p, 1); }};
+            alloc_traits::construct(_self->_allocator, &*p, c, propagate_allocator(_self->_allocator));
+            guard0.cancel();
+            p->_mtime = mtime;
+            get_removed_field(p->_item) = erased_flag;
+            _self->_removed_values.insert_after(_removed_pos, p->_item);
+            ++_removed_count;
+            _removed.emplace(p->_item.id, &*p);
+         }
+         template<typename Constructor>
+         void old_value(uint64_t mtime, Constructor&& c) {
+            auto p = old_alloc_traits::allocate(_self->_old_values_allocator, 1);
+            auto guard0 = scope_exit{[&]{ old_alloc_traits::deallocate(_self->_old_values_allocator, p, 1); }};
+            old_alloc_traits::construct(_self->_old_values_allocator, &*p, c, propagate_allocator(_self->_old_values_allocator));
+            auto guard1 = scope_exit{[&]{ old_alloc_traits::destroy(_self->_old_values_allocator, &*p); }};
+            node* current = find_current(p->_item.id, mtime);
+            if(!current) return;
+            p->_mtime = mtime;
+            p->_current = current;
+            guard1.cancel();
+            guard0.cancel();
+            _self->_old_values.insert_after(_old_pos, p->_item);
+            ++_old_count;
+         }
+         void diff_value(id_type id, uint64_t mtime, const char* data, uint32_t size) {
+            if(!(id < _state.old_next_id)) return; // Not used by undo
+            node* current = find_current(id, 0);
+            auto p = diff_alloc_traits::allocate(_self->_diff_allocator, 1);
+            auto guard0 = scope_exit{[&]{ diff_alloc_traits::deallocate(_self->_diff_allocator, p, 1); }};
+            diff_alloc_traits::construct(_self->_diff_allocator, &*p);
+            diff_record& record = p->_item;
+            if(size > diff_record::inline_size)
+               record._external = diff_data_alloc_traits::allocate(_self->_diff_data_allocator, diff_words(size));
+            guard0.cancel();
+            record._size = size;
+            record._current = current;
+            record._id = id;
+            record._mtime = mtime;
+            std::memcpy(record.data(), data, size);
+            _self->_diff_values.insert_after(_diff_pos, record);
+            ++_diff_count;
+         }
+       private:
+         friend class undo_index;
+         // The records are older than the records of the session that are in memory, because
+         // a spilled session can still be modified when it is at the top of the undo stack.
+         spill_loader(undo_index& self, std::size_t session) : _self(&self), _state(self._undo_stack[session]) {
+            auto find_pos = [](auto& list, auto end, auto&& visit) {
+               auto pos = list.before_begin();
+               for(; std::next(pos) != end; ++pos) visit(*std::next(pos));
+               return pos;
+            };
+            _old_pos = find_pos(_self->_old_values, _self->get_old_values_end(_state), [](value_type&) {});
+            // Objects that have been removed since are only reachable through their removed records
+            _removed_pos = find_pos(_self->_removed_values, _self->get_removed_values_end(_state),
+                                    [this](value_type& v) { _removed.emplace(v.id, &to_node(v)); });
+            _diff_pos = find_pos(_self->_diff_values, _self->get_diff_values_end(_state), [](diff_record&) {});
+         }
+         // Finds the object that an old value or diff applies to.  Returns nullptr for values that
+         // undo skips, because they refer to objects created by the session after a squash.
+         node* find_current(const id_type& id, uint64_t mtime) {
+            if(const value_type* obj = _self->find(id)) return &to_node(*obj);
+            auto iter = _removed.find(id);
+            if(iter != _removed.end()) return iter->second;
+            if(mtime >= _state.ctime) return nullptr;
+            BOOST_THROW_EXCEPTION( std::logic_error{ "spilled undo record refers to a missing object" } );
+         }
+         // Makes the records part of the session.  The sessions above it end at its first record.
+         void release(std::size_t session) noexcept {
+            auto update = [&](auto& list, auto pos, std::size_t count, auto end_member) {
+               if(count == 0) return;
+               auto old_end = _state.*end_member;
+               auto new_end = &*std::next(pos);
+               for(std::size_t j = session + 1; j < _self->_undo_stack.size() && _self->_undo_stack[j].*end_member == old_end; ++j)
+                  _self->_undo_stack[j].*end_member = new_end;
+            };
+            update(_self->_old_values, _old_pos, _old_count, &undo_state::old_values_end);
+            update(_self->_removed_values, _removed_pos, _removed_count, &undo_state::removed_values_end);
+            update(_self->_diff_values, _diff_pos, _diff_count, &undo_state::diff_values_end);
+            _removed_count = _old_count = _diff_count = 0;
+         }
+         undo_index* _self;
+         const undo_state& _state;
+         typename list_base<old_node, index0_type>::iterator _old_pos;
+         typename list_base<node, index0_type>::iterator _removed_pos;
+         typename list_base<diff_node, index0_type>::iterator _diff_pos;
+         std::map<id_type, node*> _removed;
+         std::size_t _removed_count = 0;
+         std::size_t _old_count = 0;
+         std::size_t _diff_count = 0;
+      };
+
+      // Reloads the records of the newest depth sessions that were spilled.  load(location, loader)
+      // is passed the location returned by the store function of spill and must add the
+      // records to the spill_loader.  The records that are in memory above the reloaded
+      // records are traversed.
+      //
+      // Exception safety: strong
+      template<typename Load>
+      void unspill(std::size_t depth, Load&& load) {
+         for(std::size_t i = _undo_stack.size(); i > 0 && depth > 0; --depth) {
+            --i;
+            undo_state& state = _undo_stack[i];
+            if(state.spill_location < 0) continue;
+            spill_loader loader(*this, i);
+            load(state.spill_location, loader);
+            loader.release(i);
+            state.spill_location = -1;
+         }
+      }
+
       const undo_index& indices() const { return *this; }
       template<typename Tag>
       const auto& get() const { return std::get<find_tag<Tag, Indices...>::value>(_indices); }
@@ -556,6 +1562,17 @@ namespace chainbase {
       template<int N>
       const auto& get() const { return std::get<N>(_indices); }
 
+      // The id that will be assigned to the next object created.
+      id_type next_id() const { return _next_id; }
+
+      // Raises the id that will be assigned to the next object created, e.g. to
+      // match the source of restored objects.  An undo session restores the old value.
+      void set_next_id( id_type id ) {
+         if(id < _next_id)
+            BOOST_THROW_EXCEPTION( std::logic_error{ "next_id cannot be lowered" } );
+         _next_id = id;
+      }
+
       std::size_t size() const {
          return std::get<0>(_indices).size();
       }
@@ -585,6 +1602,10 @@ namespace chainbase {
       };
 
       delta last_undo_session() const {
+        if constexpr (diff_undo)
+           BOOST_THROW_EXCEPTION( std::logic_error{ "last_undo_session is not available with diff undo" } );
+        if(!_undo_stack.empty() && _undo_stack.back().spill_location >= 0)
+           BOOST_THROW_EXCEPTION( std::logic_error{ "the last undo session has been spilled" } );
         if(_undo_stack.empty())
            return { { get<0>().end(), get<0>().end() },
                     { _old_values.end(), _old_values.end() },
@@ -597,6 +1618,142 @@ namespace chainbase {
                   { _removed_values.begin(), get_removed_values_end(_undo_stack.back()) } };
       }
 
+      // The net changes between two states.  The pointers are invalidated by any
+      // change to the undo_index.
+      struct revision_delta {
+         std::vector<const value_type*> created; // values at the later revision
+         std::vector<std::pair<const value_type*, const value_type*>> modified; // values at both revisions
+         std::vector<const value_type*> removed; // values at the earlier revision
+      };
+
+      // Returns the object with the given id as it was at revision, or nullptr if it did not
+      // exist then.  revision must be within undo_stack_revision_range().  The result is either
+      // the current object or an undo record, and is valid until the undo_index is changed.
+      //
+      // Complexity: linear in the number of undo records that were added after revision.
+      const value_type* find_at_revision( const id_type& id, int64_t revision ) const {
+         const undo_state* state = state_at_revision(revision);
+         if(!state) return find(id);
+         if(!(id < state->old_next_id)) return nullptr;
+         auto same_id = [&](const value_type& v) { return !(v.id < id) && !(id < v.id); };
+         // A value is current as of a state if it was last modified before the state.
+         // Only one version of an object can satisfy this.
+         for(auto iter = _old_values.begin(), end = get_old_values_end(*state); iter != end; ++iter) {
+            if(same_id(*iter) && to_old_node(*iter)._mtime < state->ctime) return &*iter;
+         }
+         for(auto iter = _removed_values.begin(), end = get_removed_values_end(*state); iter != end; ++iter) {
+            if(same_id(*iter)) return to_node(*iter)._mtime < state->ctime ? &*iter : nullptr;
+         }
+         const value_type* current = find(id);
+         return current && to_node(*current)._mtime < state->ctime ? current : nullptr;
+      }
+
+      // Calls f(const value_type&) for every object that existed at revision, in id order,
+      // with the same values as find_at_revision.  Objects that were not changed since
+      // revision are passed as is.  The index must not be changed while this runs.
+      //
+      // Complexity: linear in the number of objects that existed at revision plus the
+      // number of undo records that were added after revision.
+      template<typename F>
+      void for_each_at_revision( int64_t revision, F&& f ) const {
+         const undo_state* state = state_at_revision(revision);
+         if(!state) {
+            for(const value_type& v : *this) f(v);
+            return;
+         }
+         // The versions of the objects that changed since revision, sorted by id
+         std::vector<const value_type*> versions;
+         for(auto iter = _old_values.begin(), end = get_old_values_end(*state); iter != end; ++iter) {
+            if(to_old_node(*iter)._mtime < state->ctime) versions.push_back(&*iter);
+         }
+         for(auto iter = _removed_values.begin(), end = get_removed_values_end(*state); iter != end; ++iter) {
+            if(to_node(*iter)._mtime < state->ctime) versions.push_back(&*iter);
+         }
+         std::sort(versions.begin(), versions.end(), [](const value_type* lhs, const value_type* rhs) { return lhs->id < rhs->id; });
+         auto next = versions.begin();
+         const auto& by_id = std::get<0>(_indices);
+         for(auto iter = by_id.begin(), end = by_id.lower_bound(state->old_next_id); iter != end; ++iter) {
+            const value_type& current = *iter;
+            for(; next != versions.end() && (*next)->id < current.id; ++next) f(**next);
+            if(next != versions.end() && !(current.id < (*next)->id)) f(**next++);
+            else f(current);
+         }
+         for(; next != versions.end(); ++next) f(**next);
+      }
+
+      // Returns the objects that were created, modified or removed between the
+      // states at revisions from and to, sorted by id.  Objects that were created
+      // and removed in between are omitted.  An object is reported as modified if
+      // it was modified at least once, even if its final value is unchanged.
+      //
+      // Both revisions must be within undo_stack_revision_range() and from <= to.
+      // The undo stack is not changed.
+      revision_delta delta_between( int64_t from, int64_t to ) const {
+         if constexpr (diff_undo)
+            BOOST_THROW_EXCEPTION( std::logic_error{ "delta_between is not available with diff undo" } );
+         auto [first, last] = undo_stack_revision_range();
+         if(from < first || to > last || from > to)
+            BOOST_THROW_EXCEPTION( std::out_of_range{ "revision range is not on the undo stack" } );
+         revision_delta result;
+         if(from == to) return result;
+         if(static_cast<std::size_t>(from - first) < spilled_sessions())
+            BOOST_THROW_EXCEPTION( std::logic_error{ "revision range includes spilled undo sessions" } );
+         const undo_state& from_state = _undo_stack[from - first];
+         const undo_state* to_state = to == last ? nullptr : &_undo_stack[to - first];
+         auto to_next_id = to_state ? to_state->old_next_id : _next_id;
+         // A value is current as of a state if it was last modified before the state.
+         // Old values from later sessions that are current as of to hold the value at to.
+         std::unordered_map<const node*, const value_type*> later_values;
+         std::unordered_set<const node*> removed_before_to;
+         if(to_state) {
+            for(auto iter = _old_values.begin(), end = get_old_values_end(*to_state); iter != end; ++iter) {
+               if(to_old_node(*iter)._mtime < to_state->ctime)
+                  later_values.emplace(&*to_old_node(*iter)._current, &*iter);
+            }
+            for(auto iter = get_removed_values_end(*to_state), end = get_removed_values_end(from_state); iter != end; ++iter) {
+               removed_before_to.insert(&to_node(*iter));
+            }
+         }
+         auto exists_at_to = [&](const node& n) {
+            return to_state ? removed_before_to.count(&n) == 0 : get_removed_field(n._item) != erased_flag;
+         };
+         auto value_at_to = [&](const node& n) {
+            auto pos = later_values.find(&n);
+            return pos == later_values.end() ? &n._item : pos->second;
+         };
+         auto old_begin = to_state ? get_old_values_end(*to_state) : _old_values.begin();
+         for(auto iter = old_begin, end = get_old_values_end(from_state); iter != end; ++iter) {
+            // The value that was current as of from is the first modification after from.
+            if(to_old_node(*iter)._mtime >= from_state.ctime) continue;
+            const node& n = *to_old_node(*iter)._current;
+            if(exists_at_to(n)) {
+               result.modified.emplace_back(&*iter, value_at_to(n));
+            } else {
+               result.removed.push_back(&*iter);
+            }
+         }
+         auto removed_begin = to_state ? get_removed_values_end(*to_state) : _removed_values.begin();
+         for(auto iter = removed_begin, end = get_removed_values_end(from_state); iter != end; ++iter) {
+            // Removed values that were modified after from were handled with the old values.
+            if(iter->id < from_state.old_next_id && to_node(*iter)._mtime < from_state.ctime)
+               result.removed.push_back(&*iter);
+         }
+         for(auto iter = get<0>().lower_bound(from_state.old_next_id), end = get<0>().lower_bound(to_next_id); iter != end; ++iter) {
+            result.created.push_back(value_at_to(to_node(*iter)));
+         }
+         if(to_state) {
+            for(auto iter = _removed_values.begin(), end = get_removed_values_end(*to_state); iter != end; ++iter) {
+               if(!(iter->id < from_state.old_next_id) && iter->id < to_next_id)
+                  result.created.push_back(value_at_to(to_node(*iter)));
+            }
+         }
+         auto by_id = [](const value_type* lhs, const value_type* rhs) { return lhs->id < rhs->id; };
+         std::sort(result.created.begin(), result.created.end(), by_id);
+         std::sort(result.modified.begin(), result.modified.end(), [&](const auto& lhs, const auto& rhs) { return by_id(lhs.first, rhs.first); });
+         std::sort(result.removed.begin(), result.removed.end(), by_id);
+         return result;
+      }
+
       auto begin() const { return get<0>().begin(); }
       auto end() const { return get<0>().end(); }
 
@@ -607,13 +1764,17 @@ namespace chainbase {
       }
 
       // Resets the contents to the state at the top of the undo stack.
+      // The session must not be spilled, see unspill.
       void undo() noexcept {
          if (_undo_stack.empty()) return;
          undo_state& undo_info = _undo_stack.back();
+         assert(undo_info.spill_location < 0);
          // erase all new_ids
          auto& by_id = std::get<0>(_indices);
          auto new_ids_iter = by_id.lower_bound(undo_info.old_next_id);
          by_id.erase_and_dispose(new_ids_iter, by_id.end(), [this](pointer p){
+            if constexpr (observer::enabled) observer::on_undo(p, nullptr);
+            unlink_id(*p);
             erase_impl<1>(*p);
             dispose_node(*p);
          });
@@ -624,6 +1785,10 @@ namespace chainbase {
             // Duplicate modifies can only happen because of squash.
             if(restored_mtime < undo_info.ctime) {
                auto iter = &to_old_node(*p)._current->_item;
+               if constexpr (observer::enabled) {
+                  // A removed object is reported when it is inserted again
+                  if(get_removed_field(*iter) != erased_flag) observer::on_undo(iter, p);
+               }
                *iter = std::move(*p);
                auto& node_mtime = to_node(*iter)._mtime;
                node_mtime = restored_mtime;
@@ -637,16 +1802,38 @@ namespace chainbase {
             }
             dispose_old(*p);
          });
+         // restore the bytes changed by each modify, newest first
+         _diff_values.erase_after_and_dispose(_diff_values.before_begin(), get_diff_values_end(undo_info), [this, &undo_info](diff_record* p) {
+            if(p->_id < undo_info.old_next_id) {
+               node& node_ref = *p->_current;
+               if constexpr (observer::enabled) {
+                  if(get_removed_field(node_ref._item) != erased_flag) {
+                     value_type restored = node_ref._item;
+                     apply_diff(*p, restored);
+                     observer::on_undo(&node_ref._item, &restored);
+                  }
+               }
+               apply_diff(*p, node_ref._item);
+               node_ref._mtime = p->_mtime;
+               if (get_removed_field(node_ref._item) != erased_flag) {
+                  post_modify<false, 1>(node_ref._item);
+               }
+            }
+            dispose_diff(*p);
+         });
          // insert all removed_values
          _removed_values.erase_after_and_dispose(_removed_values.before_begin(), get_removed_values_end(undo_info), [this, &undo_info](pointer p) {
             if (p->id < undo_info.old_next_id) {
+               if constexpr (observer::enabled) observer::on_undo(nullptr, p);
                get_removed_field(*p) = 0; // Will be overwritten by tree algorithms, because we're reusing the color.
                insert_impl(*p);
+               link_id(*p);
             } else {
                dispose_node(*p);
             }
          });
          _next_id = undo_info.old_next_id;
+         _record_count = undo_info.old_record_count;
          _undo_stack.pop_back();
          --_revision;
       }
@@ -660,7 +1847,7 @@ namespace chainbase {
          if (_undo_stack.empty()) {
             return;
          } else if (_undo_stack.size() == 1) {
-            dispose_undo();
+            release_undo();
          }
          _undo_stack.pop_back();
          --_revision;
@@ -668,6 +1855,7 @@ namespace chainbase {
 
       void squash_and_compress() noexcept {
          if(_undo_stack.size() >= 2) {
+            assert(_undo_stack[_undo_stack.size() - 2].spill_location < 0);
             compress_impl(_undo_stack[_undo_stack.size() - 2]);
          }
          squash_fast();
@@ -679,6 +1867,19 @@ namespace chainbase {
 
     private:
 
+      // Returns the undo session that starts at revision, or nullptr for the current revision
+      const undo_state* state_at_revision(int64_t revision) const {
+         if constexpr (diff_undo)
+            BOOST_THROW_EXCEPTION( std::logic_error{ "historical lookups are not available with diff undo" } );
+         auto [first, last] = undo_stack_revision_range();
+         if(revision < first || revision > last)
+            BOOST_THROW_EXCEPTION( std::out_of_range{ "revision is not on the undo stack" } );
+         if(revision == last) return nullptr;
+         if(static_cast<std::size_t>(revision - first) < spilled_sessions())
+            BOOST_THROW_EXCEPTION( std::logic_error{ "revision is in a spilled undo session" } );
+         return &_undo_stack[revision - first];
+      }
+
       // Removes elements of the last undo session that would be redundant
       // if all the sessions after @c session were squashed.
       //
@@ -700,6 +1901,13 @@ namespace chainbase {
                                         return false;
                                      },
                                      [&](pointer p) { dispose_old(*p); });
+         // Diffs must all be kept, because each one is relative to the previous modify,
+         // except those of objects that are new.  Those may refer to destroyed nodes.
+         remove_if_after_and_dispose(_diff_values, _diff_values.before_begin(), get_diff_values_end(_undo_stack.back()),
+                                     [old_next_id](diff_record& r){
+                                        return r._id >= old_next_id;
+                                     },
+                                     [this](diff_record* p) { dispose_diff(*p); });
          remove_if_after_and_dispose(_removed_values, _removed_values.before_begin(), get_removed_values_end(_undo_stack.back()),
                                      [old_next_id](value_type& v){
                                         return v.id >= old_next_id;
@@ -713,8 +1921,10 @@ namespace chainbase {
          _undo_stack.emplace_back();
          _undo_stack.back().old_values_end = _old_values.empty()?nullptr:&*_old_values.begin();
          _undo_stack.back().removed_values_end = _removed_values.empty()?nullptr:&*_removed_values.begin();
+         _undo_stack.back().diff_values_end = _diff_values.empty()?nullptr:&*_diff_values.begin();
          _undo_stack.back().old_next_id = _next_id;
          _undo_stack.back().ctime = ++_monotonic_revision;
+         _undo_stack.back().old_record_count = _record_count;
          return ++_revision;
       }
 
@@ -733,42 +1943,142 @@ namespace chainbase {
          return true;
       }
 
+      static constexpr std::size_t parallel_bulk_build_threshold = 16384;
+
+      // Sorts values by each of the indices starting at N.  The sorts run concurrently
+      // when the batch is large enough.
+      template<int N>
+      auto sort_for_bulk_build(const std::vector<value_type*>& values) const {
+         constexpr std::size_t count = sizeof...(Indices) - N;
+         std::array<std::vector<value_type*>, count> result;
+         auto sort_one = [this, &values](auto n) {
+            constexpr int I = decltype(n)::value;
+            std::vector<value_type*> sorted(values);
+            const auto& idx = std::get<I>(_indices);
+            std::sort(sorted.begin(), sorted.end(), [&](const value_type* lhs, const value_type* rhs) { return idx.value_comp()(*lhs, *rhs); });
+            auto dup = std::adjacent_find(sorted.begin(), sorted.end(), [&](const value_type* lhs, const value_type* rhs) { return !idx.value_comp()(*lhs, *rhs); });
+            if(dup != sorted.end())
+               BOOST_THROW_EXCEPTION( std::logic_error{ "could not insert object, most likely a uniqueness constraint was violated" } );
+            return sorted;
+         };
+         if(values.size() >= parallel_bulk_build_threshold && count > 1) {
+            std::array<std::future<std::vector<value_type*>>, count> futures;
+            boost::mp11::mp_for_each<boost::mp11::mp_iota_c<count>>([&](auto i) {
+               futures[i] = std::async(std::launch::async, sort_one, std::integral_constant<int, N + decltype(i)::value>{});
+            });
+            for(std::size_t i = 0; i < count; ++i) result[i] = futures[i].get();
+         } else {
+            boost::mp11::mp_for_each<boost::mp11::mp_iota_c<count>>([&](auto i) {
+               result[i] = sort_one(std::integral_constant<int, N + decltype(i)::value>{});
+            });
+         }
+         return result;
+      }
+
+      template<int N, std::size_t M>
+      void build_sorted_impl(const std::array<std::vector<value_type*>, M>& sorted) noexcept {
+         if constexpr (N < sizeof...(Indices)) {
+            const auto& values = sorted[N - (sizeof...(Indices) - M)];
+            std::get<N>(_indices).build_from_sorted(values.data(), values.size());
+            build_sorted_impl<N+1>(sorted);
+         }
+      }
+
+      template<typename Index>
+      using key_extractor = get_key<typename Index::key_from_value_type, value_type>;
+      template<typename Index>
+      static constexpr bool can_save_key = is_saved_key<typename key_extractor<Index>::type>;
+
+      // The keys of an object before it is modified.  Keys that cannot be saved are
+      // compared against the backup of the object in old_values instead, if there is one.
+      using saved_keys = std::tuple<std::conditional_t<can_save_key<Indices>, typename key_extractor<Indices>::type, std::nullptr_t>...>;
+
+      static saved_keys save_keys(const value_type& obj) {
+         return saved_keys{ save_key<Indices>(obj)... };
+      }
+      template<typename Index>
+      static auto save_key(const value_type& obj) {
+         if constexpr (can_save_key<Index>) return typename key_extractor<Index>::type(key_extractor<Index>{}(obj));
+         else return nullptr;
+      }
+
+      template<typename Keys, std::size_t... N>
+      uint64_t changed_keys_impl(const value_type& obj, const Keys& keys, std::index_sequence<N...>) const {
+         auto changed = [&](auto n) -> uint64_t {
+            constexpr std::size_t i = decltype(n)::value;
+            using index = boost::mp11::mp_at_c<boost::mp11::mp_list<Indices...>, i>;
+            if constexpr (i == 0 || !can_save_key<index>) {
+               return i != 0;
+            } else {
+               const auto& comp = std::get<i>(_indices).key_comp();
+               const auto& key = key_extractor<index>{}(obj);
+               return comp(std::get<i>(keys), key) || comp(key, std::get<i>(keys));
+            }
+         };
+         return ((changed(std::integral_constant<std::size_t, N>{}) << N) | ...);
+      }
+
+      // Equivalent to post_modify<true, N>, except that trees whose key compares
+      // equal to the key before the modification are skipped.
+      template<int N = 1>
+      bool post_modify_changed(value_type& p, const saved_keys& keys, const value_type* backup) {
+         if constexpr (N < sizeof...(Indices)) {
+            using index = boost::mp11::mp_at_c<boost::mp11::mp_list<Indices...>, N>;
+            const auto& comp = std::get<N>(_indices).key_comp();
+            auto equal = [&](const auto& lhs, const auto& rhs) { return !comp(lhs, rhs) && !comp(rhs, lhs); };
+            bool unchanged;
+            if constexpr (can_save_key<index>) unchanged = equal(std::get<N>(keys), key_extractor<index>{}(p));
+            else unchanged = backup && equal(key_extractor<index>{}(*backup), key_extractor<index>{}(p));
+            if(!unchanged && !fix_position<true, N>(p)) return false;
+            return post_modify_changed<N+1>(p, keys, backup);
+         }
+         return true;
+      }
+
       // Moves a modified node into the correct location
       template<bool unique, int N = 0>
       bool post_modify(value_type& p) {
          if constexpr (N < sizeof...(Indices)) {
-            auto& idx = std::get<N>(_indices);
-            auto iter = idx.iterator_to(p);
-            bool fixup = false;
-            if (iter != idx.begin()) {
-               auto copy = iter;
-               --copy;
-               if (!idx.value_comp()(*copy, p)) fixup = true;
-            }
-            ++iter;
-            if (iter != idx.end()) {
-               if(!idx.value_comp()(p, *iter)) fixup = true;
-            }
-            if(fixup) {
-               auto iter2 = idx.iterator_to(p);
-               idx.erase(iter2);
-               if constexpr (unique) {
-                  auto [new_pos, inserted] = idx.insert_unique(p);
-                  if (!inserted) {
-                     idx.insert_before(new_pos, p);
-                     return false;
-                  }
-               } else {
-                  idx.insert_equal(p);
+            if(!fix_position<unique, N>(p)) return false;
+            return post_modify<unique, N+1>(p);
+         }
+         return true;
+      }
+
+      // Moves a modified node into the correct location in index N
+      template<bool unique, int N>
+      bool fix_position(value_type& p) {
+         auto& idx = std::get<N>(_indices);
+         auto iter = idx.iterator_to(p);
+         bool fixup = false;
+         if (iter != idx.begin()) {
+            auto copy = iter;
+            --copy;
+            if (!idx.value_comp()(*copy, p)) fixup = true;
+         }
+         ++iter;
+         if (iter != idx.end()) {
+            if(!idx.value_comp()(p, *iter)) fixup = true;
+         }
+         if(fixup) {
+            auto iter2 = idx.iterator_to(p);
+            idx.erase(iter2);
+            if constexpr (unique) {
+               auto [new_pos, inserted] = idx.insert_unique(p);
+               if (!inserted) {
+                  idx.insert_before(new_pos, p);
+                  return false;
                }
+            } else {
+               idx.insert_equal(p);
             }
-            return post_modify<unique, N+1>(p);
          }
          return true;
       }
 
       template<int N = 0>
       void erase_impl(value_type& p) {
+         if constexpr (N == 0) unlink_id(p);
          if constexpr (N < sizeof...(Indices)) {
             auto& setN = std::get<N>(_indices);
             setN.erase(setN.iterator_to(p));
@@ -776,6 +2086,14 @@ namespace chainbase {
          }
       }
 
+      // The slot for the id must already be reserved
+      void link_id(value_type& value) noexcept {
+         if constexpr (use_dense_id_table<T>::value) _id_table.set(id_to_index(value.id), &to_node(value));
+      }
+      void unlink_id(const value_type& value) noexcept {
+         if constexpr (use_dense_id_table<T>::value) _id_table.reset(id_to_index(value.id));
+      }
+
       void on_create(const value_type& value) noexcept {
          if(!_undo_stack.empty()) {
             // Not in old_values, removed_values, or new_ids
@@ -797,6 +2115,7 @@ namespace chainbase {
                p->_current = &to_node(obj);
                guard0.cancel();
                _old_values.push_front(p->_item);
+               ++_record_count;
                to_node(obj)._mtime = _monotonic_revision;
                return &p->_item;
             }
@@ -826,16 +2145,218 @@ namespace chainbase {
       void dispose_old(value_type& node_ref) noexcept {
          dispose_old(static_cast<old_node&>(*boost::intrusive::get_parent_from_member(&node_ref, &value_holder<value_type>::_item)));
       }
-      void dispose(typename list_base<old_node, index0_type>::iterator old_start, typename list_base<node, index0_type>::iterator removed_start) noexcept {
+      void dispose_diff(diff_record& record) noexcept {
+         if(record._size > diff_record::inline_size)
+            diff_data_alloc_traits::deallocate(_diff_data_allocator, record._external, diff_words(record._size));
+         diff_node* p = static_cast<diff_node*>(boost::intrusive::get_parent_from_member(&record, &value_holder<diff_record>::_item));
+         diff_alloc_traits::destroy(_diff_allocator, p);
+         diff_alloc_traits::deallocate(_diff_allocator, p, 1);
+      }
+      static std::size_t diff_words(std::size_t size) { return (size + sizeof(uint64_t) - 1) / sizeof(uint64_t); }
+
+      // Calls f(offset, size) for each range of bytes that differs between old_bytes
+      // and new_bytes.  Objects are compared a word at a time, and ranges separated by
+      // no more than a word are merged, as that costs no more than a separate range header.
+      template<typename F>
+      static void for_each_changed_range(const char* old_bytes, const char* new_bytes, F&& f) {
+         constexpr std::size_t word = sizeof(uint64_t);
+         std::size_t start = 0, end = 0;
+         bool found = false;
+         for(std::size_t pos = 0; pos < sizeof(value_type); pos += word) {
+            std::size_t n = std::min(word, sizeof(value_type) - pos);
+            if(std::memcmp(old_bytes + pos, new_bytes + pos, n) == 0) continue;
+            if(found && pos - end <= word) {
+               end = pos + n;
+            } else {
+               if(found) f(start, end - start);
+               start = pos;
+               end = pos + n;
+               found = true;
+            }
+         }
+         if(found) f(start, end - start);
+      }
+      // Records the bytes of n that differ from old_bytes, which holds the value of n
+      // before it was modified.  Does nothing if n was not changed.
+      // Exception safety: strong
+      void push_diff(node& n, const char* old_bytes) {
+         const char* new_bytes = reinterpret_cast<const char*>(&n._item);
+         std::size_t size = 0;
+         for_each_changed_range(old_bytes, new_bytes, [&](std::size_t, std::size_t len) { size += 2 * sizeof(uint32_t) + len; });
+         if(size == 0) return;
+         auto p = diff_alloc_traits::allocate(_diff_allocator, 1);
+         auto guard0 = scope_exit{[&]{ diff_alloc_traits::deallocate(_diff_allocator, p, 1); }};
+         diff_alloc_traits::construct(_diff_allocator, &*p);
+         diff_record& record = p->_item;
+         if(size > diff_record::inline_size)
+            record._external = diff_data_alloc_traits::allocate(_diff_data_allocator, diff_words(size));
+         guard0.cancel();
+         record._size = size;
+         record._current = &n;
+         record._id = n._item.id;
+         record._mtime = n._mtime;
+         char* out = record.data();
+         for_each_changed_range(old_bytes, new_bytes, [&](std::size_t offset, std::size_t len) {
+            uint32_t header[2] = { static_cast<uint32_t>(offset), static_cast<uint32_t>(len) };
+            std::memcpy(out, header, sizeof(header));
+            std::memcpy(out + sizeof(header), old_bytes + offset, len);
+            out += sizeof(header) + len;
+         });
+         _diff_values.push_front(record);
+         ++_record_count;
+      }
+      static void apply_diff(const diff_record& record, value_type& obj) noexcept {
+         const char* in = record.data();
+         const char* end = in + record._size;
+         char* out = reinterpret_cast<char*>(&obj);
+         while(in != end) {
+            uint32_t header[2];
+            std::memcpy(header, in, sizeof(header));
+            in += sizeof(header);
+            std::memcpy(out + header[0], in, header[1]);
+            in += header[1];
+         }
+      }
+      void pop_diff() noexcept {
+         _diff_values.pop_front_and_dispose([this](diff_record* p){ dispose_diff(*p); });
+         --_record_count;
+      }
+      // Returns true if changes to obj need to be recorded for undo
+      bool needs_diff(const value_type& obj) const {
+         return !_undo_stack.empty() && obj.id < _undo_stack.back().old_next_id;
+      }
+      void on_modify_diff(const value_type& obj) noexcept {
+         if(!_undo_stack.empty()) to_node(obj)._mtime = _monotonic_revision;
+      }
+
+      template<typename Modifier>
+      void modify_diff( const value_type& obj, Modifier& m ) {
+         if constexpr (observer::enabled) observer::before_modify(obj);
+         saved_keys keys = save_keys(obj);
+         value_type& node_ref = const_cast<value_type&>(obj);
+         alignas(value_type) char old_bytes[sizeof(value_type)];
+         std::memcpy(old_bytes, &obj, sizeof(value_type));
+         auto restore = [&]{
+            std::memcpy(&node_ref, old_bytes, sizeof(value_type));
+            bool success = post_modify<true, 1>(node_ref);
+            (void)success;
+            assert(success);
+         };
+         {
+            // The trees are not touched until the modifier returns
+            auto guard0 = scope_exit{[&]{ std::memcpy(&node_ref, old_bytes, sizeof(value_type)); }};
+            auto old_id = obj.id;
+            m(node_ref);
+            (void)old_id;
+            assert(obj.id == old_id);
+            guard0.cancel();
+         }
+         if(!post_modify_changed(node_ref, keys, reinterpret_cast<const value_type*>(old_bytes))) {
+            restore();
+            BOOST_THROW_EXCEPTION( std::logic_error{ "could not modify object, most likely a uniqueness constraint was violated" } );
+         }
+         if(needs_diff(obj)) {
+            auto guard1 = scope_exit{[&]{ restore(); }};
+            push_diff(to_node(obj), old_bytes);
+            guard1.cancel();
+         }
+         on_modify_diff(obj);
+         if constexpr (observer::enabled) observer::after_modify(obj);
+      }
+
+      template<typename Iter, typename Modifier>
+      void modify_each_diff( Iter first, Iter last, Modifier& m ) {
+         std::size_t count = std::distance(first, last);
+         std::vector<value_type*> modified;
+         modified.reserve(count);
+         std::unique_ptr<char[]> old_bytes(new char[count * sizeof(value_type)]);
+         auto old_value = [&](std::size_t i) { return old_bytes.get() + i * sizeof(value_type); };
+         std::size_t inserted = 0;
+         std::size_t pushed = 0;
+         auto guard0 = scope_exit{[&]{
+            for(; pushed > 0; --pushed) pop_diff();
+            for(std::size_t i = 0; i < inserted; ++i) erase_impl<1>(*modified[i]);
+            for(std::size_t i = 0; i < modified.size(); ++i) {
+               std::memcpy(modified[i], old_value(i), sizeof(value_type));
+               bool success = insert_impl<1>(*modified[i]);
+               (void)success;
+               assert(success);
+            }
+         }};
+         for(; first != last; ++first) {
+            value_type& node_ref = const_cast<value_type&>(static_cast<const value_type&>(*first));
+            if constexpr (observer::enabled) observer::before_modify(node_ref);
+            std::memcpy(old_value(modified.size()), &node_ref, sizeof(value_type));
+            erase_impl<1>(node_ref);
+            modified.push_back(&node_ref);
+            auto old_id = node_ref.id;
+            m(node_ref);
+            (void)old_id;
+            assert(node_ref.id == old_id);
+         }
+         for(; inserted < modified.size(); ++inserted) {
+            if(!insert_impl<1>(*modified[inserted]))
+               BOOST_THROW_EXCEPTION( std::logic_error{ "could not modify object, most likely a uniqueness constraint was violated" } );
+         }
+         for(std::size_t i = 0; i < modified.size(); ++i) {
+            if(needs_diff(*modified[i])) {
+               std::size_t old_size = _record_count;
+               push_diff(to_node(*modified[i]), old_value(i));
+               pushed += _record_count - old_size;
+            }
+         }
+         guard0.cancel();
+         for(value_type* v : modified) on_modify_diff(*v);
+         if constexpr (observer::enabled) {
+            for(value_type* v : modified) observer::after_modify(*v);
+         }
+      }
+      void dispose(typename list_base<old_node, index0_type>::iterator old_start, typename list_base<node, index0_type>::iterator removed_start,
+                   typename list_base<diff_node, index0_type>::iterator diff_start) noexcept {
          // This will leave one element around.  That's okay, because we'll clean it up the next time.
-         if(old_start != _old_values.end())
-            _old_values.erase_after_and_dispose(old_start, _old_values.end(), [this](pointer p){ dispose_old(*p); });
-         if(removed_start != _removed_values.end())
-            _removed_values.erase_after_and_dispose(removed_start, _removed_values.end(), [this](pointer p){ dispose_node(*p); });
+         if(old_start != _old_values.end()) {
+            if(_defer_disposal) {
+               // Everything after old_start is unreachable from the undo stack.  Any
+               // earlier reclaim position is after old_start, so it is subsumed.
+               _old_values_reclaim_start = &*old_start;
+            } else {
+               _old_values.erase_after_and_dispose(old_start, _old_values.end(), [this](pointer p){ dispose_old(*p); });
+               _old_values_reclaim_start = nullptr;
+            }
+         }
+         if(removed_start != _removed_values.end()) {
+            if(_defer_disposal) {
+               _removed_values_reclaim_start = &*removed_start;
+            } else {
+               _removed_values.erase_after_and_dispose(removed_start, _removed_values.end(), [this](pointer p){ dispose_node(*p); });
+               _removed_values_reclaim_start = nullptr;
+            }
+         }
+         if(diff_start != _diff_values.end()) {
+            if(_defer_disposal) {
+               _diff_values_reclaim_start = &*diff_start;
+            } else {
+               _diff_values.erase_after_and_dispose(diff_start, _diff_values.end(), [this](diff_record* p){ dispose_diff(*p); });
+               _diff_values_reclaim_start = nullptr;
+            }
+         }
+      }
+      // Discards the entire undo history.
+      void release_undo() noexcept {
+         if(_defer_disposal) {
+            // Keep the first element, so that new values are pushed in front of the reclaim position.
+            dispose(_old_values.begin(), _removed_values.begin(), _diff_values.begin());
+         } else {
+            dispose_undo();
+         }
       }
       void dispose_undo() noexcept {
          _old_values.clear_and_dispose([this](pointer p){ dispose_old(*p); });
          _removed_values.clear_and_dispose([this](pointer p){ dispose_node(*p); });
+         _diff_values.clear_and_dispose([this](diff_record* p){ dispose_diff(*p); });
+         _old_values_reclaim_start = nullptr;
+         _removed_values_reclaim_start = nullptr;
+         _diff_values_reclaim_start = nullptr;
       }
       static node& to_node(value_type& obj) {
          return static_cast<node&>(*boost::intrusive::get_parent_from_member(&obj, &value_holder<value_type>::_item));
@@ -846,6 +2367,9 @@ namespace chainbase {
       static old_node& to_old_node(value_type& obj) {
          return static_cast<old_node&>(*boost::intrusive::get_parent_from_member(&obj, &value_holder<value_type>::_item));
       }
+      static const old_node& to_old_node(const value_type& obj) {
+         return to_old_node(const_cast<value_type&>(obj));
+      }
 
       auto get_old_values_end(const undo_state& info) {
          if(info.old_values_end == nullptr) {
@@ -871,6 +2395,14 @@ namespace chainbase {
          return static_cast<decltype(_removed_values.cend())>(const_cast<undo_index*>(this)->get_removed_values_end(info));
       }
 
+      auto get_diff_values_end(const undo_state& info) {
+         if(info.diff_values_end == nullptr) {
+            return _diff_values.end();
+         } else {
+            return _diff_values.iterator_to(*info.diff_values_end);
+         }
+      }
+
       // returns true if the node should be destroyed
       bool on_remove( value_type& obj) {
          if (!_undo_stack.empty()) {
@@ -881,6 +2413,7 @@ namespace chainbase {
             get_removed_field(obj) = erased_flag;
 
             _removed_values.push_front(obj);
+            ++_record_count;
             return false;
          }
          return true;
@@ -894,13 +2427,22 @@ namespace chainbase {
       boost::container::deque<undo_state, rebind_alloc_t<Allocator, undo_state>> _undo_stack;
       list_base<old_node, index0_type> _old_values;
       list_base<node, index0_type> _removed_values;
+      list_base<diff_node, index0_type> _diff_values;
       rebind_alloc_t<Allocator, node> _allocator;
       rebind_alloc_t<Allocator, old_node> _old_values_allocator;
+      rebind_alloc_t<Allocator, diff_node> _diff_allocator;
+      rebind_alloc_t<Allocator, uint64_t> _diff_data_allocator;
+      std::conditional_t<use_dense_id_table<T>::value, dense_id_table<node, Allocator>, no_id_table> _id_table;
       id_type _next_id = 0;
       int64_t _revision = 0;
       uint64_t _monotonic_revision = 0;
-      uint32_t                        _size_of_value_type = sizeof(node);
-      uint32_t                        _size_of_this = sizeof(undo_index);
+      uint64_t _record_count = 0; // Number of values ever pushed onto old_values or removed_values
+      // Values after these positions have been discarded by commit, but not yet released.
+      typename std::allocator_traits<Allocator>::pointer _old_values_reclaim_start = nullptr;
+      typename std::allocator_traits<Allocator>::pointer _removed_values_reclaim_start = nullptr;
+      diff_pointer _diff_values_reclaim_start = nullptr;
+      bool _defer_disposal = false;
+      undo_index_footer _footer{ sizeof(node), sizeof(undo_index), undo_index_footer::magic_value, sizeof...(Indices) };
    };
 
    template<typename MultiIndexContainer>
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chainbase/state_delta.hpp>
+
+#include <boost/filesystem/path.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+namespace chainbase {
+
+   // An append-only file that holds the undo records of spilled sessions.  Each entry is
+   // a uint64 size followed by the data, and is identified by its offset in the file.
+   class undo_spill_file {
+    public:
+      // Opens or creates the file.  Existing entries are kept, because they may belong to
+      // the undo stack of a database that was reopened.
+      explicit undo_spill_file(const boost::filesystem::path& path);
+
+      const boost::filesystem::path& path() const { return _path; }
+      int64_t append(const std::vector<char>& data);
+      std::vector<char> read(int64_t location);
+      // Discards all entries
+      void clear();
+      uint64_t size() const { return _size; }
+
+    private:
+      boost::filesystem::path _path;
+      std::fstream            _file;
+      uint64_t                _size = 0;
+      std::mutex              _mutex; // undo may read from several threads, see database::set_parallel_undo
+   };
+
+   // The records of a spilled session are encoded as
+   //   uint64 number of removed values, each a uint64 mtime and the value
+   //   uint64 number of old values, each a uint64 mtime and the value
+   //   uint64 number of diffs, each a uint64 id, a uint64 mtime, a uint32 size and the bytes
+   // where values are prefixed by their size as a uint32 and encoded by object_serializer.
+   // Records are stored oldest first.
+   template<typename Index>
+   void write_spilled_session(delta_writer& out, const typename Index::spilled_records& records) {
+      using serializer = object_serializer<typename Index::value_type>;
+      auto write_values = [&](const auto& values) {
+         out.write(uint64_t(values.size()));
+         for(const auto& [value, mtime] : values) {
+            out.write(uint64_t(mtime));
+            std::size_t size_pos = out.position();
+            out.write(uint32_t(0));
+            serializer::pack(out, *value);
+            out.patch(size_pos, uint32_t(out.position() - size_pos - sizeof(uint32_t)));
+         }
+      };
+      write_values(records.removed_values);
+      write_values(records.old_values);
+      out.write(uint64_t(records.diff_values.size()));
+      for(const auto* diff : records.diff_values) {
+         out.write(uint64_t(id_to_index(diff->_id)));
+         out.write(uint64_t(diff->_mtime));
+         out.write(uint32_t(diff->_size));
+         out.write(diff->data(), diff->_size);
+      }
+   }
+
+   template<typename Index>
+   void read_spilled_session(delta_reader& in, typename Index::spill_loader& loader) {
+      using value_type = typename Index::value_type;
+      using id_type = typename Index::id_type;
+      using serializer = object_serializer<value_type>;
+      auto read_values = [&](auto&& add) {
+         for(uint64_t n = in.read<uint64_t>(); n > 0; --n) {
+            auto mtime = in.read<uint64_t>();
+            delta_reader value_in = in.sub_reader(in.read<uint32_t>());
+            add(mtime, [&](value_type& v) { serializer::unpack(value_in, v); });
+         }
+      };
+      read_values([&](uint64_t mtime, auto&& c) { loader.removed_value(mtime, c); });
+      read_values([&](uint64_t mtime, auto&& c) { loader.old_value(mtime, c); });
+      for(uint64_t n = in.read<uint64_t>(); n > 0; --n) {
+         auto id = in.read<uint64_t>();
+         auto mtime = in.read<uint64_t>();
+         auto size = in.read<uint32_t>();
+         std::vector<char> data(size);
+         in.read(data.data(), size);
+         loader.diff_value(id_type(id), mtime, data.data(), size);
+      }
+   }
+
+}  // namespace chainbase
@@ -1,7 +1,10 @@
 #include <chainbase/chainbase.hpp>
 #include <boost/array.hpp>
 
+#include <algorithm>
 #include <iostream>
+#include <optional>
+#include <utility>
 
 #ifndef _WIN32
 #include <sys/mman.h>
@@ -18,6 +21,19 @@ namespace chainbase {
 
    database::~database()
    {
+      if( !_read_only ) {
+         try {
+            sync_undo_stacks();
+            // Sessions that were only kept for pins are committed, since _commit_revision is not saved
+            if( _commit_revision != std::numeric_limits<int64_t>::min() )
+               for( auto* item : _index_list ) item->commit( _commit_revision );
+         } catch( const std::exception& e ) {
+            std::cerr << "CHAINBASE: could not bring the undo stacks up to date on close: " << e.what() << std::endl;
+         } catch( ... ) {
+            std::cerr << "CHAINBASE: could not bring the undo stacks up to date on close" << std::endl;
+         }
+         for( auto* item : _index_list ) item->update_footer();
+      }
       _index_list.clear();
       _index_map.clear();
    }
@@ -38,50 +54,820 @@ namespace chainbase {
    }
 #endif
 
-   void database::undo()
+   worker_pool::worker_pool( unsigned num_threads )
+   {
+      _threads.reserve( num_threads );
+      try {
+         for( unsigned i = 0; i < num_threads; ++i )
+            _threads.emplace_back( [this]{ work(); } );
+      } catch( ... ) {
+         stop();
+         throw;
+      }
+   }
+
+   worker_pool::~worker_pool()
+   {
+      stop();
+   }
+
+   void worker_pool::stop()
    {
-      for( auto& item : _index_list )
       {
-         item->undo();
+         std::lock_guard<std::mutex> lock( _mutex );
+         _stop = true;
+      }
+      _start.notify_all();
+      for( auto& t : _threads ) t.join();
+      _threads.clear();
+   }
+
+   void worker_pool::run( std::size_t n, const std::function<void(std::size_t)>& f )
+   {
+      std::unique_lock<std::mutex> lock( _mutex );
+      _task = &f;
+      _task_count = n;
+      _next_task = 0;
+      _done_count = 0;
+      _error = nullptr;
+      uint64_t generation = ++_generation;
+      _start.notify_all();
+      drain( lock, generation );
+      _finished.wait( lock, [&]{ return _done_count == _task_count; } );
+      _task = nullptr;
+      if( _error ) std::rethrow_exception( std::exchange( _error, nullptr ) );
+   }
+
+   void worker_pool::work()
+   {
+      std::unique_lock<std::mutex> lock( _mutex );
+      uint64_t seen = _generation;
+      for(;;) {
+         _start.wait( lock, [&]{ return _stop || _generation != seen; } );
+         if( _stop ) return;
+         seen = _generation;
+         drain( lock, seen );
+      }
+   }
+
+   // Tasks are claimed under the lock, so a thread that wakes up late can never
+   // pick up a task from a batch other than the one it was woken for.
+   void worker_pool::drain( std::unique_lock<std::mutex>& lock, uint64_t generation )
+   {
+      while( _generation == generation && _next_task < _task_count ) {
+         std::size_t i = _next_task++;
+         const auto& task = *_task;
+         lock.unlock();
+         std::exception_ptr error;
+         try {
+            task( i );
+         } catch( ... ) {
+            error = std::current_exception();
+         }
+         lock.lock();
+         if( error && !_error ) _error = error;
+         if( ++_done_count == _task_count ) _finished.notify_all();
+      }
+   }
+
+   void database::set_parallel_undo( unsigned num_threads, std::size_t min_undo_records )
+   {
+      _undo_workers.reset();
+      if( num_threads > 0 )
+         _undo_workers.reset( new worker_pool( num_threads ) );
+      _min_parallel_undo_records = min_undo_records;
+   }
+
+   // Each undo_index has its own undo stack and node allocators, so indices can be processed
+   // concurrently.  The segment manager serializes the allocations that reach it.
+   template<typename Work, typename Op>
+   void database::for_each_index( Work&& work, Op&& op )
+   {
+      if( _undo_workers && _index_list.size() > 1 ) {
+         std::size_t total = 0;
+         for( auto* item : _index_list ) total += work( *item );
+         if( total >= _min_parallel_undo_records ) {
+            _undo_workers->run( _index_list.size(), [&]( std::size_t i ) { op( *_index_list[i] ); } );
+            return;
+         }
       }
+      for( auto* item : _index_list ) op( *item );
+   }
+
+   void database::undo()
+   {
+      if( is_committed( revision() ) ) return;
+      unspill( 1 );
+      if( _trace ) _trace->undo();
+      if( _lazy_sessions ) {
+         for_each_lazy_index( []( abstract_index& item ) { item.undo(); } );
+      } else {
+         const int64_t previous = revision() - 1;
+         for_each_index( [&]( abstract_index& item ) { return item.undo_records_since( previous ); },
+                         []( abstract_index& item ) { item.undo(); } );
+      }
+      truncate_undo_spill();
+      release_undone_pins();
    }
 
    void database::squash()
    {
-      for( auto& item : _index_list )
-      {
-         item->squash();
+      if( is_committed( revision() ) ) return;
+      unspill( 2 );
+      if( _trace ) _trace->squash();
+      if( _lazy_sessions ) {
+         for_each_lazy_index( []( abstract_index& item ) { item.squash(); } );
+         return;
+      }
+      const int64_t previous = revision() - 1;
+      for_each_index( [&]( abstract_index& item ) { return item.undo_records_since( previous ); },
+                      []( abstract_index& item ) { item.squash(); } );
+   }
+
+   void database::unspill( std::size_t depth )
+   {
+      // In lazy mode only the indices at the top revision are undone or squashed
+      for( auto* item : _index_list ) {
+         if( !_lazy_sessions || item->revision() == revision() ) item->unspill( depth );
+      }
+   }
+
+   database::session::~session()
+   {
+      try {
+         undo();
+      } catch( const std::exception& e ) {
+         std::cerr << "CHAINBASE: could not undo session, it is left on the undo stack: " << e.what() << std::endl;
+         push();
+      } catch( ... ) {
+         std::cerr << "CHAINBASE: could not undo session, it is left on the undo stack" << std::endl;
+         push();
+      }
+   }
+
+   void database::set_lazy_sessions( bool enabled )
+   {
+      if( enabled == _lazy_sessions ) return;
+      if( enabled ) {
+         _lazy_revision = _lazy_floor = revision();
+         _lazy_committed = std::numeric_limits<int64_t>::min();
+         _lazy_touched.clear();
+         _lazy_sessions = true;
+      } else {
+         sync_undo_stacks();
+         _lazy_sessions = false;
+      }
+   }
+
+   void database::sync_undo_stacks()
+   {
+      if( !_lazy_sessions ) return;
+      for( auto* item : _index_list ) item->extend_undo_stack( _lazy_revision );
+      _lazy_floor = _lazy_revision;
+      _lazy_touched.clear();
+   }
+
+   void database::join_lazy_session( abstract_index& item )
+   {
+      if( item.revision() == _lazy_floor ) _lazy_touched.push_back( &item );
+      item.extend_undo_stack( _lazy_revision );
+   }
+
+   void database::for_each_lazy_index( const std::function<void(abstract_index&)>& op )
+   {
+      const int64_t top = _lazy_revision;
+      if( top > _lazy_floor ) {
+         // Only the indices that were written to can have a session at the top revision
+         for( auto* item : _lazy_touched ) {
+            if( item->revision() == top ) op( *item );
+         }
+         _lazy_touched.erase( std::remove_if( _lazy_touched.begin(), _lazy_touched.end(),
+                                              [&]( abstract_index* item ) { return item->revision() <= _lazy_floor; } ),
+                              _lazy_touched.end() );
+      } else {
+         // Every index is at the top revision
+         for( auto* item : _index_list ) op( *item );
+         _lazy_floor = top - 1;
+         _lazy_touched.clear();
+      }
+      --_lazy_revision;
+   }
+
+   void database::set_deferred_disposal( bool enabled )
+   {
+      _deferred_disposal = enabled;
+      for( auto* item : _index_list ) item->set_deferred_disposal( enabled );
+   }
+
+   bool database::reclaim( std::chrono::nanoseconds budget )
+   {
+      // Nodes are released in small batches, so that the clock is not read for every node.
+      constexpr std::size_t batch_size = 64;
+      const auto deadline = std::chrono::steady_clock::now() + budget;
+      // Start where the previous call ran out of time, so that every index makes progress.
+      for( std::size_t finished = 0; finished < _index_list.size(); ) {
+         _reclaim_cursor %= _index_list.size();
+         if( _index_list[_reclaim_cursor]->reclaim( batch_size ) < batch_size ) {
+            ++finished;
+            ++_reclaim_cursor;
+         } else {
+            finished = 0;
+            if( std::chrono::steady_clock::now() >= deadline )
+               return true;
+         }
       }
+      return false;
    }
 
    void database::commit( int64_t revision )
    {
-      for( auto& item : _index_list )
-      {
-         item->commit( revision );
+      // Committing a revision above the head would turn every later undo into a push
+      revision = std::min( revision, this->revision() );
+      if( _trace ) _trace->commit( revision );
+      _commit_revision = std::max( _commit_revision, revision );
+      // Keep the sessions above the oldest pinned revision.  A later commit catches up.
+      revision = std::min( revision, oldest_pinned_revision() );
+      if( _lazy_sessions && std::min( revision, _lazy_floor ) <= _lazy_committed ) {
+         // The other indices have no sessions above the floor, and were committed up to it before
+         for( auto* item : _lazy_touched ) item->commit( revision );
+         truncate_undo_spill();
+         return;
       }
+      for_each_index( [&]( abstract_index& item ) -> std::size_t {
+                         // A deferred commit does not depend on the amount of history it discards.
+                         if( _deferred_disposal ) return 0;
+                         return item.undo_records_since( item.undo_stack_revision_range().first ) - item.undo_records_since( revision );
+                      },
+                      [&]( abstract_index& item ) { item.commit( revision ); } );
+      if( _lazy_sessions ) _lazy_committed = std::min( revision, _lazy_floor );
+      truncate_undo_spill();
    }
 
    void database::undo_all()
    {
-      for( auto& item : _index_list )
+      sync_undo_stacks();
+      if( _index_list.size() != 0 && is_committed( _index_list[0]->undo_stack_revision_range().first ) ) {
+         // A deferred commit left committed sessions on the stack
+         while( !is_committed( revision() ) ) undo();
+         return;
+      }
+      if( _trace ) _trace->undo_all();
+      for_each_index( []( abstract_index& item ) { return item.undo_records_since( item.undo_stack_revision_range().first ); },
+                      []( abstract_index& item ) { item.undo_all(); } );
+      if( _lazy_sessions && _index_list.size() != 0 ) _lazy_revision = _lazy_floor = _index_list[0]->revision();
+      truncate_undo_spill();
+      release_undone_pins();
+   }
+
+   undo_spill_file::undo_spill_file( const bfs::path& path ) : _path( path )
+   {
+      // Create the file if it does not exist, without truncating it if it does
+      std::ofstream( path.string(), std::ios::binary | std::ios::app );
+      _file.open( path.string(), std::ios::binary | std::ios::in | std::ios::out );
+      if( !_file )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "could not open undo spill file " + path.string() ) );
+      _file.seekg( 0, std::ios::end );
+      _size = _file.tellg();
+   }
+
+   int64_t undo_spill_file::append( const std::vector<char>& data )
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      const uint64_t size = data.size();
+      _file.seekp( _size );
+      _file.write( reinterpret_cast<const char*>( &size ), sizeof( size ) );
+      _file.write( data.data(), data.size() );
+      _file.flush();
+      if( !_file ) {
+         _file.clear();
+         BOOST_THROW_EXCEPTION( std::runtime_error( "could not write to undo spill file " + _path.string() ) );
+      }
+      const int64_t location = _size;
+      _size += sizeof( size ) + data.size();
+      return location;
+   }
+
+   std::vector<char> undo_spill_file::read( int64_t location )
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      uint64_t size = 0;
+      _file.seekg( location );
+      _file.read( reinterpret_cast<char*>( &size ), sizeof( size ) );
+      if( _file && location + sizeof( size ) + size > _size )
+         _file.setstate( std::ios::failbit );
+      std::vector<char> result;
+      if( _file ) {
+         result.resize( size );
+         _file.read( result.data(), size );
+      }
+      if( !_file ) {
+         _file.clear();
+         BOOST_THROW_EXCEPTION( std::runtime_error( "could not read undo spill file " + _path.string() + " at " + std::to_string( location ) ) );
+      }
+      return result;
+   }
+
+   void undo_spill_file::clear()
+   {
+      std::lock_guard<std::mutex> lock( _mutex );
+      _file.close();
+      _file.open( _path.string(), std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc );
+      if( !_file )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "could not truncate undo spill file " + _path.string() ) );
+      _size = 0;
+   }
+
+   trace_recorder::trace_recorder( const bfs::path& path, int64_t revision ) : _path( path )
+   {
+      _file.open( path.string(), std::ios::binary | std::ios::out | std::ios::trunc );
+      if( !_file )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "could not create trace file " + path.string() ) );
+      _buffer.reserve( buffer_size + 64 );
+      _file.write( reinterpret_cast<const char*>( &trace_magic ), sizeof( trace_magic ) );
+      _file.write( reinterpret_cast<const char*>( &trace_version ), sizeof( trace_version ) );
+      varint( revision );
+   }
+
+   trace_recorder::~trace_recorder()
+   {
+      try {
+         flush();
+      } catch( ... ) {
+         std::cerr << "CHAINBASE: could not write the end of trace " << _path << "\n";
+      }
+   }
+
+   void trace_recorder::write_buffer()
+   {
+      _file.write( _buffer.data(), _buffer.size() );
+      _file.flush();
+      _buffer.clear();
+      if( !_file ) {
+         _file.clear();
+         BOOST_THROW_EXCEPTION( std::runtime_error( "could not write to trace file " + _path.string() ) );
+      }
+   }
+
+   trace_reader::trace_reader( const bfs::path& path ) : _path( path ), _file( path.string(), std::ios::binary )
+   {
+      uint32_t header[2] = {};
+      _file.read( reinterpret_cast<char*>( header ), sizeof( header ) );
+      if( !_file || header[0] != trace_magic )
+         BOOST_THROW_EXCEPTION( std::runtime_error( path.string() + " is not a chainbase trace" ) );
+      if( header[1] != trace_version )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "unsupported version " + std::to_string( header[1] ) + " of trace " + path.string() ) );
+      _revision = varint();
+   }
+
+   bool trace_reader::byte( uint8_t& b )
+   {
+      char c;
+      if( !_file.get( c ) ) return false;
+      b = static_cast<uint8_t>( c );
+      return true;
+   }
+
+   uint64_t trace_reader::varint()
+   {
+      uint64_t result = 0;
+      for( unsigned shift = 0; shift < 64; shift += 7 ) {
+         uint8_t b;
+         if( !byte( b ) )
+            BOOST_THROW_EXCEPTION( std::runtime_error( "unexpected end of trace " + _path.string() ) );
+         result |= uint64_t( b & 0x7f ) << shift;
+         if( !( b & 0x80 ) ) return result;
+      }
+      BOOST_THROW_EXCEPTION( std::runtime_error( "malformed trace " + _path.string() ) );
+   }
+
+   bool trace_reader::next( trace_event& event )
+   {
+      uint8_t op;
+      if( !byte( op ) ) return false;
+      event = trace_event{ static_cast<trace_op>( op ) };
+      switch( event.op ) {
+         case trace_op::add_index:
+            event.type_id = varint();
+            event.value = varint();
+            event.rows = varint();
+            event.next_id = varint();
+            break;
+         case trace_op::start_session:
+         case trace_op::undo:
+         case trace_op::squash:
+         case trace_op::undo_all:
+            break;
+         case trace_op::commit:
+            event.value = varint();
+            break;
+         case trace_op::modify:
+            event.type_id = varint();
+            event.id = varint();
+            event.value = varint();
+            break;
+         case trace_op::create:
+         case trace_op::remove:
+         case trace_op::find:
+         case trace_op::find_by_key:
+            event.type_id = varint();
+            event.id = varint();
+            break;
+         default:
+            BOOST_THROW_EXCEPTION( std::runtime_error( "unknown event " + std::to_string( op ) + " in trace " + _path.string() ) );
+      }
+      return true;
+   }
+
+   void database::start_trace( const bfs::path& path )
+   {
+      CHAINBASE_REQUIRE_WRITE_LOCK( "start_trace", uint64_t );
+      _trace.reset();
+      _trace.reset( new trace_recorder( path, revision() ) );
+      for( const auto& item : _index_map ) {
+         if( item ) _trace->add_index( item->type_id(), item->value_size(), item->row_count(), item->next_id() );
+      }
+   }
+
+   void database::stop_trace()
+   {
+      CHAINBASE_REQUIRE_WRITE_LOCK( "stop_trace", uint64_t );
+      if( _trace ) _trace->flush();
+      _trace.reset();
+   }
+
+   void database::set_undo_spill( const bfs::path& path, std::size_t max_depth )
+   {
+      if( !_undo_spill || _undo_spill->path() != path ) {
+         auto file = std::make_unique<undo_spill_file>( path );
+         for( auto* item : _index_list ) item->set_spill_file( file.get() );
+         _undo_spill = std::move( file );
+      }
+      _undo_spill_depth = max_depth;
+      truncate_undo_spill();
+   }
+
+   void database::spill_undo_history()
+   {
+      // Pinned revisions are read from memory
+      const std::size_t keep = std::max<std::size_t>( _undo_spill_depth, revision() - oldest_pinned_revision() );
+      for( auto* item : _index_list ) {
+         auto [first, last] = item->undo_stack_revision_range();
+         if( std::size_t( last - first ) - item->spilled_sessions() > 2 * keep )
+            item->spill( keep );
+      }
+   }
+
+   void database::truncate_undo_spill()
+   {
+      if( !_undo_spill || _undo_spill->size() == 0 ) return;
+      for( auto* item : _index_list ) {
+         if( item->spilled_sessions() > 0 ) return;
+      }
+      _undo_spill->clear();
+   }
+
+   database::revision_pin::revision_pin( revision_pin&& other )
+      : _pins( other._pins ), _id( other._id ), _revision( other._revision )
+   {
+      other._pins = nullptr;
+   }
+
+   database::revision_pin::~revision_pin()
+   {
+      if( !_pins ) return;
+      std::lock_guard<std::mutex> lock( _pins->mutex );
+      _pins->revisions.erase( _id );
+   }
+
+   bool database::revision_pin::valid()const
+   {
+      if( !_pins ) return false;
+      std::lock_guard<std::mutex> lock( _pins->mutex );
+      return _pins->revisions.count( _id ) != 0;
+   }
+
+   database::revision_pin database::pin_revision( int64_t revision )const
+   {
+      for( const auto* item : _index_list ) {
+         // The undo stack of an index that was not written to by lazy sessions can stop below the revision
+         auto first = item->undo_stack_revision_range().first;
+         if( revision < first || revision > this->revision() )
+            BOOST_THROW_EXCEPTION( std::out_of_range( "revision " + std::to_string( revision ) + " is not on the undo stack of " + item->type_name() ) );
+      }
+      std::lock_guard<std::mutex> lock( _pins->mutex );
+      const uint64_t id = _pins->next_id++;
+      _pins->revisions.emplace( id, revision );
+      return revision_pin( *_pins, id, revision );
+   }
+
+   int64_t database::oldest_pinned_revision()const
+   {
+      int64_t result = revision();
+      std::lock_guard<std::mutex> lock( _pins->mutex );
+      for( const auto& [id, pinned] : _pins->revisions ) result = std::min( result, pinned );
+      return result;
+   }
+
+   void database::release_undone_pins()
+   {
+      const int64_t current = revision();
+      std::lock_guard<std::mutex> lock( _pins->mutex );
+      for( auto iter = _pins->revisions.begin(); iter != _pins->revisions.end(); ) {
+         if( iter->second > current ) iter = _pins->revisions.erase( iter );
+         else ++iter;
+      }
+   }
+
+   std::vector<char> database::last_undo_session_delta()
+   {
+      CHAINBASE_REQUIRE_READ_LOCK( "last_undo_session_delta", uint64_t );
+      std::vector<char> result;
+      delta_writer out( result );
+      uint32_t section_count = 0;
+      out.write( section_count );
+      for( auto* item : _index_list ) {
+         // An index that is behind the database has no changes at the top revision, see set_lazy_sessions
+         if( item->revision() != revision() ) continue;
+         std::size_t start = out.position();
+         out.write( item->type_id() );
+         out.write( uint64_t(0) );
+         if( item->write_delta( out ) == 0 ) {
+            result.resize( start );
+         } else {
+            out.patch( start + sizeof(uint32_t), uint64_t(out.position() - start - sizeof(uint32_t) - sizeof(uint64_t)) );
+            ++section_count;
+         }
+      }
+      out.patch( 0, section_count );
+      return result;
+   }
+
+   void database::apply_delta( const char* data, std::size_t size )
+   {
+      CHAINBASE_REQUIRE_WRITE_LOCK( "apply_delta", uint64_t );
+      delta_reader in( data, size );
+      for( auto section_count = in.read<uint32_t>(); section_count > 0; --section_count ) {
+         auto type_id = in.read<uint32_t>();
+         delta_reader section = in.sub_reader( in.read<uint64_t>() );
+         if( type_id >= _index_map.size() || !_index_map[type_id] )
+            BOOST_THROW_EXCEPTION( std::logic_error( "state delta contains unknown index " + std::to_string( type_id ) ) );
+         if( _lazy_sessions ) join_lazy_session( *_index_map[type_id] );
+         _index_map[type_id]->apply_delta( section );
+         if( section.remaining() != 0 )
+            BOOST_THROW_EXCEPTION( std::logic_error( "malformed state delta for " + _index_map[type_id]->type_name() ) );
+      }
+   }
+
+   namespace {
+      // Runs batches of tasks on up to num_threads threads, including the calling thread
+      class task_runner {
+         public:
+            explicit task_runner( unsigned num_threads ) {
+               if( num_threads > 1 ) _pool.emplace( num_threads - 1 );
+            }
+            void run( std::size_t n, const std::function<void(std::size_t)>& f ) {
+               if( _pool && n > 1 ) {
+                  _pool->run( n, f );
+               } else {
+                  for( std::size_t i = 0; i < n; ++i ) f( i );
+               }
+            }
+         private:
+            std::optional<worker_pool> _pool;
+      };
+
+      // Runs f(i) for every i in [0, n) on up to num_threads threads, including the calling thread.
+      void run_tasks( unsigned num_threads, std::size_t n, const std::function<void(std::size_t)>& f )
       {
-         item->undo_all();
+         task_runner( std::min<std::size_t>( num_threads, n ) ).run( n, f );
+      }
+   }
+
+   void database::write_snapshot( std::ostream& out, unsigned num_threads )const
+   {
+      // Large indices are split into id ranges of about this many objects, which are encoded concurrently.
+      constexpr uint64_t objects_per_chunk = 1 << 16;
+      struct chunk {
+         const abstract_index* index;
+         uint64_t              begin_id;
+         uint64_t              end_id;
+         uint64_t              size;
+      };
+      std::vector<chunk> chunks;
+      std::vector<std::size_t> index_chunks; // the first chunk of each index
+      for( const auto* item : _index_list ) {
+         index_chunks.push_back( chunks.size() );
+         const uint64_t next_id = item->next_id();
+         const uint64_t count = std::max<uint64_t>( 1, ( item->row_count() + objects_per_chunk - 1 ) / objects_per_chunk );
+         const uint64_t step = ( next_id + count - 1 ) / count;
+         for( uint64_t i = 0; i < count; ++i )
+            chunks.push_back( { item, step * i, i + 1 == count ? next_id : step * ( i + 1 ), 0 } );
+      }
+      index_chunks.push_back( chunks.size() );
+
+      // Only a window of chunks is encoded at a time and written out in order, so that the memory
+      // used does not grow with the size of the database.
+      num_threads = std::max( 1u, num_threads );
+      const std::size_t window = std::min<std::size_t>( 2 * num_threads, chunks.size() );
+      task_runner tasks( std::min<std::size_t>( num_threads, window ) );
+      std::vector<std::vector<char>> buffers( window );
+      auto encode = [&]( const std::function<void(std::size_t, const std::vector<char>&)>& emit ) {
+         for( std::size_t first = 0; first < chunks.size(); first += window ) {
+            const std::size_t n = std::min( window, chunks.size() - first );
+            tasks.run( n, [&]( std::size_t i ) {
+               const chunk& c = chunks[first + i];
+               buffers[i].clear();
+               delta_writer chunk_out( buffers[i] );
+               c.index->write_snapshot_chunk( chunk_out, c.begin_id, c.end_id );
+            } );
+            for( std::size_t i = 0; i < n; ++i ) emit( first + i, buffers[i] );
+         }
+      };
+
+      // The size of a section comes before its chunks.  It is filled in afterwards if the stream
+      // can seek, otherwise the chunks are encoded once more beforehand to measure them.
+      const bool seekable = out.tellp() != std::ostream::pos_type( -1 );
+      if( !seekable ) encode( [&]( std::size_t i, const std::vector<char>& data ) { chunks[i].size = data.size(); } );
+
+      auto write = [&]( auto value ) {
+         value = to_little_endian( value );
+         out.write( reinterpret_cast<const char*>( &value ), sizeof( value ) );
+      };
+      write( snapshot_magic );
+      write( int64_t( revision() ) );
+      write( uint32_t( _index_list.size() ) );
+      std::size_t index = 0;
+      std::ostream::pos_type size_pos = -1;
+      uint64_t section_size = 0;
+      uint64_t measured_size = 0;
+      encode( [&]( std::size_t i, const std::vector<char>& data ) {
+         if( i == index_chunks[index] ) {
+            measured_size = 2 * sizeof( uint64_t );
+            for( std::size_t j = index_chunks[index]; j < index_chunks[index + 1]; ++j ) measured_size += chunks[j].size;
+            write( uint32_t( _index_list[index]->type_id() ) );
+            size_pos = out.tellp();
+            write( measured_size );
+            write( _index_list[index]->next_id() );
+            write( uint64_t( index_chunks[index + 1] - index_chunks[index] ) );
+            section_size = 2 * sizeof( uint64_t );
+         }
+         out.write( data.data(), data.size() );
+         section_size += data.size();
+         if( i + 1 == index_chunks[index + 1] ) {
+            if( seekable ) {
+               const auto end = out.tellp();
+               out.seekp( size_pos );
+               write( section_size );
+               out.seekp( end );
+            } else if( section_size != measured_size ) {
+               BOOST_THROW_EXCEPTION( std::logic_error( "database changed while the snapshot was written" ) );
+            }
+            ++index;
+         }
+      } );
+      if( !out )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "could not write snapshot" ) );
+   }
+
+   void database::check_snapshot_target()
+   {
+      if( _read_only )
+         BOOST_THROW_EXCEPTION( std::logic_error( "cannot load a snapshot into a read-only database" ) );
+      sync_undo_stacks();
+      for( const auto* item : _index_list ) {
+         auto range = item->undo_stack_revision_range();
+         if( range.first != range.second )
+            BOOST_THROW_EXCEPTION( std::logic_error( "cannot load a snapshot while " + item->type_name() + " has an undo stack" ) );
+      }
+   }
+
+   int64_t database::read_snapshot_header( snapshot_reader& reader )const
+   {
+      if( reader.read<uint32_t>() != snapshot_magic )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "not a chainbase snapshot" ) );
+      const auto snapshot_revision = reader.read<int64_t>();
+      if( snapshot_revision < revision() )
+         BOOST_THROW_EXCEPTION( std::logic_error( "snapshot revision is older than the database" ) );
+      return snapshot_revision;
+   }
+
+   const abstract_index& database::snapshot_section_index( uint32_t type_id, std::vector<const abstract_index*>& loaded )const
+   {
+      if( type_id >= _index_map.size() || !_index_map[type_id] )
+         BOOST_THROW_EXCEPTION( std::logic_error( "snapshot contains unknown index " + std::to_string( type_id ) ) );
+      const abstract_index* item = _index_map[type_id].get();
+      if( item->row_count() != 0 || std::find( loaded.begin(), loaded.end(), item ) != loaded.end() )
+         BOOST_THROW_EXCEPTION( std::logic_error( "snapshot can only be loaded into an empty index: " + item->type_name() ) );
+      loaded.push_back( item );
+      return *item;
+   }
+
+   void database::read_snapshot_section( const abstract_index& item, snapshot_reader& section )
+   {
+      item.read_snapshot( section );
+      if( section.remaining() != 0 )
+         BOOST_THROW_EXCEPTION( std::logic_error( "malformed snapshot section for " + item.type_name() ) );
+   }
+
+   void database::read_snapshot( std::istream& in )
+   {
+      check_snapshot_target();
+      // Sizes in the snapshot are bounded by the rest of the stream if it is seekable
+      uint64_t length = std::numeric_limits<uint64_t>::max();
+      const auto start = in.tellg();
+      if( start != std::istream::pos_type( -1 ) && in.seekg( 0, std::ios::end ) ) {
+         length = uint64_t( in.tellg() - start );
+         in.seekg( start );
+      }
+      in.clear();
+      snapshot_reader reader( in, length );
+
+      const auto snapshot_revision = read_snapshot_header( reader );
+      std::vector<const abstract_index*> loaded;
+      for( auto section_count = reader.read<uint32_t>(); section_count > 0; --section_count ) {
+         const abstract_index& item = snapshot_section_index( reader.read<uint32_t>(), loaded );
+         snapshot_reader section = reader.sub_reader( reader.read<uint64_t>() );
+         read_snapshot_section( item, section );
+      }
+      set_revision( snapshot_revision );
+   }
+
+   void database::read_snapshot( const bfs::path& file, unsigned num_threads )
+   {
+      check_snapshot_target();
+      const std::string name = file.generic_string();
+      std::ifstream in( name, std::ios::binary );
+      if( !in )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "could not open snapshot " + name ) );
+      const uint64_t length = bfs::file_size( file );
+      snapshot_reader reader( in, length );
+
+      // The sections are located by skipping over them, then each is read through its own stream
+      struct section {
+         const abstract_index* index;
+         uint64_t              offset;
+         uint64_t              size;
+      };
+      const auto snapshot_revision = read_snapshot_header( reader );
+      std::vector<section> sections;
+      std::vector<const abstract_index*> loaded;
+      for( auto section_count = reader.read<uint32_t>(); section_count > 0; --section_count ) {
+         const abstract_index& item = snapshot_section_index( reader.read<uint32_t>(), loaded );
+         const uint64_t size = reader.read<uint64_t>();
+         const uint64_t offset = length - reader.remaining();
+         reader.skip( size );
+         sections.push_back( { &item, offset, size } );
       }
+
+      run_tasks( num_threads, sections.size(), [&]( std::size_t i ) {
+         std::ifstream section_in( name, std::ios::binary );
+         if( !section_in.seekg( sections[i].offset ) )
+            BOOST_THROW_EXCEPTION( std::runtime_error( "could not read snapshot " + name ) );
+         snapshot_reader section_reader( section_in, sections[i].size );
+         read_snapshot_section( *sections[i].index, section_reader );
+      } );
+      set_revision( snapshot_revision );
    }
 
    database::session database::start_undo_session( bool enabled )
    {
-      if( enabled ) {
+      if( enabled && _trace ) _trace->start_session();
+      if( enabled && _lazy_sessions ) {
+         session result;
+         result._db = this;
+         result._lazy = true;
+         ++_lazy_revision;
+         if( _undo_spill_depth > 0 ) spill_undo_history();
+         return result;
+      } else if( enabled ) {
          vector< std::unique_ptr<abstract_session> > _sub_sessions;
          _sub_sessions.reserve( _index_list.size() );
          for( auto& item : _index_list ) {
             _sub_sessions.push_back( item->start_undo_session( enabled ) );
          }
-         return session( std::move( _sub_sessions ) );
+         session result( std::move( _sub_sessions ) );
+         result._db = this;
+         if( _undo_spill_depth > 0 ) spill_undo_history();
+         return result;
       } else {
          return session();
       }
    }
 
+   std::vector<index_metrics> database::metrics_snapshot()const
+   {
+      std::vector<index_metrics> result;
+      for( const auto& item : _index_map ) {
+         if( item ) result.push_back( item->metrics() );
+      }
+      return result;
+   }
+
+   void database::reset_metrics()
+   {
+      for( auto* item : _index_list ) {
+         if( auto* ops = item->op_metrics() ) ops->reset();
+      }
+   }
+
 }  // namespace chainbase
@@ -2,12 +2,20 @@
 
 #include <boost/test/unit_test.hpp>
 #include <chainbase/chainbase.hpp>
+#include <chainbase/typed_database.hpp>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/member.hpp>
 
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <shared_mutex>
+#include <sstream>
+#include <thread>
 
 using namespace chainbase;
 using namespace boost::multi_index;
@@ -38,6 +46,94 @@ typedef multi_index_container<
 
 CHAINBASE_SET_INDEX_TYPE( book, book_index )
 
+struct page : public chainbase::object<1, page> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( page )
+
+   id_type id;
+   int number = 0;
+};
+
+typedef multi_index_container<
+  page,
+  indexed_by<
+     ordered_unique< member<page,page::id_type,&page::id> >,
+     ordered_unique< BOOST_MULTI_INDEX_MEMBER(page,int,number) >
+  >,
+  chainbase::node_allocator<page>
+> page_index;
+
+CHAINBASE_SET_INDEX_TYPE( page, page_index )
+CHAINBASE_USE_DENSE_ID_TABLE( page )
+
+namespace chainbase {
+   template<>
+   struct object_serializer<book> {
+      static void pack( delta_writer& out, const book& b ) { out.write( b.id._id ); out.write( b.a ); out.write( b.b ); }
+      static void unpack( delta_reader& in, book& b ) { b.id._id = in.read<int64_t>(); b.a = in.read<int>(); b.b = in.read<int>(); }
+   };
+   template<>
+   struct object_serializer<page> {
+      static void pack( delta_writer& out, const page& p ) { out.write( p.id._id ); out.write( p.number ); }
+      static void unpack( delta_reader& in, page& p ) { p.id._id = in.read<int64_t>(); p.number = in.read<int>(); }
+   };
+}
+
+// Two tables whose undo is observed by one cache, keyed by type and id
+struct shelf : public chainbase::object<2, shelf> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( shelf )
+
+   id_type id;
+   int value = 0;
+};
+
+typedef multi_index_container<
+  shelf,
+  indexed_by< ordered_unique< member<shelf,shelf::id_type,&shelf::id> > >,
+  chainbase::node_allocator<shelf>
+> shelf_index;
+
+CHAINBASE_SET_INDEX_TYPE( shelf, shelf_index )
+
+struct label : public chainbase::object<3, label> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( label )
+
+   id_type id;
+   int value = 0;
+};
+
+typedef multi_index_container<
+  label,
+  indexed_by< ordered_unique< member<label,label::id_type,&label::id> > >,
+  chainbase::node_allocator<label>
+> label_index;
+
+CHAINBASE_SET_INDEX_TYPE( label, label_index )
+
+struct undo_cache {
+   std::mutex                                  mutex;
+   std::map<std::pair<uint16_t, int64_t>, int> values;
+
+   template<typename T>
+   void on_undo( const T* before, const T* after ) {
+      std::lock_guard<std::mutex> guard( mutex );
+      const uint16_t type_id = T::type_id;
+      if( after ) values[{ type_id, after->id._id }] = after->value;
+      else values.erase( { type_id, before->id._id } );
+   }
+};
+undo_cache shared_undo_cache;
+
+namespace chainbase {
+   template<>
+   struct undo_index_observer<shelf> : undo_index_observer_base<shelf> {
+      static void on_undo( const shelf* before, const shelf* after ) noexcept { shared_undo_cache.on_undo( before, after ); }
+   };
+   template<>
+   struct undo_index_observer<label> : undo_index_observer_base<label> {
+      static void on_undo( const label* before, const label* after ) noexcept { shared_undo_cache.on_undo( before, after ); }
+   };
+}
+
 
 BOOST_AUTO_TEST_CASE( open_and_create ) {
    boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
@@ -132,4 +228,1005 @@ BOOST_AUTO_TEST_CASE( open_and_create ) {
    bfs::remove_all( temp );
 }
 
+BOOST_AUTO_TEST_CASE( dense_id_lookup ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< page_index >();
+
+      for( int i = 0; i < 2000; ++i )
+         db.create<page>( [&]( page& p ) { p.number = i; } );
+      BOOST_REQUIRE_EQUAL( db.get( page::id_type(1500) ).number, 1500 );
+      {
+         auto session = db.start_undo_session(true);
+         db.remove( db.get( page::id_type(1500) ) );
+         BOOST_REQUIRE( db.find( page::id_type(1500) ) == nullptr );
+      }
+      BOOST_REQUIRE_EQUAL( db.get( page::id_type(1500) ).number, 1500 );
+      BOOST_REQUIRE( db.find( page::id_type(2000) ) == nullptr );
+      BOOST_CHECK_THROW( db.get( page::id_type(2000) ), std::out_of_range );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( parallel_undo ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      db.add_index< page_index >();
+      db.set_parallel_undo( 2, 0 );
+
+      for( int i = 0; i < 3; ++i ) {
+         auto session = db.start_undo_session(true);
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+         db.create<page>( [&]( page& p ) { p.number = i; } );
+         session.push();
+      }
+      db.modify( db.get( book::id_type(0) ), []( book& b ) { b.a = 10; } );
+      db.remove( db.get( page::id_type(1) ) );
+      BOOST_REQUIRE_EQUAL( db.revision(), 3 );
+
+      db.undo();
+      BOOST_REQUIRE_EQUAL( db.revision(), 2 );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(0) ).a, 0 );
+      BOOST_REQUIRE_EQUAL( db.get( page::id_type(1) ).number, 1 );
+      BOOST_REQUIRE( db.find( page::id_type(2) ) == nullptr );
+
+      db.squash();
+      BOOST_REQUIRE_EQUAL( db.revision(), 1 );
+      db.commit( 0 );
+      db.undo_all();
+      BOOST_REQUIRE_EQUAL( db.revision(), 0 );
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().size(), 0u );
+      BOOST_REQUIRE_EQUAL( db.get_index<page_index>().size(), 0u );
+
+      chainbase::worker_pool pool( 3 );
+      std::vector<int> results( 100 );
+      pool.run( results.size(), [&]( std::size_t i ) { results[i] = i * 2; } );
+      for( std::size_t i = 0; i < results.size(); ++i )
+         BOOST_REQUIRE_EQUAL( results[i], int(i * 2) );
+      BOOST_CHECK_THROW( pool.run( 4, []( std::size_t i ) { if( i == 2 ) throw std::runtime_error( "task" ); } ), std::runtime_error );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( parallel_undo_observer ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< shelf_index >();
+      db.add_index< label_index >();
+      // Both indices are undone at once on the worker threads, and their hooks share the cache
+      db.set_parallel_undo( 2, 0 );
+      constexpr int rows = 500;
+      for( int i = 0; i < rows; ++i ) {
+         db.create<shelf>( [&]( shelf& s ) { s.value = i; } );
+         db.create<label>( [&]( label& l ) { l.value = -i; } );
+      }
+      shared_undo_cache.values.clear();
+      for( int round = 0; round < 5; ++round ) {
+         auto session = db.start_undo_session(true);
+         for( int i = 0; i < rows; ++i ) {
+            db.modify( db.get( shelf::id_type(i) ), [&]( shelf& s ) { s.value = round; } );
+            db.modify( db.get( label::id_type(i) ), [&]( label& l ) { l.value = round; } );
+         }
+         db.create<shelf>( [&]( shelf& s ) { s.value = rows; } );
+         shared_undo_cache.values[{ uint16_t( shelf::type_id ), rows }] = rows;
+      }
+      BOOST_REQUIRE_EQUAL( shared_undo_cache.values.size(), 2u * rows );
+      for( int i = 0; i < rows; ++i ) {
+         BOOST_REQUIRE_EQUAL( ( shared_undo_cache.values[{ uint16_t( shelf::type_id ), i }] ), i );
+         BOOST_REQUIRE_EQUAL( ( shared_undo_cache.values[{ uint16_t( label::type_id ), i }] ), -i );
+      }
+      BOOST_REQUIRE( db.find( shelf::id_type(rows) ) == nullptr );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( deferred_disposal ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.set_deferred_disposal( true );
+      db.add_index< book_index >();
+      db.add_index< page_index >();
+
+      for( int i = 0; i < 100; ++i ) {
+         db.create<page>( [&]( page& p ) { p.number = i; } );
+      }
+      for( int i = 0; i < 50; ++i ) {
+         auto session = db.start_undo_session(true);
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+         db.modify( db.get( page::id_type(i) ), [&]( page& p ) { p.number = 1000 + i; } );
+         db.remove( db.get( page::id_type(99 - i) ) );
+         session.push();
+      }
+      db.commit( db.revision() - 1 );
+      BOOST_REQUIRE( !db.reclaim( std::chrono::seconds(10) ) );
+      BOOST_REQUIRE( !db.reclaim( std::chrono::nanoseconds(0) ) );
+
+      db.undo();
+      BOOST_REQUIRE_EQUAL( db.get( page::id_type(49) ).number, 49 );
+      BOOST_REQUIRE_EQUAL( db.get( page::id_type(50) ).number, 50 );
+      BOOST_REQUIRE_EQUAL( db.get( page::id_type(48) ).number, 1048 );
+      BOOST_REQUIRE( db.find( page::id_type(51) ) == nullptr );
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().size(), 49u );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( state_delta ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   boost::filesystem::path temp2 = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database producer(temp, database::read_write, 1024*1024*8);
+      chainbase::database follower(temp2, database::read_write, 1024*1024*8);
+      for( auto* db : { &producer, &follower } ) {
+         db->add_index< book_index >();
+         db->add_index< page_index >();
+         for( int i = 0; i < 5; ++i ) {
+            db->create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+            db->create<page>( [&]( page& p ) { p.number = i; } );
+         }
+      }
+      BOOST_REQUIRE_EQUAL( producer.last_undo_session_delta().size(), sizeof(uint32_t) );
+
+      auto session = producer.start_undo_session(true);
+      producer.remove( producer.get( book::id_type(4) ) );
+      producer.modify( producer.get( book::id_type(0) ), []( book& b ) { b.a = 4; } );
+      producer.modify( producer.get( book::id_type(1) ), []( book& b ) { b.b = 10; } );
+      producer.modify( producer.get( book::id_type(1) ), []( book& b ) { b.b = 11; } );
+      producer.remove( producer.get( book::id_type(2) ) );
+      producer.create<book>( [&]( book& b ) { b.a = 20; b.b = 20; } );
+      producer.remove( producer.create<book>( [&]( book& b ) { b.a = 21; b.b = 21; } ) );
+      producer.create<book>( [&]( book& b ) { b.a = 2; b.b = 22; } );
+      // exchange the unique keys of two pages
+      producer.modify( producer.get( page::id_type(0) ), []( page& p ) { p.number = 100; } );
+      producer.modify( producer.get( page::id_type(1) ), []( page& p ) { p.number = 0; } );
+      producer.modify( producer.get( page::id_type(0) ), []( page& p ) { p.number = 1; } );
+      auto delta = producer.last_undo_session_delta();
+
+      {
+         auto follower_session = follower.start_undo_session(true);
+         follower.apply_delta( delta.data(), delta.size() );
+         for( const auto& b : producer.get_index<book_index>() ) {
+            const auto* copy = follower.find<book>( b.id );
+            BOOST_REQUIRE( copy != nullptr );
+            BOOST_REQUIRE_EQUAL( copy->a, b.a );
+            BOOST_REQUIRE_EQUAL( copy->b, b.b );
+         }
+         BOOST_REQUIRE_EQUAL( follower.get_index<book_index>().size(), producer.get_index<book_index>().size() );
+         BOOST_REQUIRE_EQUAL( follower.get( page::id_type(0) ).number, 1 );
+         BOOST_REQUIRE_EQUAL( follower.get( page::id_type(1) ).number, 0 );
+         BOOST_REQUIRE( follower.find( book::id_type(6) ) == nullptr );
+         BOOST_REQUIRE_EQUAL( follower.get( book::id_type(7) ).b, 22 );
+      }
+      BOOST_REQUIRE_EQUAL( follower.get_index<book_index>().size(), 5u );
+      BOOST_REQUIRE_EQUAL( follower.get( page::id_type(0) ).number, 0 );
+      BOOST_REQUIRE_EQUAL( follower.get( book::id_type(1) ).b, -1 );
+
+      // The follower is back at the state before the delta, so only the truncation can fail
+      {
+         auto follower_session = follower.start_undo_session(true);
+         BOOST_CHECK_THROW( follower.apply_delta( delta.data(), delta.size() - 1 ), std::out_of_range );
+      }
+      BOOST_REQUIRE_EQUAL( follower.get_index<book_index>().size(), 5u );
+      BOOST_REQUIRE_EQUAL( follower.get( page::id_type(0) ).number, 0 );
+      BOOST_REQUIRE_EQUAL( follower.get( book::id_type(1) ).b, -1 );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      bfs::remove_all( temp2 );
+      throw;
+   }
+   bfs::remove_all( temp );
+   bfs::remove_all( temp2 );
+}
+
+// Collects the output of a stream that cannot seek, like a pipe
+struct unseekable_buffer : std::streambuf {
+   std::string data;
+   int_type overflow( int_type c ) override {
+      if( c != traits_type::eof() ) data.push_back( traits_type::to_char_type( c ) );
+      return c;
+   }
+   std::streamsize xsputn( const char* s, std::streamsize n ) override {
+      data.append( s, n );
+      return n;
+   }
+};
+
+BOOST_AUTO_TEST_CASE( snapshot ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   boost::filesystem::path temp2 = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   boost::filesystem::path temp3 = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      std::stringstream snapshot;
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*64);
+         db.add_index< book_index >();
+         db.add_index< page_index >();
+         db.set_revision( 42 );
+         for( int i = 0; i < 4; ++i ) {
+            db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+         }
+         db.remove( db.get( book::id_type(1) ) );
+         db.remove( db.get( book::id_type(3) ) );
+         // enough pages for several chunks
+         std::vector<int> numbers( 150000 );
+         std::iota( numbers.begin(), numbers.end(), 0 );
+         db.bulk_create<page>( numbers.begin(), numbers.end(), []( page& p, int n ) { p.number = n * 2; } );
+         db.write_snapshot( snapshot, 4 );
+         // Without seeking, the section sizes are measured before they are written
+         unseekable_buffer buffer;
+         std::ostream unseekable( &buffer );
+         db.write_snapshot( unseekable, 1 );
+         BOOST_TEST( buffer.data == snapshot.str() );
+      }
+      const bfs::path snapshot_file = temp / "snapshot.bin";
+      const bfs::path truncated_file = temp / "truncated.bin";
+      {
+         std::ofstream out( snapshot_file.generic_string(), std::ios::binary );
+         out << snapshot.str();
+         std::ofstream truncated_out( truncated_file.generic_string(), std::ios::binary );
+         truncated_out << snapshot.str().substr( 0, snapshot.str().size() - 1 );
+      }
+      chainbase::database db(temp2, database::read_write, 1024*1024*64);
+      db.add_index< book_index >();
+      db.add_index< page_index >();
+      // The first section claims more data than the snapshot holds
+      std::stringstream truncated( snapshot.str().substr( 0, 40 ) );
+      BOOST_CHECK_THROW( db.read_snapshot( truncated ), std::runtime_error );
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().size(), 0u );
+      db.read_snapshot( snapshot );
+      BOOST_REQUIRE_EQUAL( db.revision(), 42 );
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().size(), 2u );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(2) ).b, -2 );
+      BOOST_REQUIRE( db.find( book::id_type(1) ) == nullptr );
+      BOOST_REQUIRE_EQUAL( db.create<book>( []( book& b ) { b.a = 10; b.b = 10; } ).id._id, 4 );
+      const auto& pages = db.get_index<page_index>();
+      BOOST_REQUIRE_EQUAL( pages.size(), 150000u );
+      int expected = 0;
+      for( const auto& p : pages ) {
+         BOOST_REQUIRE_EQUAL( p.id._id, expected );
+         BOOST_REQUIRE_EQUAL( p.number, expected * 2 );
+         ++expected;
+      }
+
+      snapshot.clear();
+      snapshot.seekg( 0 );
+      BOOST_CHECK_THROW( db.read_snapshot( snapshot ), std::logic_error );
+
+      // A snapshot file is loaded one index per worker
+      chainbase::database db3(temp3, database::read_write, 1024*1024*64);
+      db3.add_index< book_index >();
+      db3.add_index< page_index >();
+      BOOST_CHECK_THROW( db3.read_snapshot( truncated_file, 4 ), std::runtime_error );
+      BOOST_REQUIRE_EQUAL( db3.get_index<book_index>().size(), 0u );
+      BOOST_REQUIRE_EQUAL( db3.get_index<page_index>().size(), 0u );
+      db3.read_snapshot( snapshot_file, 4 );
+      BOOST_REQUIRE_EQUAL( db3.revision(), 42 );
+      BOOST_REQUIRE_EQUAL( db3.get_index<book_index>().size(), 2u );
+      BOOST_REQUIRE_EQUAL( db3.get( book::id_type(2) ).b, -2 );
+      BOOST_REQUIRE_EQUAL( db3.get_index<page_index>().size(), 150000u );
+      BOOST_REQUIRE_EQUAL( db3.get( page::id_type(149999) ).number, 299998 );
+      BOOST_REQUIRE_EQUAL( db3.create<page>( []( page& p ) { p.number = -1; } ).id._id, 150000 );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      bfs::remove_all( temp2 );
+      bfs::remove_all( temp3 );
+      throw;
+   }
+   bfs::remove_all( temp );
+   bfs::remove_all( temp2 );
+   bfs::remove_all( temp3 );
+}
+
+BOOST_AUTO_TEST_CASE( undo_spill ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      db.add_index< page_index >();
+      db.set_undo_spill( temp / "undo_spill", 2 );
+
+      for( int i = 0; i < 100; ++i ) {
+         db.create<page>( [&]( page& p ) { p.number = i; } );
+      }
+      auto capture = [&] {
+         std::vector<std::pair<int64_t, uint64_t>> result;
+         for( const page& p : db.get_index<page_index>() ) result.emplace_back( p.id._id, p.number );
+         for( const book& b : db.get_index<book_index>() ) result.emplace_back( -b.id._id - 1, b.a );
+         return result;
+      };
+      std::vector<std::vector<std::pair<int64_t, uint64_t>>> states;
+      for( int i = 0; i < 20; ++i ) {
+         states.push_back( capture() );
+         auto session = db.start_undo_session(true);
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+         db.modify( db.get( page::id_type(i) ), [&]( page& p ) { p.number = 1000 + i; } );
+         db.modify( db.get( page::id_type(99 - i) ), [&]( page& p ) { p.number = 2000 + i; } );
+         db.remove( db.get( page::id_type(99 - i) ) );
+         session.push();
+      }
+      BOOST_REQUIRE( bfs::file_size( temp / "undo_spill" ) > 0 );
+
+      {
+         // squash reaches a spilled session once the sessions in memory have been undone
+         for( int i = 0; i < 4; ++i ) {
+            db.undo();
+            BOOST_REQUIRE( capture() == states.back() );
+            states.pop_back();
+         }
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( page::id_type(0) ), [&]( page& p ) { p.number = 3000; } );
+         session.squash();
+      }
+      while( !states.empty() ) {
+         db.undo();
+         BOOST_REQUIRE( capture() == states.back() );
+         states.pop_back();
+      }
+      BOOST_REQUIRE_EQUAL( bfs::file_size( temp / "undo_spill" ), 0u );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( undo_spill_error ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      db.set_undo_spill( temp / "undo_spill", 1 );
+      {
+         auto session = db.start_undo_session(true);
+         db.create<book>( [&]( book& b ) { b.a = 0; b.b = 0; } );
+         for( int i = 1; i < 4; ++i ) {
+            auto inner = db.start_undo_session(true);
+            db.create<book>( [&]( book& b ) { b.a = i; b.b = i; } );
+            inner.push();
+         }
+         BOOST_REQUIRE( bfs::file_size( temp / "undo_spill" ) > 0 );
+         bfs::resize_file( temp / "undo_spill", 0 );
+         db.undo();
+         db.undo();
+         // The session has been spilled and cannot be reloaded, which must not escape the destructor
+      }
+      BOOST_REQUIRE_EQUAL( db.revision(), 2 );
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().size(), 2u );
+      BOOST_CHECK_THROW( db.undo(), std::runtime_error );
+      BOOST_REQUIRE_EQUAL( db.get_index<book_index>().size(), 2u );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( revision_pin ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+
+      const auto& created = db.create<book>( [&]( book& b ) { b.a = 1; } );
+      const book::id_type id = created.id;
+      for( int i = 0; i < 3; ++i ) {
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( id ), [&]( book& b ) { b.a += 1; } );
+         session.push();
+      }
+      const int64_t base = db.revision();
+      BOOST_CHECK_THROW( db.pin_revision( base + 1 ), std::out_of_range );
+
+      auto pin = db.pin_revision( base - 2 );
+      {
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( id ), [&]( book& b ) { b.a = 100; } );
+         session.push();
+      }
+      // The commit is deferred, the pinned revision stays readable
+      db.commit( db.revision() );
+      BOOST_TEST( db.find_at_revision( pin, id )->a == 2 );
+      int visited = 0;
+      db.for_each_at_revision<book>( pin, [&]( const book& b ) { BOOST_TEST( b.a == 2 ); ++visited; } );
+      BOOST_TEST( visited == 1 );
+      BOOST_TEST( db.get_index<book_index>().undo_stack_revision_range().first == base - 2 );
+      db.undo();
+      BOOST_TEST( db.get( id ).a == 100 );
+      {
+         // Committed sessions are not undone
+         auto session = db.start_undo_session(true);
+         session.push();
+      }
+      db.commit( db.revision() );
+      db.undo_all();
+      BOOST_TEST( db.get( id ).a == 100 );
+      BOOST_TEST( db.revision() == base + 2 );
+
+      {
+         auto later = db.pin_revision();
+         BOOST_TEST( later.valid() );
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( id ), [&]( book& b ) { b.a = 200; } );
+         auto newest = db.pin_revision();
+         BOOST_TEST( db.find_at_revision( later, id )->a == 100 );
+         BOOST_TEST( db.find_at_revision( newest, id )->a == 200 );
+         session.undo();
+         BOOST_TEST( !newest.valid() );
+         BOOST_CHECK_THROW( db.find_at_revision( newest, id ), std::logic_error );
+      }
+
+      // Releasing the pin lets the next commit catch up
+      { auto released = std::move( pin ); }
+      BOOST_TEST( !pin.valid() );
+      db.commit( db.revision() );
+      auto range = db.get_index<book_index>().undo_stack_revision_range();
+      BOOST_TEST( range.first == range.second );
+
+      // A commit above the head revision does not commit the sessions that follow
+      db.commit( db.revision() + 10 );
+      {
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( id ), [&]( book& b ) { b.a = 300; } );
+      }
+      BOOST_TEST( db.get( id ).a == 100 );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( deferred_commit_on_close ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      int64_t committed = 0;
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< book_index >();
+         for( int i = 0; i < 3; ++i ) {
+            auto session = db.start_undo_session(true);
+            db.create<book>( [&]( book& b ) { b.a = i; b.b = i; } );
+            session.push();
+         }
+         auto pin = db.pin_revision( db.revision() - 2 );
+         committed = db.revision();
+         db.commit( committed );
+         BOOST_TEST( db.get_index<book_index>().undo_stack_revision_range().first == committed - 2 );
+      }
+      // The committed sessions were kept for the pin only, so they are gone after a restart
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      auto range = db.get_index<book_index>().undo_stack_revision_range();
+      BOOST_TEST( range.first == committed );
+      BOOST_TEST( range.second == committed );
+      db.undo_all();
+      BOOST_TEST( db.get_index<book_index>().size() == 3u );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( find_batch ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      db.add_index< page_index >();
+      for( int i = 0; i < 30; ++i ) {
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+         db.create<page>( [&]( page& p ) { p.number = i; } );
+      }
+      std::vector<book::id_type> book_ids;
+      std::vector<page::id_type> page_ids;
+      for( int i = 0; i < 40; i += 3 ) {
+         book_ids.push_back( book::id_type(i) );
+         page_ids.push_back( page::id_type(i) );
+      }
+      std::vector<const book*> books;
+      std::vector<const page*> pages;
+      db.find_batch<book>( book_ids.begin(), book_ids.end(), std::back_inserter( books ) );
+      db.find_batch<page>( page_ids.begin(), page_ids.end(), std::back_inserter( pages ) );
+      BOOST_REQUIRE_EQUAL( books.size(), book_ids.size() );
+      BOOST_REQUIRE_EQUAL( pages.size(), page_ids.size() );
+      for( std::size_t i = 0; i < book_ids.size(); ++i ) {
+         BOOST_TEST( books[i] == db.find( book_ids[i] ) );
+         BOOST_TEST( pages[i] == db.find( page_ids[i] ) );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( typed_database_sessions ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      // The coverage is checked before the missing page_index is added
+      BOOST_CHECK_THROW( chainbase::typed_database< page_index >{ db }, std::logic_error );
+      BOOST_CHECK_NO_THROW( chainbase::typed_database< book_index >{ db } );
+      chainbase::typed_database< book_index, page_index > tdb( db );
+      BOOST_CHECK_THROW( chainbase::typed_database< book_index >{ db }, std::logic_error );
+      const auto& books = tdb.get_index< book_index >();
+
+      const int64_t base = tdb.revision();
+      {
+         auto session = tdb.start_undo_session(true);
+         db.create<book>( [&]( book& b ) { b.a = 1; b.b = 1; } );
+         db.create<page>( [&]( page& p ) { p.number = 1; } );
+         BOOST_TEST( tdb.revision() == base + 1 );
+         {
+            auto inner = tdb.start_undo_session(true);
+            db.modify( db.get( book::id_type(0) ), [&]( book& b ) { b.a = 2; } );
+            inner.squash();
+         }
+         BOOST_TEST( books.get( book::id_type(0) ).a == 2 );
+         {
+            auto inner = tdb.start_undo_session(true);
+            db.remove( db.get( page::id_type(0) ) );
+            auto moved = std::move( inner );
+         }
+         BOOST_TEST( db.find( page::id_type(0) ) != nullptr );
+         session.push();
+      }
+      BOOST_TEST( tdb.revision() == base + 1 );
+      BOOST_TEST( db.revision() == base + 1 );
+      {
+         auto disabled = tdb.start_undo_session(false);
+         BOOST_TEST( tdb.revision() == base + 1 );
+      }
+      db.set_lazy_sessions( true );
+      BOOST_CHECK_THROW( tdb.undo(), std::logic_error );
+      BOOST_CHECK_THROW( tdb.squash(), std::logic_error );
+      db.set_lazy_sessions( false );
+      BOOST_TEST( books.size() == 1u );
+      tdb.undo();
+      BOOST_TEST( books.size() == 0u );
+      BOOST_TEST( tdb.get_index< page_index >().size() == 0u );
+      BOOST_TEST( db.revision() == base );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( lazy_sessions ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      db.add_index< page_index >();
+      db.create<book>( [&]( book& b ) { b.a = 1; b.b = 1; } );
+      db.create<page>( [&]( page& p ) { p.number = 1; } );
+      db.set_lazy_sessions( true );
+      const auto& books = db.get_index<book_index>();
+      const auto& pages = db.get_index<page_index>();
+      const int64_t base = db.revision();
+
+      auto outer = db.start_undo_session(true);
+      {
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( book::id_type(0) ), [&]( book& b ) { b.a = 2; } );
+         session.push();
+      }
+      {
+         // A session that writes nothing does not touch any index
+         auto session = db.start_undo_session(true);
+         BOOST_TEST( db.revision() == base + 3 );
+         BOOST_TEST( books.revision() == base + 2 );
+         BOOST_TEST( pages.revision() == base );
+         BOOST_TEST( ( db.undo_stack_revision_range() == std::pair<int64_t, int64_t>( base, base + 3 ) ) );
+      }
+      BOOST_TEST( db.revision() == base + 2 );
+      BOOST_TEST( books.get( book::id_type(0) ).a == 2 );
+      {
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( page::id_type(0) ), [&]( page& p ) { p.number = 3; } );
+         BOOST_TEST( pages.revision() == base + 3 );
+         BOOST_TEST( db.last_undo_session_delta().size() > sizeof(uint32_t) );
+         session.squash();
+      }
+      BOOST_TEST( db.revision() == base + 2 );
+      BOOST_TEST( pages.revision() == base + 2 );
+      BOOST_TEST( books.revision() == base + 2 );
+      db.undo();
+      BOOST_TEST( books.get( book::id_type(0) ).a == 1 );
+      BOOST_TEST( pages.get( page::id_type(0) ).number == 1 );
+      BOOST_TEST( db.revision() == base + 1 );
+      BOOST_TEST( pages.revision() == base + 1 );
+      outer.undo();
+      BOOST_TEST( db.revision() == base );
+      BOOST_TEST( books.revision() == base );
+
+      {
+         auto session = db.start_undo_session(true);
+         db.create<book>( [&]( book& b ) { b.a = 5; b.b = 5; } );
+         session.push();
+      }
+      db.start_undo_session(true).push();
+      db.set_lazy_sessions( false );
+      BOOST_TEST( ( books.undo_stack_revision_range() == pages.undo_stack_revision_range() ) );
+      BOOST_TEST( pages.revision() == base + 2 );
+      db.undo_all();
+      BOOST_TEST( books.size() == 1u );
+      BOOST_TEST( db.revision() == base );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( lazy_commit ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      db.add_index< page_index >();
+      db.create<book>( [&]( book& b ) { b.a = 1; b.b = 1; } );
+      db.create<page>( [&]( page& p ) { p.number = 1; } );
+      const auto& books = db.get_index<book_index>();
+      const auto& pages = db.get_index<page_index>();
+      const int64_t base = db.revision();
+      {
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( book::id_type(0) ), [&]( book& b ) { b.a = 2; } );
+         db.modify( db.get( page::id_type(0) ), [&]( page& p ) { p.number = 2; } );
+         session.push();
+      }
+      db.set_lazy_sessions( true );
+      auto write_book = [&]( int a ) {
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( book::id_type(0) ), [&]( book& b ) { b.a = a; } );
+         session.push();
+      };
+
+      // The first commit visits every index, including the untouched pages
+      write_book( 3 );
+      db.commit( base + 2 );
+      BOOST_TEST( ( books.undo_stack_revision_range() == std::pair<int64_t, int64_t>( base + 2, base + 2 ) ) );
+      BOOST_TEST( ( pages.undo_stack_revision_range() == std::pair<int64_t, int64_t>( base + 1, base + 1 ) ) );
+
+      // Later commits only visit the touched indices
+      write_book( 4 );
+      {
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( page::id_type(0) ), [&]( page& p ) { p.number = 4; } );
+         session.push();
+      }
+      write_book( 5 );
+      db.commit( base + 4 );
+      BOOST_TEST( ( books.undo_stack_revision_range() == std::pair<int64_t, int64_t>( base + 4, base + 5 ) ) );
+      BOOST_TEST( ( pages.undo_stack_revision_range() == std::pair<int64_t, int64_t>( base + 4, base + 4 ) ) );
+      db.undo();
+      BOOST_TEST( books.get( book::id_type(0) ).a == 4 );
+      db.undo();
+      BOOST_TEST( db.revision() == base + 4 );
+      BOOST_TEST( pages.get( page::id_type(0) ).number == 4 );
+
+      db.set_lazy_sessions( false );
+      BOOST_TEST( ( db.undo_stack_revision_range() == std::pair<int64_t, int64_t>( base + 4, base + 4 ) ) );
+      BOOST_TEST( ( pages.undo_stack_revision_range() == std::pair<int64_t, int64_t>( base + 4, base + 4 ) ) );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( lazy_commit_range ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      // The first index is never written to, so its undo stack stops below the commit
+      db.add_index< page_index >();
+      db.add_index< book_index >();
+      db.create<book>( [&]( book& b ) { b.a = 1; b.b = 1; } );
+      db.set_lazy_sessions( true );
+      const int64_t base = db.revision();
+      for( int i = 2; i <= 4; ++i ) {
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( book::id_type(0) ), [&]( book& b ) { b.a = i; } );
+         session.push();
+      }
+      BOOST_TEST( ( db.undo_stack_revision_range() == std::pair<int64_t, int64_t>( base, base + 3 ) ) );
+      db.commit( base + 2 );
+      BOOST_TEST( ( db.get_index<page_index>().undo_stack_revision_range() == std::pair<int64_t, int64_t>( base, base ) ) );
+      BOOST_TEST( ( db.undo_stack_revision_range() == std::pair<int64_t, int64_t>( base + 2, base + 3 ) ) );
+      for( int i = 0; i < 10 && db.revision() > db.undo_stack_revision_range().first; ++i ) db.undo();
+      BOOST_TEST( db.revision() == base + 2 );
+      BOOST_TEST( db.get( book::id_type(0) ).a == 3 );
+      BOOST_TEST( ( db.undo_stack_revision_range() == std::pair<int64_t, int64_t>( base + 2, base + 2 ) ) );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( metrics_snapshot ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      db.add_index< page_index >();
+      for( int i = 0; i < 7; ++i ) db.create<book>( [&]( book& b ) { b.a = i; b.b = i; } );
+      {
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( book::id_type(0) ), [&]( book& b ) { b.a = 10; } );
+         db.remove( db.get( book::id_type(1) ) );
+         session.push();
+      }
+
+      auto metrics = db.metrics_snapshot();
+      BOOST_TEST_REQUIRE( metrics.size() == 2u );
+      const index_metrics& books = metrics[0];
+      BOOST_TEST( books.type_id == 0u );
+      BOOST_TEST( books.row_count == 6u );
+      BOOST_TEST( books.tree_heights.size() == 3u );
+      for( uint32_t height : books.tree_heights ) BOOST_TEST( height == 3u );
+      BOOST_TEST( books.undo_sessions == 1u );
+      BOOST_TEST( books.old_values == 1u );
+      BOOST_TEST( books.removed_values == 1u );
+      BOOST_TEST( metrics[1].row_count == 0u );
+      BOOST_TEST( metrics[1].tree_heights.size() == 2u );
+      BOOST_TEST( metrics[1].tree_heights[0] == 0u );
+
+      db.undo();
+      metrics = db.metrics_snapshot();
+      BOOST_TEST( metrics[0].undo_sessions == 0u );
+      BOOST_TEST( metrics[0].old_values == 0u );
+      if( metrics_enabled ) {
+         BOOST_TEST( metrics[0][index_op::emplace].count == 7u );
+         BOOST_TEST( metrics[0][index_op::modify].count == 1u );
+         BOOST_TEST( metrics[0][index_op::remove].count == 1u );
+         BOOST_TEST( metrics[0][index_op::find].count == 2u );
+         BOOST_TEST( metrics[0][index_op::undo].count == 1u );
+         BOOST_TEST( metrics[1][index_op::undo].count == 1u );
+         BOOST_TEST( metrics[0][index_op::emplace].percentile( 1.0 ) == metrics[0][index_op::emplace].max_ns );
+         db.reset_metrics();
+         BOOST_TEST( db.metrics_snapshot()[0][index_op::emplace].count == 0u );
+      } else {
+         BOOST_TEST( metrics[0][index_op::emplace].count == 0u );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( latency_histogram_buckets ) {
+   latency_histogram h;
+   for( uint64_t ns = 1; ns <= 1000; ++ns ) h.record( ns );
+   h.record( uint64_t(1) << 40 );
+   latency_stats stats = h.snapshot();
+   BOOST_TEST( stats.count == 1001u );
+   BOOST_TEST( stats.max_ns == uint64_t(1) << 40 );
+   // Each bucket bounds its values within 1/8
+   for( uint64_t ns : { 0, 7, 8, 15, 16, 1000, 123456789 } ) {
+      std::size_t bucket = latency_stats::bucket_of( ns );
+      BOOST_TEST( latency_stats::bucket_lower_bound( bucket ) <= ns );
+      BOOST_TEST( latency_stats::bucket_lower_bound( bucket + 1 ) > ns );
+      BOOST_TEST( latency_stats::bucket_lower_bound( bucket + 1 ) - latency_stats::bucket_lower_bound( bucket ) <= std::max<uint64_t>( 1, ns / 8 ) );
+   }
+   BOOST_TEST( latency_stats::bucket_of( ~uint64_t(0) ) == latency_stats::bucket_count - 1 );
+   uint64_t median = stats.percentile( 0.5 );
+   BOOST_TEST( median >= 500u );
+   BOOST_TEST( median <= 500u * 9 / 8 );
+   BOOST_TEST( stats.percentile( 1.0 ) == uint64_t(1) << 40 );
+}
+
+BOOST_AUTO_TEST_CASE( trace_recording ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      db.create<book>( [&]( book& b ) { b.a = 1; b.b = 1; } );
+      db.start_trace( temp / "trace" );
+      db.add_index< page_index >();
+      {
+         auto session = db.start_undo_session(true);
+         db.create<book>( [&]( book& b ) { b.a = 2; b.b = 2; } );
+         db.modify( db.get( book::id_type(0) ), [&]( book& b ) { b.b = 3; } );
+         db.modify( db.get( book::id_type(1) ), [&]( book& b ) { ++b.id._id; --b.id._id; } );
+         BOOST_TEST( db.find<book>( book::id_type(5) ) == nullptr );
+         db.remove( db.get( book::id_type(0) ) );
+         session.push();
+      }
+      db.start_undo_session(true).squash();
+      db.undo();
+      db.commit( db.revision() );
+      db.stop_trace();
+
+      trace_reader reader( temp / "trace" );
+      BOOST_TEST( reader.revision() == 0 );
+      std::vector<trace_event> events;
+      for( trace_event event; reader.next( event ); ) events.push_back( event );
+      std::vector<std::tuple<trace_op, uint32_t, uint64_t, uint64_t>> expected{
+         { trace_op::add_index, 0, 0, sizeof(book) },
+         { trace_op::add_index, 1, 0, sizeof(page) },
+         { trace_op::start_session, 0, 0, 0 },
+         { trace_op::create, 0, 1, 0 },
+         { trace_op::find, 0, 1, 0 },
+         { trace_op::modify, 0, 0, 1 << 2 },
+         { trace_op::find, 0, 2, 0 },
+         { trace_op::modify, 0, 1, 0 },
+         { trace_op::find, 0, 0, 0 },
+         { trace_op::find, 0, 1, 0 },
+         { trace_op::remove, 0, 0, 0 },
+         { trace_op::start_session, 0, 0, 0 },
+         { trace_op::squash, 0, 0, 0 },
+         { trace_op::undo, 0, 0, 0 },
+         { trace_op::commit, 0, 0, 0 },
+      };
+      BOOST_TEST_REQUIRE( events.size() == expected.size() );
+      for( std::size_t i = 0; i < events.size(); ++i ) {
+         BOOST_TEST_CONTEXT( "event " << i ) {
+            BOOST_TEST( ( events[i].op == std::get<0>( expected[i] ) ) );
+            BOOST_TEST( events[i].type_id == std::get<1>( expected[i] ) );
+            BOOST_TEST( events[i].id == std::get<2>( expected[i] ) );
+            BOOST_TEST( events[i].value == std::get<3>( expected[i] ) );
+         }
+      }
+      BOOST_TEST( events[0].rows == 1u );
+      BOOST_TEST( events[0].next_id == 1u );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( index_footer ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 1024*1024*8);
+         db.add_index< book_index >();
+         for( int i = 0; i < 3; ++i ) db.create<book>( [&]( book& b ) { b.a = i; b.b = i; } );
+         auto session = db.start_undo_session(true);
+         db.modify( db.get( book::id_type(0) ), [&]( book& b ) { b.b = 10; } );
+         db.remove( db.get( book::id_type(1) ) );
+         session.push();
+      }
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      const chainbase::undo_index_footer& footer = db.get_index<book_index>().footer();
+      BOOST_TEST( footer.magic == chainbase::undo_index_footer::magic_value );
+      BOOST_TEST( footer.index_count == 3u );
+      BOOST_TEST( footer.row_count == 2u );
+      BOOST_TEST( footer.next_id == 3u );
+      BOOST_TEST( footer.revision == 1 );
+      BOOST_TEST( footer.undo_sessions == 1u );
+      BOOST_TEST( footer.undo_records == 2u );
+      BOOST_TEST( footer.undo_bytes > 0u );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( concurrent_readers ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 1024*1024*8);
+      db.add_index< book_index >();
+      // Every book has b == -a, which a reader would see broken in the middle of a modify
+      {
+         auto lock = db.write_lock();
+         for( int i = 1; i <= 50; ++i ) db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+      }
+      BOOST_TEST( db.write_epoch() == 2u );
+      // The finds of the readers are recorded alongside the operations of the writer
+      {
+         auto lock = db.write_lock();
+         db.start_trace( temp / "trace" );
+      }
+
+      std::atomic<bool> done{ false };
+      std::atomic<int> errors{ 0 };
+      std::atomic<uint64_t> reads{ 0 };
+      std::vector<std::thread> readers;
+      for( int t = 0; t < 4; ++t ) {
+         readers.emplace_back( [&] {
+            auto reader = db.make_reader();
+            uint64_t last_epoch = 0;
+            while( !done.load() ) {
+               std::shared_lock<epoch_lock::reader> lock( reader );
+               uint64_t epoch = reader.epoch();
+               if( ( epoch & 1 ) || epoch < last_epoch ) ++errors;
+               last_epoch = epoch;
+               const auto& idx = db.get_index<book_index>();
+               std::size_t rows = 0;
+               for( const book& b : idx ) {
+                  if( b.a != -b.b ) ++errors;
+                  ++rows;
+               }
+               if( rows != idx.size() || rows != 50 ) ++errors;
+               const book* first = db.find<book>( book::id_type( 0 ) );
+               if( !first || first->a != -first->b ) ++errors;
+               ++reads;
+            }
+         } );
+      }
+
+      while( reads.load() < 4 ) std::this_thread::yield();
+      int next = 1000;
+      for( int i = 0; i < 300; ++i ) {
+         auto lock = db.write_lock();
+         auto session = db.start_undo_session( true );
+         for( int j = 0; j < 5; ++j, ++next ) {
+            db.modify( db.get( book::id_type( next % 50 ) ), [&]( book& b ) { b.a = next; } );
+            db.modify( db.get( book::id_type( next % 50 ) ), [&]( book& b ) { b.b = -next; } );
+         }
+         if( i % 3 == 0 ) session.undo();
+         else session.push();
+         if( i % 10 == 9 ) db.commit( db.revision() );
+         if( i % 10 == 0 ) std::this_thread::yield();
+      }
+      done = true;
+      for( auto& t : readers ) t.join();
+      BOOST_TEST( errors.load() == 0 );
+      BOOST_TEST( db.write_epoch() == 604u );
+      db.stop_trace();
+
+      trace_reader trace( temp / "trace" );
+      std::size_t finds = 0, modifies = 0;
+      for( trace_event event; trace.next( event ); ) {
+         if( event.op == trace_op::find ) ++finds;
+         if( event.op == trace_op::modify ) ++modifies;
+      }
+      BOOST_TEST( finds == reads.load() + 3000 );
+      BOOST_TEST( modifies == 3000u );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( reader_slots ) {
+   epoch_lock lock;
+   std::vector<epoch_lock::reader> readers;
+   for( std::size_t i = 0; i < epoch_lock::max_readers; ++i ) readers.push_back( lock.make_reader() );
+   BOOST_CHECK_THROW( lock.make_reader(), std::runtime_error );
+   readers.pop_back();
+   readers.push_back( lock.make_reader() );
+
+   readers[0].lock_shared();
+   BOOST_TEST( !lock.try_lock() );
+   BOOST_TEST( lock.epoch() == 0u );
+   readers[0].unlock_shared();
+   BOOST_TEST( lock.try_lock() );
+   BOOST_TEST( !readers[1].try_lock_shared() );
+   lock.unlock();
+   BOOST_TEST( readers[1].try_lock_shared() );
+   readers[1].unlock_shared();
+   BOOST_TEST( lock.epoch() == 2u );
+}
+
 // BOOST_AUTO_TEST_SUITE_END()
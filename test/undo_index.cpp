@@ -1,12 +1,19 @@
 #include <chainbase/undo_index.hpp>
 
+#include <boost/multi_index/composite_key.hpp>
+#include <boost/multi_index/mem_fun.hpp>
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/ranked_index.hpp>
 
 #include <boost/test/unit_test.hpp>
 #include <boost/test/data/monomorphic.hpp>
 #include <boost/test/data/test_case.hpp>
 
+#include <map>
+#include <string_view>
+#include <tuple>
+
 
 namespace {
 int exception_counter = 0;
@@ -83,6 +90,46 @@ struct key_impl<T C::*> { template<auto F> using fn = boost::multi_index::member
 template<auto Fn>
 using key = typename key_impl<decltype(Fn)>::template fn<Fn>;
 
+struct dense_element_t {
+   template<typename C, typename A>
+   dense_element_t(C&& c, const std::allocator<A>&) { c(*this); }
+   uint64_t id;
+   int secondary;
+   throwing_copy dummy;
+};
+
+struct diff_element_t {
+   template<typename C, typename A>
+   diff_element_t(C&& c, const std::allocator<A>&) { c(*this); }
+   uint64_t id;
+   int secondary;
+   uint64_t payload[16];
+};
+
+struct observed_element_t {
+   template<typename C, typename A>
+   observed_element_t(C&& c, const std::allocator<A>&) { c(*this); }
+   uint64_t id;
+   int secondary;
+};
+
+// The events seen by the observer of observed_element_t as (event, id, secondary before, secondary after)
+std::vector<std::tuple<std::string, uint64_t, int, int>> observed_events;
+
+}
+
+namespace chainbase {
+template<> struct use_dense_id_table<dense_element_t> : std::true_type {};
+template<> struct use_diff_undo<diff_element_t> : std::true_type {};
+template<> struct undo_index_observer<observed_element_t> : undo_index_observer_base<observed_element_t> {
+   static void after_emplace(const observed_element_t& obj) noexcept { observed_events.emplace_back("emplace", obj.id, 0, obj.secondary); }
+   static void before_modify(const observed_element_t& obj) noexcept { observed_events.emplace_back("before_modify", obj.id, obj.secondary, 0); }
+   static void after_modify(const observed_element_t& obj) noexcept { observed_events.emplace_back("after_modify", obj.id, 0, obj.secondary); }
+   static void before_remove(const observed_element_t& obj) noexcept { observed_events.emplace_back("remove", obj.id, obj.secondary, 0); }
+   static void on_undo(const observed_element_t* before, const observed_element_t* after) noexcept {
+      observed_events.emplace_back("undo", before ? before->id : after->id, before ? before->secondary : -1, after ? after->secondary : -1);
+   }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(undo_index_tests)
@@ -528,6 +575,77 @@ EXCEPTION_TEST_CASE(test_modify_conflict) {
    BOOST_TEST(i0.get<3>().find(2)->x2 == 2);
 }
 
+EXCEPTION_TEST_CASE(test_modify_key_subset) {
+   chainbase::undo_index<conflict_element_t, test_allocator<conflict_element_t>,
+                         boost::multi_index::ordered_unique<key<&conflict_element_t::id>>,
+                         boost::multi_index::ordered_unique<boost::multi_index::composite_key<conflict_element_t,
+                                                                                              key<&conflict_element_t::x0>,
+                                                                                              key<&conflict_element_t::x1>>>,
+                         boost::multi_index::ordered_unique<key<&conflict_element_t::x2>>> i0;
+   for(int i = 0; i < 5; ++i) {
+      i0.emplace([&](conflict_element_t& elem) { elem.x0 = i; elem.x1 = 0; elem.x2 = i; });
+   }
+   auto check_order = [&]{
+      int prev = -1;
+      for(const auto& elem : i0.get<1>()) { BOOST_TEST(elem.x0 > prev); prev = elem.x0; }
+      prev = -1;
+      for(const auto& elem : i0.get<2>()) { BOOST_TEST(elem.x2 > prev); prev = elem.x2; }
+   };
+   // without an undo session there is no backup to compare the composite key against
+   i0.modify(i0.get(0), [](conflict_element_t& elem) { elem.x0 = 10; });
+   check_order();
+   {
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(1), [](conflict_element_t& elem) { elem.x2 = 20; });
+      i0.modify(i0.get(2), [](conflict_element_t& elem) { elem.x0 = 20; });
+      i0.modify(i0.get(2), [](conflict_element_t& elem) { elem.x1 = 1; });
+      check_order();
+      BOOST_TEST(i0.get<2>().rbegin()->id == 1u);
+      BOOST_TEST(i0.get<1>().rbegin()->id == 2u);
+      BOOST_CHECK_THROW(i0.modify(i0.get(3), [](conflict_element_t& elem) { elem.x0 = 4; }), std::logic_error);
+      BOOST_TEST(i0.get(3).x0 == 3);
+      check_order();
+   }
+   BOOST_TEST(i0.get(1).x2 == 1);
+   BOOST_TEST(i0.get(2).x0 == 2);
+   BOOST_TEST(i0.get(2).x1 == 0);
+   check_order();
+}
+
+struct view_element_t {
+   template<typename C, typename A>
+   view_element_t(C&& c, const test_allocator<A>&) { c(*this); }
+   std::string_view name_view() const { return { name, sizeof(name) }; }
+   uint64_t id;
+   char name[2];
+   throwing_copy dummy;
+};
+
+// A key that views the object compares equal to itself after a modify, so it must not be saved
+EXCEPTION_TEST_CASE(test_modify_view_key) {
+   chainbase::undo_index<view_element_t, test_allocator<view_element_t>,
+                         boost::multi_index::ordered_unique<key<&view_element_t::id>>,
+                         boost::multi_index::ordered_unique<boost::multi_index::const_mem_fun<view_element_t, std::string_view, &view_element_t::name_view>>> i0;
+   for(char c : { 'b', 'c', 'd' }) {
+      i0.emplace([&](view_element_t& elem) { elem.name[0] = c; elem.name[1] = c; });
+   }
+   auto check_order = [&]{
+      std::string_view prev;
+      for(const auto& elem : i0.get<1>()) { BOOST_TEST((prev < elem.name_view())); prev = elem.name_view(); }
+   };
+   i0.modify(i0.get(2), [](view_element_t& elem) { elem.name[0] = 'a'; });
+   check_order();
+   BOOST_TEST(i0.get<1>().begin()->id == 2u);
+   {
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(2), [](view_element_t& elem) { elem.name[0] = 'e'; });
+      check_order();
+      BOOST_TEST(i0.get<1>().rbegin()->id == 2u);
+   }
+   check_order();
+   BOOST_TEST(i0.get<1>().begin()->id == 2u);
+}
+
 BOOST_DATA_TEST_CASE(test_insert_fail, boost::unit_test::data::make({true, false}), use_undo) {
    chainbase::undo_index<conflict_element_t, test_allocator<conflict_element_t>,
                          boost::multi_index::ordered_unique<key<&conflict_element_t::id>>,
@@ -643,4 +761,662 @@ EXCEPTION_TEST_CASE(test_remove_tracking_no_session) {
    BOOST_CHECK(tracker.is_removed(elem1));
 }
 
+EXCEPTION_TEST_CASE(test_dense_id_table) {
+   chainbase::undo_index<dense_element_t, test_allocator<dense_element_t>,
+                         boost::multi_index::ordered_unique<key<&dense_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&dense_element_t::secondary>>> i0;
+   for(int i = 0; i < 1100; ++i) {
+      i0.emplace([&](dense_element_t& elem) { elem.secondary = i; });
+   }
+   BOOST_TEST(i0.find(1099)->secondary == 1099);
+   BOOST_TEST(i0.find(1100) == nullptr);
+   BOOST_TEST(i0.find(-1) == nullptr);
+   {
+      auto session = i0.start_undo_session(true);
+      i0.remove(i0.get(5));
+      i0.remove(i0.get(1030));
+      i0.emplace([](dense_element_t& elem) { elem.secondary = 5000; });
+      BOOST_TEST(i0.find(5) == nullptr);
+      BOOST_TEST(i0.find(1030) == nullptr);
+      BOOST_TEST(i0.find(1100)->secondary == 5000);
+      i0.modify(i0.get(7), [](dense_element_t& elem) { elem.secondary = 7000; });
+      BOOST_TEST(i0.find(7)->secondary == 7000);
+   }
+   BOOST_TEST(i0.find(5)->secondary == 5);
+   BOOST_TEST(i0.find(1030)->secondary == 1030);
+   BOOST_TEST(i0.find(7)->secondary == 7);
+   BOOST_TEST(i0.find(1100) == nullptr);
+   BOOST_TEST(&i0.get(5) == &*i0.get<1>().find(5));
+   BOOST_CHECK_THROW(i0.modify(i0.get(3), [](dense_element_t& elem) { elem.secondary = 4; }), std::logic_error);
+   BOOST_TEST(i0.find(3) == nullptr);
+}
+
+EXCEPTION_TEST_CASE(test_diff_undo) {
+   chainbase::undo_index<diff_element_t, test_allocator<diff_element_t>,
+                         boost::multi_index::ordered_unique<key<&diff_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&diff_element_t::secondary>>> i0;
+   using state = std::map<uint64_t, std::vector<uint64_t>>;
+   auto capture = [&]{
+      state result;
+      for(const diff_element_t& elem : i0) {
+         std::vector<uint64_t> values{uint64_t(elem.secondary)};
+         values.insert(values.end(), std::begin(elem.payload), std::end(elem.payload));
+         result[elem.id] = values;
+      }
+      return result;
+   };
+   for(int i = 0; i < 10; ++i) {
+      i0.emplace([&](diff_element_t& elem) { elem.secondary = i; std::fill(std::begin(elem.payload), std::end(elem.payload), i); });
+   }
+   state original = capture();
+   {
+      auto session = i0.start_undo_session(true);
+      // small diff, stored inline
+      i0.modify(i0.get(1), [](diff_element_t& elem) { elem.payload[3] = 100; });
+      // large diff, and a modify of the same object in the same session
+      i0.modify(i0.get(1), [](diff_element_t& elem) { std::fill(std::begin(elem.payload), std::end(elem.payload), 200); });
+      i0.modify(i0.get(2), [](diff_element_t& elem) { elem.secondary = 20; });
+      i0.modify(i0.get(3), [](diff_element_t& elem) {});
+      BOOST_CHECK_THROW(i0.modify(i0.get(4), [](diff_element_t& elem) { elem.secondary = 5; }), std::logic_error);
+      BOOST_TEST(i0.get(4).secondary == 4);
+      i0.modify(i0.get(5), [](diff_element_t& elem) { elem.payload[0] = 500; });
+      i0.remove(i0.get(5));
+      i0.emplace([](diff_element_t& elem) { elem.secondary = 10; });
+      i0.modify(i0.get(10), [](diff_element_t& elem) { elem.secondary = 11; });
+      std::vector<std::reference_wrapper<const diff_element_t>> swap{i0.get(6), i0.get(7)};
+      i0.modify_each(swap.begin(), swap.end(), [](diff_element_t& elem) { elem.secondary = 13 - elem.secondary; });
+      BOOST_TEST(i0.get(6).secondary == 7);
+      BOOST_TEST(i0.get(7).secondary == 6);
+      BOOST_TEST(i0.get<1>().find(20)->id == 2u);
+   }
+   BOOST_TEST(capture() == original);
+   BOOST_TEST(&*i0.get<1>().find(2) == &i0.get(2));
+   {
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(1), [](diff_element_t& elem) { elem.secondary = 100; });
+      state expected = capture();
+      {
+         auto session2 = i0.start_undo_session(true);
+         i0.modify(i0.get(1), [](diff_element_t& elem) { elem.secondary = 101; elem.payload[15] = 1; });
+         i0.emplace([](diff_element_t& elem) { elem.secondary = 50; });
+         i0.modify(i0.get(8), [](diff_element_t& elem) { elem.secondary = 80; });
+         session2.squash();
+      }
+      i0.modify(i0.get(10), [](diff_element_t& elem) { elem.secondary = 51; });
+      i0.remove(i0.get(10));
+      session.undo();
+      BOOST_TEST(capture() == original);
+   }
+   {
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(9), [](diff_element_t& elem) { elem.secondary = 90; });
+      session.push();
+   }
+   i0.commit(i0.revision());
+   BOOST_TEST(i0.get(9).secondary == 90);
+}
+
+EXCEPTION_TEST_CASE(test_spill) {
+   using index_type = chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                                            boost::multi_index::ordered_unique<key<&test_element_t::secondary>>>;
+   index_type i0;
+   struct stored_value { uint64_t mtime; uint64_t id; int secondary; };
+   // removed values and old values of each spilled session
+   std::vector<std::pair<std::vector<stored_value>, std::vector<stored_value>>> file;
+   auto store = [&](const index_type::spilled_records& records) {
+      BOOST_TEST(records.diff_values.empty());
+      auto copy = [](const auto& values) {
+         std::vector<stored_value> result;
+         for(const auto& [value, mtime] : values) result.push_back({mtime, value->id, value->secondary});
+         return result;
+      };
+      file.emplace_back(copy(records.removed_values), copy(records.old_values));
+      return int64_t(file.size() - 1);
+   };
+   auto load = [&](int64_t location, index_type::spill_loader& loader) {
+      for(const stored_value& v : file[location].first)
+         loader.removed_value(v.mtime, [&](test_element_t& elem) { elem.id = v.id; elem.secondary = v.secondary; });
+      for(const stored_value& v : file[location].second)
+         loader.old_value(v.mtime, [&](test_element_t& elem) { elem.id = v.id; elem.secondary = v.secondary; });
+   };
+   auto capture = [&]{
+      std::map<uint64_t, int> result;
+      for(const test_element_t& elem : i0) result[elem.id] = elem.secondary;
+      return result;
+   };
+   auto check_index = [&]{
+      for(const test_element_t& elem : i0) BOOST_TEST(&*i0.get<1>().find(elem.secondary) == &elem);
+   };
+
+   for(int i = 0; i < 20; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   }
+   std::vector<std::map<uint64_t, int>> states;
+   for(int i = 0; i < 6; ++i) {
+      states.push_back(capture());
+      auto session = i0.start_undo_session(true);
+      for(int j = 0; j < 3; ++j) i0.modify(i0.get(3*i + j), [](test_element_t& elem) { elem.secondary += 100; });
+      i0.remove(i0.get(3*i + 2));
+      if(i > 0) i0.modify(i0.get(20 + i - 1), [](test_element_t& elem) { elem.secondary += 100; });
+      i0.emplace([&](test_element_t& elem) { elem.secondary = 2000 + i; });
+      session.push();
+   }
+   BOOST_TEST(i0.spill(2, store) == 4u);
+   BOOST_TEST(i0.spilled_sessions() == 4u);
+   BOOST_TEST(i0.spill(2, store) == 0u);
+   BOOST_CHECK_THROW(i0.delta_between(i0.revision() - 6, i0.revision()), std::logic_error);
+   BOOST_TEST(i0.delta_between(i0.revision() - 2, i0.revision()).removed.size() == 2u);
+
+   i0.undo();
+   BOOST_TEST(capture() == states[5]);
+   states.pop_back();
+   // Squash a session that is in memory into a spilled session
+   i0.unspill(2, load);
+   BOOST_TEST(i0.spilled_sessions() == 3u);
+   i0.squash();
+   states.pop_back();
+   i0.undo();
+   BOOST_TEST(capture() == states[3]);
+   states.pop_back();
+   // Modify a spilled session, including an object with a spilled old value
+   i0.modify(i0.get(1), [](test_element_t& elem) { elem.secondary = 5000; });
+   i0.remove(i0.get(7));
+   while(!states.empty()) {
+      i0.unspill(1, load);
+      i0.undo();
+      BOOST_TEST(capture() == states.back());
+      check_index();
+      states.pop_back();
+   }
+   BOOST_TEST(i0.spilled_sessions() == 0u);
+
+   for(int i = 0; i < 3; ++i) {
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(i), [](test_element_t& elem) { elem.secondary += 100; });
+      i0.remove(i0.get(10 + i));
+      session.push();
+   }
+   auto expected = capture();
+   BOOST_TEST(i0.spill(1, store) == 2u);
+   i0.commit(i0.revision());
+   BOOST_TEST(i0.spilled_sessions() == 0u);
+   BOOST_TEST(capture() == expected);
+}
+
+EXCEPTION_TEST_CASE(test_find_at_revision) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   auto capture = [&]{
+      std::map<uint64_t, int> result;
+      for(const test_element_t& elem : i0) result[elem.id] = elem.secondary;
+      return result;
+   };
+   for(int i = 0; i < 10; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   }
+   std::vector<std::map<uint64_t, int>> states;
+   for(int i = 0; i < 5; ++i) {
+      states.push_back(capture());
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(i), [](test_element_t& elem) { elem.secondary += 100; });
+      i0.modify(i0.get(i), [](test_element_t& elem) { elem.secondary += 100; });
+      i0.modify(i0.get(i + 1), [](test_element_t& elem) { elem.secondary += 1000; });
+      i0.remove(i0.get(9 - i));
+      i0.emplace([&](test_element_t& elem) { elem.secondary = 5000 + i; });
+      session.push();
+   }
+   states.push_back(capture());
+   const int64_t first = i0.revision() - 5;
+   for(int64_t revision = first; revision <= i0.revision(); ++revision) {
+      const auto& state = states[revision - first];
+      for(uint64_t id = 0; id < 20; ++id) {
+         auto iter = state.find(id);
+         const test_element_t* elem = i0.find_at_revision(id, revision);
+         if(iter == state.end()) {
+            BOOST_TEST(elem == nullptr);
+         } else {
+            BOOST_TEST_REQUIRE(elem != nullptr);
+            BOOST_TEST(elem->id == id);
+            BOOST_TEST(elem->secondary == iter->second);
+         }
+      }
+      std::map<uint64_t, int> visited;
+      uint64_t last_id = 0;
+      i0.for_each_at_revision(revision, [&](const test_element_t& elem) {
+         BOOST_TEST((visited.empty() || elem.id > last_id));
+         last_id = elem.id;
+         visited[elem.id] = elem.secondary;
+      });
+      BOOST_TEST(visited == state);
+   }
+   BOOST_CHECK_THROW(i0.find_at_revision(0, first - 1), std::out_of_range);
+   BOOST_CHECK_THROW(i0.find_at_revision(0, i0.revision() + 1), std::out_of_range);
+}
+
+EXCEPTION_TEST_CASE(test_range_scan) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   for(int i = 0; i < 200; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = (i * 37) % 200; });
+   }
+   const auto& by_secondary = i0.get<1>();
+   for(auto [lower, upper] : { std::pair{0, 200}, std::pair{10, 15}, std::pair{50, 51}, std::pair{70, 70} }) {
+      auto first = by_secondary.lower_bound(lower);
+      auto last = by_secondary.lower_bound(upper);
+      std::vector<int> expected;
+      for(auto iter = first; iter != last; ++iter) expected.push_back(iter->secondary);
+      std::vector<int> visited;
+      by_secondary.for_each_in_range(first, last, [&](const test_element_t& elem) { visited.push_back(elem.secondary); });
+      BOOST_TEST(visited == expected);
+      visited.clear();
+      by_secondary.for_each_batch_in_range(first, last, [&](const test_element_t* const* values, std::size_t n) {
+         BOOST_TEST(n > 0u);
+         BOOST_TEST(n <= by_secondary.scan_batch_size);
+         for(std::size_t i = 0; i < n; ++i) visited.push_back(values[i]->secondary);
+      });
+      BOOST_TEST(visited == expected);
+   }
+}
+
+EXCEPTION_TEST_CASE(test_ranked_index) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ranked_unique<key<&test_element_t::secondary>>> i0;
+   auto check = [&]{
+      const auto& by_secondary = i0.get<1>();
+      std::size_t pos = 0;
+      for(auto iter = by_secondary.begin(); iter != by_secondary.end(); ++iter, ++pos) {
+         BOOST_TEST(by_secondary.rank(iter) == pos);
+         BOOST_TEST(&*by_secondary.nth(pos) == &*iter);
+      }
+      BOOST_TEST(by_secondary.rank(by_secondary.end()) == pos);
+      BOOST_TEST((by_secondary.nth(pos) == by_secondary.end()));
+      for(int lower = 0; lower < 300; lower += 37) {
+         for(int upper = lower - 40; upper < 300; upper += 53) {
+            std::size_t expected = 0;
+            for(const test_element_t& elem : by_secondary) expected += elem.secondary >= lower && elem.secondary < upper;
+            BOOST_TEST(by_secondary.count(lower, upper) == expected);
+         }
+      }
+   };
+   std::vector<int> input;
+   for(int i = 0; i < 50; ++i) input.push_back((i * 37) % 50);
+   i0.bulk_emplace(input.begin(), input.end(), [](test_element_t& elem, int v) { elem.secondary = v * 2; });
+   check();
+   {
+      auto session = i0.start_undo_session(true);
+      for(int i = 0; i < 50; i += 2) {
+         i0.modify(i0.get(i), [](test_element_t& elem) { elem.secondary += 101; });
+      }
+      for(int i = 1; i < 50; i += 7) {
+         i0.remove(i0.get(i));
+      }
+      for(int i = 0; i < 20; ++i) {
+         i0.emplace([&](test_element_t& elem) { elem.secondary = 201 + i * 3; });
+      }
+      check();
+   }
+   check();
+   BOOST_TEST(i0.get<1>().size() == 50u);
+}
+
+BOOST_DATA_TEST_CASE(test_find_batch, boost::unit_test::data::make({false, true}), dense) {
+   auto run = [](auto& i0) {
+      using element_type = typename std::decay_t<decltype(i0)>::value_type;
+      for(int i = 0; i < 100; ++i) {
+         i0.emplace([&](element_type& elem) { elem.secondary = i * 2; });
+      }
+      i0.remove(i0.get(50));
+      std::vector<uint64_t> ids;
+      std::vector<int> secondaries;
+      for(int i = 0; i < 40; ++i) {
+         ids.push_back((i * 13) % 120);
+         secondaries.push_back((i * 13) % 240);
+      }
+      std::vector<const element_type*> results;
+      i0.find_batch(ids.begin(), ids.end(), std::back_inserter(results));
+      BOOST_TEST_REQUIRE(results.size() == ids.size());
+      for(std::size_t i = 0; i < ids.size(); ++i) BOOST_TEST(results[i] == i0.find(ids[i]));
+      results.clear();
+      const auto& by_secondary = i0.template get<1>();
+      by_secondary.find_batch(secondaries.begin(), secondaries.end(), std::back_inserter(results));
+      BOOST_TEST_REQUIRE(results.size() == secondaries.size());
+      for(std::size_t i = 0; i < secondaries.size(); ++i) {
+         auto iter = by_secondary.find(secondaries[i]);
+         BOOST_TEST(results[i] == (iter == by_secondary.end() ? nullptr : &*iter));
+      }
+   };
+   if(dense) {
+      chainbase::undo_index<dense_element_t, std::allocator<dense_element_t>,
+                            boost::multi_index::ordered_unique<key<&dense_element_t::id>>,
+                            boost::multi_index::ordered_unique<key<&dense_element_t::secondary>>> i0;
+      run(i0);
+   } else {
+      chainbase::undo_index<test_element_t, std::allocator<test_element_t>,
+                            boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                            boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+      run(i0);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(test_observer) {
+   using event = std::tuple<std::string, uint64_t, int, int>;
+   observed_events.clear();
+   chainbase::undo_index<observed_element_t, std::allocator<observed_element_t>,
+                         boost::multi_index::ordered_unique<key<&observed_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&observed_element_t::secondary>>> i0;
+   i0.emplace([](observed_element_t& elem) { elem.secondary = 10; });
+   i0.emplace([](observed_element_t& elem) { elem.secondary = 20; });
+   {
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(0), [](observed_element_t& elem) { elem.secondary = 11; });
+      BOOST_CHECK_THROW(i0.modify(i0.get(0), [](observed_element_t& elem) { elem.secondary = 20; }), std::logic_error);
+      i0.remove(i0.get(1));
+      i0.emplace([](observed_element_t& elem) { elem.secondary = 30; });
+   }
+   std::vector<event> expected{
+      { "emplace", 0, 0, 10 },
+      { "emplace", 1, 0, 20 },
+      { "before_modify", 0, 10, 0 },
+      { "after_modify", 0, 0, 11 },
+      // The object was already saved in this session, so the failed modify removes it
+      { "before_modify", 0, 11, 0 },
+      { "remove", 0, 20, 0 },
+      { "remove", 1, 20, 0 },
+      { "emplace", 2, 0, 30 },
+      { "undo", 2, 30, -1 },
+      { "undo", 1, -1, 20 },
+      { "undo", 0, -1, 10 },
+   };
+   BOOST_TEST((observed_events == expected));
+
+   observed_events.clear();
+   {
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(1), [](observed_element_t& elem) { elem.secondary = 21; });
+   }
+   expected = {
+      { "before_modify", 1, 20, 0 },
+      { "after_modify", 1, 0, 21 },
+      { "undo", 1, 21, 20 },
+   };
+   BOOST_TEST((observed_events == expected));
+}
+
+EXCEPTION_TEST_CASE(test_undo_records_since) {
+   chainbase::undo_index<basic_element_t, test_allocator<basic_element_t>, boost::multi_index::ordered_unique<key<&basic_element_t::id>>> i0;
+   i0.set_revision(5);
+   i0.emplace([](basic_element_t& elem) {});
+   // No undo sessions, so there is nothing to undo after any revision
+   BOOST_TEST(i0.undo_records_since(0) == 0u);
+   BOOST_TEST(i0.undo_records_since(5) == 0u);
+   {
+      auto session = i0.start_undo_session(true);
+      i0.emplace([](basic_element_t& elem) {});
+      BOOST_TEST(i0.undo_records_since(0) == 1u);
+      BOOST_TEST(i0.undo_records_since(6) == 0u);
+      session.push();
+   }
+   i0.commit(6);
+   BOOST_TEST(i0.undo_records_since(0) == 0u);
+}
+
+EXCEPTION_TEST_CASE(test_bulk_emplace) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   std::vector<int> input;
+   for(int i = 0; i < 100; ++i) input.push_back((i * 37) % 100);
+   i0.bulk_emplace(input.begin(), input.end(), [](test_element_t& elem, int v) { elem.secondary = v; });
+   BOOST_TEST(i0.size() == 100u);
+   int expected = 0;
+   for(const auto& elem : i0.get<1>()) {
+      BOOST_TEST(elem.secondary == expected++);
+   }
+   for(int i = 0; i < 100; ++i) {
+      BOOST_TEST(i0.find(i)->secondary == input[i]);
+   }
+   // The trees must support normal operations after being built
+   for(int i = 0; i < 100; i += 3) {
+      i0.remove(i0.get(i));
+   }
+   i0.emplace([](test_element_t& elem) { elem.secondary = 1000; });
+   BOOST_TEST(i0.find(100)->secondary == 1000);
+   BOOST_TEST(i0.get<1>().size() == 67u);
+   BOOST_TEST(i0.get<1>().rbegin()->secondary == 1000);
+}
+
+BOOST_AUTO_TEST_CASE(test_bulk_emplace_fail) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   std::vector<int> input{ 3, 1, 4, 1, 5 };
+   BOOST_CHECK_THROW(i0.bulk_emplace(input.begin(), input.end(), [](test_element_t& elem, int v) { elem.secondary = v; }), std::logic_error);
+   BOOST_TEST(i0.empty());
+   BOOST_TEST(i0.get<1>().empty());
+   // ids may be raised, but must increase
+   std::vector<uint64_t> ids{ 2, 5, 9 };
+   i0.bulk_emplace(ids.begin(), ids.end(), [](test_element_t& elem, uint64_t id) { elem.id = id; elem.secondary = id; });
+   BOOST_TEST(i0.find(5)->secondary == 5);
+   BOOST_TEST(i0.emplace([](test_element_t&) {}).id == 10u);
+   BOOST_CHECK_THROW(i0.bulk_emplace(ids.begin(), ids.end(), [](test_element_t&, uint64_t) {}), std::logic_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_bulk_emplace_undo) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   std::vector<int> input(20000);
+   for(int i = 0; i < 20000; ++i) input[i] = 20000 - i;
+   {
+      auto session = i0.start_undo_session(true);
+      i0.bulk_emplace(input.begin(), input.end(), [](test_element_t& elem, int v) { elem.secondary = v; });
+      BOOST_TEST(i0.get<1>().begin()->id == 19999u);
+      BOOST_TEST(i0.get<1>().find(7)->id == 19993u);
+   }
+   BOOST_TEST(i0.empty());
+   BOOST_TEST(i0.get<1>().empty());
+}
+
+EXCEPTION_TEST_CASE(test_remove_range) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<boost::multi_index::tag<by_secondary>, key<&test_element_t::secondary>>> i0;
+   for(int i = 0; i < 10; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = 20 - i; });
+   }
+   {
+      auto undo_checker = capture_state(i0);
+      auto session = i0.start_undo_session(true);
+      i0.emplace([](test_element_t& elem) { elem.secondary = 100; });
+      BOOST_TEST(i0.remove_range<by_secondary>(13, 17) == 4u);
+      BOOST_TEST(i0.size() == 7u);
+      BOOST_TEST(i0.find(4) == nullptr);
+      BOOST_TEST(i0.find(7) == nullptr);
+      BOOST_TEST(i0.find(3)->secondary == 17);
+      BOOST_TEST(i0.find(8)->secondary == 12);
+      BOOST_TEST(i0.remove_range<0>(0, 2) == 2u);
+      BOOST_TEST(i0.remove_range<by_secondary>(100, 200) == 1u);
+      BOOST_TEST(i0.size() == 4u);
+   }
+   BOOST_TEST(i0.size() == 10u);
+   BOOST_TEST(i0.find(4)->secondary == 16);
+   BOOST_TEST(i0.find(10) == nullptr);
+}
+
+EXCEPTION_TEST_CASE(test_remove_if) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   for(int i = 0; i < 10; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   }
+   BOOST_TEST(i0.remove_if([](const test_element_t& elem) { return elem.secondary == 9; }) == 1u);
+   {
+      auto undo_checker = capture_state(i0);
+      auto session = i0.start_undo_session(true);
+      i0.emplace([](test_element_t& elem) { elem.secondary = 20; });
+      i0.modify(i0.get(2), [](test_element_t& elem) { elem.secondary = 21; });
+      BOOST_TEST(i0.remove_if([](const test_element_t& elem) { return elem.secondary % 2 == 0; }) == 5u);
+      BOOST_TEST(i0.size() == 5u);
+      BOOST_TEST(i0.get<1>().begin()->secondary == 1);
+      BOOST_TEST(i0.get<1>().rbegin()->secondary == 21);
+   }
+   BOOST_TEST(i0.size() == 9u);
+   BOOST_TEST(i0.find(2)->secondary == 2);
+   BOOST_TEST(i0.find(9) == nullptr);
+}
+
+EXCEPTION_TEST_CASE(test_deferred_disposal) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   i0.set_deferred_disposal(true);
+   for(int i = 0; i < 10; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   }
+   for(int i = 0; i < 3; ++i) {
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(0), [&](test_element_t& elem) { elem.secondary = 10 + i; });
+      i0.remove(i0.get(9 - i));
+      session.push();
+   }
+   i0.commit(i0.revision());
+   BOOST_TEST(!i0.has_undo_session());
+   // One value from each list is kept as the reclaim position.
+   BOOST_TEST(i0.has_pending_reclamation());
+   BOOST_TEST(i0.reclaim(3) == 3u);
+   BOOST_TEST(i0.has_pending_reclamation());
+   BOOST_TEST(i0.reclaim(100) == 1u);
+   BOOST_TEST(!i0.has_pending_reclamation());
+   {
+      auto undo_checker = capture_state(i0);
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(1), [](test_element_t& elem) { elem.secondary = 20; });
+      i0.remove(i0.get(2));
+   }
+   for(int i = 0; i < 3; ++i) {
+      auto session = i0.start_undo_session(true);
+      i0.modify(i0.get(1), [&](test_element_t& elem) { elem.secondary = 30 + i; });
+      i0.remove(i0.get(2 + i));
+      session.push();
+   }
+   i0.commit(i0.revision() - 1);
+   BOOST_TEST(i0.has_pending_reclamation());
+   BOOST_TEST(i0.reclaim(100) == 4u);
+   BOOST_TEST(!i0.has_pending_reclamation());
+   BOOST_TEST(i0.find(1)->secondary == 32);
+   i0.undo();
+   BOOST_TEST(i0.find(1)->secondary == 31);
+   BOOST_TEST(i0.find(4)->secondary == 4);
+   BOOST_TEST(i0.find(3) == nullptr);
+}
+
+EXCEPTION_TEST_CASE(test_modify_each) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   for(int i = 0; i < 5; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   }
+   {
+      auto undo_checker = capture_state(i0);
+      auto session = i0.start_undo_session(true);
+      // rotate the keys of the first three elements
+      std::vector<std::reference_wrapper<const test_element_t>> elements{ i0.get(0), i0.get(1), i0.get(2) };
+      i0.modify_each(elements.begin(), elements.end(), [](test_element_t& elem) { elem.secondary = (elem.secondary + 1) % 3; });
+      BOOST_TEST(i0.find(0)->secondary == 1);
+      BOOST_TEST(i0.find(2)->secondary == 0);
+      BOOST_TEST(i0.get<1>().begin()->id == 2u);
+      elements = { i0.get(3), i0.get(4) };
+      BOOST_CHECK_THROW(i0.modify_each(elements.begin(), elements.end(), [](test_element_t& elem) { elem.secondary = 0; }), std::logic_error);
+      BOOST_TEST(i0.find(3)->secondary == 3);
+      BOOST_TEST(i0.find(4)->secondary == 4);
+   }
+   {
+      auto undo_checker = capture_state(i0);
+      auto session = i0.start_undo_session(true);
+      BOOST_TEST(i0.emplace([](test_element_t& elem) { elem.id = 10; elem.secondary = 10; }).id == 10u);
+      BOOST_TEST(i0.emplace([](test_element_t& elem) { elem.secondary = 11; }).id == 11u);
+      BOOST_CHECK_THROW(i0.emplace([](test_element_t& elem) { elem.id = 4; elem.secondary = 12; }), std::logic_error);
+   }
+   BOOST_TEST(i0.emplace([](test_element_t& elem) { elem.secondary = 5; }).id == 5u);
+}
+
+BOOST_AUTO_TEST_CASE(test_delta_between) {
+   chainbase::undo_index<test_element_t, std::allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   using state_t = std::map<uint64_t, int>;
+   auto current_state = [&]{
+      state_t result;
+      for(const auto& elem : i0) result[elem.id] = elem.secondary;
+      return result;
+   };
+   int next_value = 0;
+   for(int i = 0; i < 10; ++i) {
+      i0.emplace([&](test_element_t& elem) { elem.secondary = next_value++; });
+   }
+   std::vector<state_t> states;
+   uint32_t seed = 1;
+   auto random_element = [&]() -> const test_element_t& {
+      seed = seed * 1103515245 + 12345;
+      auto iter = i0.begin();
+      std::advance(iter, (seed >> 16) % i0.size());
+      return *iter;
+   };
+   for(int session_number = 0; session_number < 8; ++session_number) {
+      states.push_back(current_state());
+      i0.start_undo_session(true).push();
+      for(int j = 0; j < 3; ++j) {
+         i0.modify(random_element(), [&](test_element_t& elem) { elem.secondary = next_value++; });
+      }
+      i0.emplace([&](test_element_t& elem) { elem.secondary = next_value++; });
+      i0.remove(random_element());
+      if(session_number % 3 == 1) {
+         i0.squash();
+         states.pop_back();
+      }
+      if(session_number == 4) i0.last_undo_session();
+   }
+   states.push_back(current_state());
+   auto [first, last] = i0.undo_stack_revision_range();
+   BOOST_TEST(states.size() == static_cast<std::size_t>(last - first + 1));
+   for(int64_t from = first; from <= last; ++from) {
+      for(int64_t to = from; to <= last; ++to) {
+         const state_t& before = states[from - first];
+         const state_t& after = states[to - first];
+         auto delta = i0.delta_between(from, to);
+         std::vector<std::pair<uint64_t, int>> created, removed;
+         std::vector<std::tuple<uint64_t, int, int>> modified;
+         for(const auto* v : delta.created) created.emplace_back(v->id, v->secondary);
+         for(const auto& [old_value, new_value] : delta.modified) {
+            BOOST_TEST(old_value->id == new_value->id);
+            modified.emplace_back(old_value->id, old_value->secondary, new_value->secondary);
+         }
+         for(const auto* v : delta.removed) removed.emplace_back(v->id, v->secondary);
+         std::vector<std::pair<uint64_t, int>> expected_created, expected_removed;
+         std::vector<std::tuple<uint64_t, int, int>> expected_modified;
+         for(const auto& [id, value] : after) {
+            auto pos = before.find(id);
+            if(pos == before.end()) expected_created.emplace_back(id, value);
+            else if(pos->second != value) expected_modified.emplace_back(id, pos->second, value);
+         }
+         for(const auto& [id, value] : before) {
+            if(after.count(id) == 0) expected_removed.emplace_back(id, value);
+         }
+         BOOST_TEST((created == expected_created));
+         BOOST_TEST((modified == expected_modified));
+         BOOST_TEST((removed == expected_removed));
+      }
+   }
+   BOOST_CHECK_THROW(i0.delta_between(first - 1, last), std::out_of_range);
+   BOOST_CHECK_THROW(i0.delta_between(last, first), std::out_of_range);
+   BOOST_TEST(i0.undo_stack_revision_range().first == first);
+   BOOST_TEST(i0.undo_stack_revision_range().second == last);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,241 @@
+// Reports how the memory of a database file is used, without the types of the application.
+//
+// The file is opened read-only.  The segment is walked block by block to build a histogram of
+// the free blocks, and the named objects are listed with their sizes.  Every index of the
+// database is a named object that ends with an undo_index_footer, from which the row count,
+// node size and undo history of the index are read.  The footers are refreshed when the
+// database is closed, so they are stale if the dirty flag of the file is set.
+
+#include <chainbase/environment.hpp>
+#include <chainbase/pinnable_mapped_file.hpp>
+#include <chainbase/undo_index.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace chainbase;
+
+namespace {
+
+using segment_manager = pinnable_mapped_file::segment_manager;
+using memory_algorithm = segment_manager::memory_algorithm;
+
+// Mirrors the block header of boost::interprocess::rbtree_best_fit, which is private.  Sizes
+// are in units of memory_algorithm::Alignment.
+struct block_header {
+   std::size_t prev_size;
+   std::size_t size           : sizeof( std::size_t ) * 8 - 2;
+   std::size_t prev_allocated : 1;
+   std::size_t allocated      : 1;
+};
+
+struct free_blocks {
+   bool                  valid = false;
+   uint64_t              count = 0;
+   uint64_t              bytes = 0;
+   uint64_t              largest = 0;
+   uint64_t              allocated_blocks = 0;
+   // Bucket i counts the free blocks of at least 2^i and less than 2^(i+1) bytes
+   std::vector<uint64_t> histogram_count = std::vector<uint64_t>( 64 );
+   std::vector<uint64_t> histogram_bytes = std::vector<uint64_t>( 64 );
+};
+
+// Walks the blocks of the segment from the first to the end block.  Returns an invalid result
+// if the blocks are not laid out as expected, e.g. with a different version of boost.
+free_blocks walk_segment( const segment_manager& segment ) {
+   free_blocks result;
+   // The memory algorithm is a private base of the segment manager, which a C-style cast may convert to
+   const char* base = reinterpret_cast<const char*>( (const memory_algorithm*)&segment );
+   const std::size_t alignment = memory_algorithm::Alignment;
+   const std::size_t end_block_bytes = ( sizeof( block_header ) + alignment - 1 ) / alignment * alignment;
+   const char* end = base + segment.get_size() / alignment * alignment - end_block_bytes;
+   const block_header* end_block = reinterpret_cast<const block_header*>( end );
+   if( !end_block->allocated || end_block->size * alignment > std::size_t( end - base ) ) return result;
+   const char* pos = end - end_block->size * alignment;
+   if( reinterpret_cast<const block_header*>( pos )->prev_size != end_block->size ) return result;
+   while( pos != end ) {
+      const block_header* block = reinterpret_cast<const block_header*>( pos );
+      const uint64_t bytes = uint64_t( block->size ) * alignment;
+      if( bytes == 0 || bytes > std::size_t( end - pos ) ) return result;
+      if( block->allocated ) {
+         ++result.allocated_blocks;
+      } else {
+         ++result.count;
+         result.bytes += bytes;
+         result.largest = std::max( result.largest, bytes );
+         unsigned bucket = 63 - __builtin_clzll( bytes );
+         ++result.histogram_count[bucket];
+         result.histogram_bytes[bucket] += bytes;
+      }
+      pos += bytes;
+   }
+   result.valid = true;
+   return result;
+}
+
+struct named_object {
+   std::string name;
+   bool        unique;
+   uint64_t    bytes;
+   bool        is_index = false;
+   undo_index_footer footer;
+};
+
+template<typename Iterator>
+void collect_objects( Iterator begin, Iterator end, bool unique, std::vector<named_object>& out ) {
+   for( auto itr = begin; itr != end; ++itr ) {
+      named_object obj{ std::string( itr->name(), itr->name_length() ), unique, itr->m_val->get_block_header()->value_bytes() };
+      if( obj.bytes >= sizeof( undo_index_footer ) ) {
+         std::memcpy( &obj.footer, static_cast<const char*>( itr->value() ) + obj.bytes - sizeof( undo_index_footer ), sizeof( undo_index_footer ) );
+         obj.is_index = obj.footer.magic == undo_index_footer::magic_value && obj.footer.size_of_this == obj.bytes;
+      }
+      out.push_back( std::move( obj ) );
+   }
+}
+
+std::string json_string( const std::string& s ) {
+   std::string result = "\"";
+   for( char c : s ) {
+      if( c == '"' || c == '\\' ) result += '\\';
+      result += c;
+   }
+   return result + "\"";
+}
+
+void report_text( const bfs::path& file, bool dirty, const segment_manager& segment, const free_blocks& blocks,
+                  const std::vector<named_object>& objects ) {
+   const uint64_t size = segment.get_size();
+   const uint64_t free = segment.get_free_memory();
+   std::cout << "file:            " << file.string() << ( dirty ? " (dirty, the index summaries may be stale)" : "" ) << "\n"
+             << "segment size:    " << size << "\n"
+             << "used:            " << size - free << "\n"
+             << "free:            " << free << std::fixed << std::setprecision( 1 ) << " (" << 100.0 * free / size << "%)\n";
+   if( blocks.valid ) {
+      std::cout << "allocated blocks: " << blocks.allocated_blocks << "\n"
+                << "free blocks:     " << blocks.count << ", largest " << blocks.largest;
+      if( blocks.bytes ) std::cout << ", fragmentation " << std::setprecision( 3 ) << 1 - double( blocks.largest ) / blocks.bytes;
+      std::cout << "\n\n" << std::left << std::setw( 24 ) << "free block size" << std::right << std::setw( 14 ) << "count" << std::setw( 20 ) << "bytes" << "\n";
+      for( unsigned i = 0; i < 64; ++i ) {
+         if( !blocks.histogram_count[i] ) continue;
+         std::string range = "[" + std::to_string( uint64_t( 1 ) << i ) + ", " + std::to_string( ( uint64_t( 1 ) << i ) * 2 ) + ")";
+         std::cout << std::left << std::setw( 24 ) << range << std::right << std::setw( 14 ) << blocks.histogram_count[i]
+                   << std::setw( 20 ) << blocks.histogram_bytes[i] << "\n";
+      }
+   } else {
+      std::cout << "free blocks:     unknown, the segment does not have the expected block layout\n";
+   }
+
+   std::cout << "\n" << std::left << std::setw( 48 ) << "named object" << std::right << std::setw( 12 ) << "bytes" << "\n";
+   for( const named_object& obj : objects )
+      std::cout << std::left << std::setw( 48 ) << obj.name + ( obj.unique ? " (unique)" : "" ) << std::right << std::setw( 12 ) << obj.bytes << "\n";
+
+   std::cout << "\n" << std::left << std::setw( 48 ) << "index" << std::right << std::setw( 12 ) << "rows" << std::setw( 8 ) << "node"
+             << std::setw( 16 ) << "node bytes" << std::setw( 12 ) << "revision" << std::setw( 10 ) << "sessions" << std::setw( 10 ) << "spilled"
+             << std::setw( 14 ) << "undo records" << std::setw( 16 ) << "undo bytes" << "\n";
+   for( const named_object& obj : objects ) {
+      if( !obj.is_index ) continue;
+      const undo_index_footer& f = obj.footer;
+      std::cout << std::left << std::setw( 48 ) << obj.name << std::right << std::setw( 12 ) << f.row_count << std::setw( 8 ) << f.size_of_value_type
+                << std::setw( 16 ) << f.row_count * f.size_of_value_type << std::setw( 12 ) << f.revision << std::setw( 10 ) << f.undo_sessions
+                << std::setw( 10 ) << f.spilled_sessions << std::setw( 14 ) << f.undo_records << std::setw( 16 ) << f.undo_bytes << "\n";
+   }
+}
+
+void report_json( const bfs::path& file, bool dirty, const segment_manager& segment, const free_blocks& blocks,
+                  const std::vector<named_object>& objects ) {
+   std::cout << "{\"file\":" << json_string( file.string() ) << ",\"dirty\":" << ( dirty ? "true" : "false" )
+             << ",\"segment_size\":" << segment.get_size() << ",\"free\":" << segment.get_free_memory();
+   if( blocks.valid ) {
+      std::cout << ",\"allocated_blocks\":" << blocks.allocated_blocks << ",\"free_blocks\":{\"count\":" << blocks.count
+                << ",\"bytes\":" << blocks.bytes << ",\"largest\":" << blocks.largest << ",\"histogram\":[";
+      bool first = true;
+      for( unsigned i = 0; i < 64; ++i ) {
+         if( !blocks.histogram_count[i] ) continue;
+         std::cout << ( first ? "" : "," ) << "{\"min_size\":" << ( uint64_t( 1 ) << i ) << ",\"count\":" << blocks.histogram_count[i]
+                   << ",\"bytes\":" << blocks.histogram_bytes[i] << "}";
+         first = false;
+      }
+      std::cout << "]}";
+   }
+   std::cout << ",\"objects\":[";
+   for( std::size_t i = 0; i < objects.size(); ++i ) {
+      const named_object& obj = objects[i];
+      std::cout << ( i ? "," : "" ) << "{\"name\":" << json_string( obj.name ) << ",\"unique\":" << ( obj.unique ? "true" : "false" )
+                << ",\"bytes\":" << obj.bytes;
+      if( obj.is_index ) {
+         const undo_index_footer& f = obj.footer;
+         std::cout << ",\"index\":{\"rows\":" << f.row_count << ",\"node_size\":" << f.size_of_value_type << ",\"indices\":" << f.index_count
+                   << ",\"next_id\":" << f.next_id << ",\"revision\":" << f.revision << ",\"undo_sessions\":" << f.undo_sessions
+                   << ",\"spilled_sessions\":" << f.spilled_sessions << ",\"undo_records\":" << f.undo_records
+                   << ",\"undo_bytes\":" << f.undo_bytes << "}";
+      }
+      std::cout << "}";
+   }
+   std::cout << "]}\n";
+}
+
+void usage( const char* name ) {
+   std::cerr << "usage: " << name << " [options] DIR\n"
+             << "  DIR                        the directory holding shared_memory.bin\n"
+             << "  --format text|json         output format (default text)\n";
+}
+
+}
+
+int main( int argc, char** argv ) {
+   bfs::path dir;
+   bool json = false;
+   try {
+      for( int i = 1; i < argc; ++i ) {
+         std::string arg = argv[i];
+         if( arg == "--help" || arg == "-h" ) {
+            usage( argv[0] );
+            return 0;
+         }
+         if( arg.rfind( "--", 0 ) != 0 ) {
+            dir = arg;
+            continue;
+         }
+         if( i + 1 >= argc ) throw std::invalid_argument( "missing value for " + arg );
+         std::string value = argv[++i];
+         if( arg == "--format" ) {
+            if( value != "text" && value != "json" ) throw std::invalid_argument( "unknown format " + value );
+            json = value == "json";
+         }
+         else throw std::invalid_argument( "unknown option " + arg );
+      }
+      if( dir.empty() ) throw std::invalid_argument( "no database directory given" );
+   } catch( const std::exception& e ) {
+      std::cerr << e.what() << "\n";
+      usage( argv[0] );
+      return 2;
+   }
+
+   try {
+      const bfs::path file = dir / "shared_memory.bin";
+      db_header header;
+      std::ifstream in( file.generic_string(), std::ifstream::binary );
+      if( !in.read( reinterpret_cast<char*>( &header ), sizeof( header ) ) )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "unable to read the header of " + file.string() ) );
+      in.close();
+
+      pinnable_mapped_file db_file( dir, false, 0, true, pinnable_mapped_file::mapped, {} );
+      const segment_manager& segment = *db_file.get_segment_manager();
+      free_blocks blocks = walk_segment( segment );
+      std::vector<named_object> objects;
+      collect_objects( segment.named_begin(), segment.named_end(), false, objects );
+      collect_objects( segment.unique_begin(), segment.unique_end(), true, objects );
+
+      if( json ) report_json( file, header.dirty, segment, blocks, objects );
+      else report_text( file, header.dirty, segment, blocks, objects );
+   } catch( const std::exception& e ) {
+      std::cerr << e.what() << "\n";
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,420 @@
+// Replays a trace recorded by database::start_trace against a fresh database.
+//
+// The objects of the traced database are not part of the trace, so every traced index is
+// replaced by a table of objects of the same size class, with an id, one secondary key and a
+// payload.  Types of the same size class share a table.  The rows that an index held when the
+// trace started are created before the replay, and the ids that the trace refers to are
+// mapped to replay objects as they are first seen.  Modifies that changed a secondary key in
+// the trace change the key of the replay object.
+//
+// Each operation is timed on its own, and the throughput and latency percentiles of each kind
+// of operation are reported.
+
+#include <chainbase/chainbase.hpp>
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace chainbase;
+using namespace boost::multi_index;
+
+namespace {
+
+struct by_key;
+
+template<uint16_t TypeId, std::size_t PayloadSize>
+struct replay_object : public chainbase::object<TypeId, replay_object<TypeId, PayloadSize>> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( replay_object )
+
+   typename chainbase::object<TypeId, replay_object>::id_type id;
+   uint64_t key = 0;
+   char     payload[PayloadSize];
+};
+
+template<uint16_t TypeId, std::size_t PayloadSize>
+using replay_index = multi_index_container<
+   replay_object<TypeId, PayloadSize>,
+   indexed_by<
+      ordered_unique< member<replay_object<TypeId, PayloadSize>, typename replay_object<TypeId, PayloadSize>::id_type, &replay_object<TypeId, PayloadSize>::id> >,
+      ordered_unique< tag<by_key>, member<replay_object<TypeId, PayloadSize>, uint64_t, &replay_object<TypeId, PayloadSize>::key> >
+   >,
+   chainbase::node_allocator<replay_object<TypeId, PayloadSize>>
+>;
+
+}
+
+namespace chainbase {
+   template<uint16_t TypeId, std::size_t PayloadSize>
+   struct get_index_type<replay_object<TypeId, PayloadSize>> { typedef replay_index<TypeId, PayloadSize> type; };
+}
+
+namespace {
+
+// The operations on one replay table.  Each returns false if the object does not exist.
+class replay_table {
+   public:
+      virtual ~replay_table() {}
+      virtual uint64_t create( uint64_t key ) = 0;
+      virtual bool     modify( uint64_t id, const uint64_t* new_key ) = 0;
+      virtual bool     remove( uint64_t id ) = 0;
+      virtual bool     find( uint64_t id ) = 0;
+      virtual bool     find_by_key( uint64_t key ) = 0;
+      virtual uint64_t key_of( uint64_t id ) = 0;
+};
+
+// Keeps the results of lookups alive, so that the compiler cannot drop them
+volatile uint64_t sink;
+
+template<uint16_t TypeId, std::size_t ValueSize>
+class table_impl : public replay_table {
+   public:
+      // The payload makes the object as large as the traced object
+      static constexpr std::size_t payload_size = ValueSize - 2 * sizeof( uint64_t );
+      using object_type = replay_object<TypeId, payload_size>;
+      using index_type = replay_index<TypeId, payload_size>;
+      using id_type = typename object_type::id_type;
+
+      explicit table_impl( database& db ):_db( db ) { _db.add_index<index_type>(); }
+
+      uint64_t create( uint64_t key ) override {
+         return _db.create<object_type>( [&]( object_type& obj ) {
+            obj.key = key;
+            std::memset( obj.payload, 0, sizeof( obj.payload ) );
+         } ).id._id;
+      }
+      bool modify( uint64_t id, const uint64_t* new_key ) override {
+         const object_type* obj = _db.find<object_type>( id_type( id ) );
+         if( !obj ) return false;
+         _db.modify( *obj, [&]( object_type& o ) {
+            if( new_key ) o.key = *new_key;
+            ++o.payload[0];
+         } );
+         return true;
+      }
+      bool remove( uint64_t id ) override {
+         const object_type* obj = _db.find<object_type>( id_type( id ) );
+         if( !obj ) return false;
+         _db.remove( *obj );
+         return true;
+      }
+      bool find( uint64_t id ) override {
+         const object_type* obj = _db.find<object_type>( id_type( id ) );
+         if( obj ) sink = obj->key;
+         return obj != nullptr;
+      }
+      bool find_by_key( uint64_t key ) override {
+         const object_type* obj = _db.find<object_type, by_key>( key );
+         if( obj ) sink = obj->id._id;
+         return obj != nullptr;
+      }
+      uint64_t key_of( uint64_t id ) override {
+         const object_type* obj = _db.find<object_type>( id_type( id ) );
+         return obj ? obj->key : 0;
+      }
+
+   private:
+      database& _db;
+};
+
+// Traced objects are rounded up to one of these sizes
+constexpr std::size_t size_classes[] = { 32, 64, 128, 256, 512, 1024, 4096 };
+constexpr std::size_t size_class_count = sizeof( size_classes ) / sizeof( size_classes[0] );
+
+template<std::size_t... I>
+std::vector<std::unique_ptr<replay_table>> make_tables( database& db, std::index_sequence<I...> ) {
+   std::vector<std::unique_ptr<replay_table>> result;
+   ( result.emplace_back( new table_impl<I, size_classes[I]>( db ) ), ... );
+   return result;
+}
+
+std::size_t size_class_of( uint64_t value_size ) {
+   for( std::size_t i = 0; i < size_class_count; ++i ) {
+      if( value_size <= size_classes[i] ) return i;
+   }
+   return size_class_count - 1;
+}
+
+const char* to_string( pinnable_mapped_file::map_mode mode ) {
+   switch( mode ) {
+      case pinnable_mapped_file::mapped: return "mapped";
+      case pinnable_mapped_file::heap:   return "heap";
+      case pinnable_mapped_file::locked: return "locked";
+   }
+   return "unknown";
+}
+
+const char* to_string( trace_op op ) {
+   switch( op ) {
+      case trace_op::add_index:     return "add_index";
+      case trace_op::start_session: return "start_session";
+      case trace_op::undo:          return "undo";
+      case trace_op::squash:        return "squash";
+      case trace_op::commit:        return "commit";
+      case trace_op::undo_all:      return "undo_all";
+      case trace_op::create:        return "create";
+      case trace_op::modify:        return "modify";
+      case trace_op::remove:        return "remove";
+      case trace_op::find:          return "find";
+      case trace_op::find_by_key:   return "find_by_key";
+   }
+   return "unknown";
+}
+
+// Removes a directory once the database inside it has been closed
+struct temp_directory {
+   bfs::path path;
+   ~temp_directory() { bfs::remove_all( path ); }
+};
+
+class replayer {
+   public:
+      replayer( const bfs::path& dir, uint64_t size, pinnable_mapped_file::map_mode mode, int64_t revision )
+         : _dir{ dir / bfs::unique_path( "chainbase-replay-%%%%-%%%%-%%%%" ) },
+           _db( _dir.path, database::read_write, size, false, mode ),
+           _tables( make_tables( _db, std::make_index_sequence<size_class_count>{} ) )
+      {
+         if( revision > 0 ) _db.set_revision( revision );
+      }
+
+      void apply( const trace_event& event ) {
+         switch( event.op ) {
+            case trace_op::add_index:     return add_index( event );
+            case trace_op::start_session: return timed( event.op, [&] { _db.start_undo_session( true ).push(); } );
+            case trace_op::undo:
+               if( !has_session() ) return skip();
+               return timed( event.op, [&] { _db.undo(); } );
+            case trace_op::squash:
+               if( !has_session() ) return skip();
+               return timed( event.op, [&] { _db.squash(); } );
+            case trace_op::commit:        return timed( event.op, [&] { _db.commit( event.value ); } );
+            case trace_op::undo_all:      return timed( event.op, [&] { _db.undo_all(); } );
+            case trace_op::create: {
+               type_state& type = type_of( event );
+               uint64_t key = _next_key++;
+               uint64_t id = 0;
+               timed( event.op, [&] { id = table_of( type ).create( key ); } );
+               type.ids[event.id] = id;
+               return;
+            }
+            case trace_op::modify: {
+               type_state& type = type_of( event );
+               const uint64_t* id = map_id( type, event.id );
+               if( !id ) return skip();
+               uint64_t key = _next_key;
+               // Only the first secondary key of the trace is reproduced
+               bool changes_key = event.value & ~uint64_t( 1 );
+               if( changes_key ) ++_next_key;
+               bool found = false;
+               timed( event.op, [&] { found = table_of( type ).modify( *id, changes_key ? &key : nullptr ); } );
+               if( !found ) skip();
+               return;
+            }
+            case trace_op::remove: {
+               type_state& type = type_of( event );
+               const uint64_t* id = map_id( type, event.id );
+               if( !id ) return skip();
+               bool found = false;
+               timed( event.op, [&] { found = table_of( type ).remove( *id ); } );
+               if( !found ) skip();
+               // The object may come back through undo
+               return;
+            }
+            case trace_op::find:
+            case trace_op::find_by_key: {
+               type_state& type = type_of( event );
+               // Misses are replayed as lookups of an id that does not exist
+               uint64_t missing = ~uint64_t( 0 ) >> 1;
+               const uint64_t* id = event.id ? map_id( type, event.id - 1 ) : &missing;
+               if( !id ) return skip();
+               replay_table& table = table_of( type );
+               if( event.op == trace_op::find ) {
+                  timed( event.op, [&] { table.find( *id ); } );
+               } else {
+                  uint64_t key = event.id ? table.key_of( *id ) : missing;
+                  timed( event.op, [&] { table.find_by_key( key ); } );
+               }
+               return;
+            }
+         }
+      }
+
+      void report( std::ostream& out, bool json, pinnable_mapped_file::map_mode mode )const {
+         uint64_t total_ops = 0;
+         std::chrono::nanoseconds total_time{ 0 };
+         for( const auto& [op, h] : _ops ) {
+            latency_stats stats = h->snapshot();
+            total_ops += stats.count;
+            total_time += std::chrono::nanoseconds( stats.total_ns );
+         }
+         double ops_per_sec = total_time.count() ? total_ops * 1e9 / total_time.count() : 0;
+         if( json ) {
+            out << "{\"map_mode\":\"" << to_string( mode ) << "\",\"ops\":" << total_ops << ",\"skipped\":" << _skipped
+                << ",\"ops_per_sec\":" << ops_per_sec << ",\"operations\":{";
+            bool first = true;
+            for( const auto& [op, h] : _ops ) {
+               latency_stats stats = h->snapshot();
+               out << ( first ? "" : "," ) << "\"" << to_string( op ) << "\":{\"count\":" << stats.count << ",\"mean_ns\":" << stats.mean_ns()
+                   << ",\"p50_ns\":" << stats.percentile( 0.5 ) << ",\"p90_ns\":" << stats.percentile( 0.9 )
+                   << ",\"p99_ns\":" << stats.percentile( 0.99 ) << ",\"p999_ns\":" << stats.percentile( 0.999 )
+                   << ",\"max_ns\":" << stats.max_ns << "}";
+               first = false;
+            }
+            out << "}}\n";
+            return;
+         }
+         out << "map mode " << to_string( mode ) << ": " << total_ops << " operations, " << std::fixed << std::setprecision( 0 )
+             << ops_per_sec << " ops/s, " << _skipped << " skipped\n";
+         out << std::left << std::setw( 16 ) << "operation" << std::right << std::setw( 12 ) << "count" << std::setw( 12 ) << "mean ns"
+             << std::setw( 12 ) << "p50 ns" << std::setw( 12 ) << "p90 ns" << std::setw( 12 ) << "p99 ns"
+             << std::setw( 12 ) << "p99.9 ns" << std::setw( 12 ) << "max ns" << "\n";
+         for( const auto& [op, h] : _ops ) {
+            latency_stats stats = h->snapshot();
+            out << std::left << std::setw( 16 ) << to_string( op ) << std::right << std::setw( 12 ) << stats.count
+                << std::setw( 12 ) << std::setprecision( 1 ) << stats.mean_ns() << std::setw( 12 ) << stats.percentile( 0.5 )
+                << std::setw( 12 ) << stats.percentile( 0.9 ) << std::setw( 12 ) << stats.percentile( 0.99 )
+                << std::setw( 12 ) << stats.percentile( 0.999 ) << std::setw( 12 ) << stats.max_ns << "\n";
+         }
+      }
+
+   private:
+      struct type_state {
+         std::size_t                            size_class = 0;
+         // Replay ids of the traced ids seen so far
+         std::unordered_map<uint64_t, uint64_t> ids;
+         // Rows created before the replay that no traced id has been mapped to yet
+         std::vector<uint64_t>                  unmapped;
+      };
+
+      template<typename F>
+      void timed( trace_op op, F&& f ) {
+         auto& h = _ops[op];
+         if( !h ) h.reset( new latency_histogram );
+         scoped_op_timer timer( *h );
+         f();
+      }
+
+      void skip() { ++_skipped; }
+
+      bool has_session()const {
+         auto [first, last] = _db.undo_stack_revision_range();
+         return last > first;
+      }
+
+      void add_index( const trace_event& event ) {
+         type_state& type = _types[event.type_id];
+         type.size_class = size_class_of( event.value );
+         replay_table& table = table_of( type );
+         for( uint64_t i = 0; i < event.rows; ++i ) type.unmapped.push_back( table.create( _next_key++ ) );
+      }
+
+      type_state& type_of( const trace_event& event ) {
+         auto iter = _types.find( event.type_id );
+         if( iter == _types.end() )
+            throw std::runtime_error( "trace uses type " + std::to_string( event.type_id ) + " before adding its index" );
+         return iter->second;
+      }
+
+      replay_table& table_of( const type_state& type ) { return *_tables[type.size_class]; }
+
+      // Returns the replay id of a traced id, or nullptr if the trace refers to an object that
+      // is neither in the initial rows nor created by the trace
+      const uint64_t* map_id( type_state& type, uint64_t traced_id ) {
+         auto iter = type.ids.find( traced_id );
+         if( iter != type.ids.end() ) return &iter->second;
+         if( type.unmapped.empty() ) return nullptr;
+         iter = type.ids.emplace( traced_id, type.unmapped.back() ).first;
+         type.unmapped.pop_back();
+         return &iter->second;
+      }
+
+      temp_directory                                          _dir;
+      database                                                _db;
+      std::vector<std::unique_ptr<replay_table>>              _tables;
+      std::map<uint32_t, type_state>                          _types;
+      std::map<trace_op, std::unique_ptr<latency_histogram>>  _ops;
+      uint64_t                                                _next_key = 0;
+      uint64_t                                                _skipped = 0;
+};
+
+void usage( const char* name ) {
+   std::cerr << "usage: " << name << " [options] TRACE\n"
+             << "  --map-mode M[,M...]   mapped, heap or locked (default mapped)\n"
+             << "  --db-size MIB         size of the replay database in MiB (default 1024)\n"
+             << "  --dir PATH            directory for the replay database (default the system temp directory)\n"
+             << "  --format text|json    output format (default text)\n";
+}
+
+pinnable_mapped_file::map_mode parse_map_mode( const std::string& name ) {
+   if( name == "mapped" ) return pinnable_mapped_file::mapped;
+   if( name == "heap" ) return pinnable_mapped_file::heap;
+   if( name == "locked" ) return pinnable_mapped_file::locked;
+   throw std::invalid_argument( "unknown map mode " + name );
+}
+
+}
+
+int main( int argc, char** argv ) {
+   std::vector<pinnable_mapped_file::map_mode> modes = { pinnable_mapped_file::mapped };
+   uint64_t db_size = 1024;
+   bfs::path dir = bfs::temp_directory_path();
+   bool json = false;
+   bfs::path trace;
+   try {
+      for( int i = 1; i < argc; ++i ) {
+         std::string arg = argv[i];
+         if( arg == "--help" || arg == "-h" ) {
+            usage( argv[0] );
+            return 0;
+         }
+         if( arg.rfind( "--", 0 ) != 0 ) {
+            trace = arg;
+            continue;
+         }
+         if( i + 1 >= argc ) throw std::invalid_argument( "missing value for " + arg );
+         std::string value = argv[++i];
+         if( arg == "--map-mode" ) {
+            modes.clear();
+            std::stringstream in( value );
+            for( std::string item; std::getline( in, item, ',' ); ) modes.push_back( parse_map_mode( item ) );
+         }
+         else if( arg == "--db-size" ) db_size = std::stoull( value );
+         else if( arg == "--dir" ) dir = value;
+         else if( arg == "--format" ) {
+            if( value != "text" && value != "json" ) throw std::invalid_argument( "unknown format " + value );
+            json = value == "json";
+         }
+         else throw std::invalid_argument( "unknown option " + arg );
+      }
+      if( trace.empty() ) throw std::invalid_argument( "no trace given" );
+   } catch( const std::exception& e ) {
+      std::cerr << e.what() << "\n";
+      usage( argv[0] );
+      return 2;
+   }
+
+   try {
+      for( auto mode : modes ) {
+         trace_reader reader( trace );
+         replayer r( dir, db_size * 1024 * 1024, mode, reader.revision() );
+         for( trace_event event; reader.next( event ); ) r.apply( event );
+         r.report( std::cout, json, mode );
+      }
+   } catch( const std::exception& e ) {
+      std::cerr << e.what() << "\n";
+      return 1;
+   }
+   return 0;
+}